@@ -0,0 +1,292 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <semaphore.h>
+#include "json-app.h"
+
+/* hand-off between the main loop and the apply worker.
+ *
+ * a bounded single-producer/single-consumer ring. the main loop is the
+ * only producer and never blocks: when the ring is full, messages go to a
+ * small set of per-topic overflow slots where a newer message simply
+ * replaces the older one for the same topic. while any overflow slot is in
+ * use nothing new goes into the ring, so a topic can never have an older
+ * message waiting behind a newer one that was already taken.
+ *
+ * the worker takes everything that is pending in one go, restores producer
+ * order and coalesces it: of several messages for the same topic only the
+ * newest is applied, the superseded ones are dropped unseen. */
+struct jsonapp_queue {
+        struct jsonapp_msg **ring;
+        unsigned int depth;
+        atomic_uint head;
+        atomic_uint tail;
+        struct jsonapp_msg *_Atomic overflow[JSONAPP_QUEUE_OVERFLOW];
+        atomic_bool closed;
+        atomic_uint coalesced;
+        atomic_uint dropped;
+        sem_t wakeup;
+        /* producer private */
+        unsigned long seq;
+        char *overflow_topic[JSONAPP_QUEUE_OVERFLOW];
+};
+
+struct jsonapp_msg *jsonapp_msg_new(const char *topic, const void *payload, int payloadlen)
+{
+        struct jsonapp_msg *msg;
+
+        if (!(msg = calloc(1, sizeof *msg)))
+                return NULL;
+        if (!(msg->topic = strdup(topic)) || jsonapp_msg_append(msg, payload, payloadlen) != 0) {
+                jsonapp_msg_free(msg);
+                return NULL;
+        }
+        msg->recv_ns = jsonapp_now_ns();
+        return msg;
+}
+
+/* add the next piece of a push that is sent in parts */
+int jsonapp_msg_append(struct jsonapp_msg *msg, const void *payload, int payloadlen)
+{
+        struct jsonapp_msg_part *part;
+
+        if (!(part = malloc(sizeof *part + payloadlen + 1)))
+                return -1;
+        part->next = NULL;
+        part->len = payloadlen;
+        memcpy(part->data, payload, payloadlen);
+        part->data[payloadlen] = '\0';
+        if (msg->last)
+                msg->last->next = part;
+        else
+                msg->parts = part;
+        msg->last = part;
+        msg->payloadlen += payloadlen;
+        return 0;
+}
+
+void jsonapp_msg_free(struct jsonapp_msg *msg)
+{
+        struct jsonapp_msg_part *part;
+
+        if (msg) {
+                while ((part = msg->parts)) {
+                        msg->parts = part->next;
+                        free(part);
+                }
+                free(msg->topic);
+                free(msg);
+        }
+        return;
+}
+
+struct jsonapp_queue *jsonapp_queue_new(unsigned int depth)
+{
+        struct jsonapp_queue *q;
+        int i;
+
+        if (!(q = calloc(1, sizeof *q)) || !(q->ring = calloc(depth, sizeof *q->ring)))
+                jsonapp_die("insufficient memory for apply queue");
+        q->depth = depth;
+        atomic_init(&q->head, 0);
+        atomic_init(&q->tail, 0);
+        for (i = 0; i < JSONAPP_QUEUE_OVERFLOW; i++)
+                atomic_init(&q->overflow[i], NULL);
+        atomic_init(&q->closed, false);
+        atomic_init(&q->coalesced, 0);
+        atomic_init(&q->dropped, 0);
+        if (sem_init(&q->wakeup, 0, 0) != 0)
+                jsonapp_die("unable to create apply queue semaphore");
+        return q;
+}
+
+void jsonapp_queue_free(struct jsonapp_queue *q)
+{
+        struct jsonapp_msg **batch;
+        int i;
+        int n;
+
+        if (!q)
+                return;
+
+        if (!(batch = calloc(jsonapp_queue_batch_size(q), sizeof *batch)))
+                jsonapp_die("insufficient memory for apply queue");
+        n = jsonapp_queue_drain(q, batch, jsonapp_queue_batch_size(q));
+        for (i = 0; i < n; i++)
+                jsonapp_msg_free(batch[i]);
+        for (i = 0; i < JSONAPP_QUEUE_OVERFLOW; i++)
+                free(q->overflow_topic[i]);
+        free(batch);
+        sem_destroy(&q->wakeup);
+        free(q->ring);
+        free(q);
+        return;
+}
+
+/* the most a single jsonapp_queue_pop() can return */
+int jsonapp_queue_batch_size(struct jsonapp_queue *q)
+{
+        return q->depth + JSONAPP_QUEUE_OVERFLOW;
+}
+
+static bool jsonapp_queue_overflowing(struct jsonapp_queue *q)
+{
+        int i;
+
+        for (i = 0; i < JSONAPP_QUEUE_OVERFLOW; i++) {
+                if (atomic_load_explicit(&q->overflow[i], memory_order_acquire))
+                        return true;
+        }
+        return false;
+}
+
+/* park msg in the overflow slot of its topic, or in a free one */
+static void jsonapp_queue_push_overflow(struct jsonapp_queue *q, struct jsonapp_msg *msg)
+{
+        struct jsonapp_msg *old;
+        int slot = -1;
+        int i;
+
+        for (i = 0; i < JSONAPP_QUEUE_OVERFLOW; i++) {
+                if (q->overflow_topic[i] && strcmp(q->overflow_topic[i], msg->topic) == 0) {
+                        slot = i;
+                        break;
+                }
+                if (slot == -1 && !atomic_load_explicit(&q->overflow[i], memory_order_acquire))
+                        slot = i;
+        }
+
+        if (slot == -1) {
+                atomic_fetch_add(&q->dropped, 1);
+                fprintf(stderr, "apply queue full. dropping message for %s\n", msg->topic);
+                jsonapp_msg_free(msg);
+                return;
+        }
+
+        if (!q->overflow_topic[slot] || strcmp(q->overflow_topic[slot], msg->topic) != 0) {
+                free(q->overflow_topic[slot]);
+                if (!(q->overflow_topic[slot] = strdup(msg->topic)))
+                        jsonapp_die("insufficient memory for apply queue");
+        }
+
+        if ((old = atomic_exchange_explicit(&q->overflow[slot], msg, memory_order_acq_rel))) {
+                atomic_fetch_add(&q->coalesced, 1);
+                jsonapp_msg_free(old);
+        }
+        return;
+}
+
+/* producer side. only ever called from the main loop. */
+void jsonapp_queue_push(struct jsonapp_queue *q, struct jsonapp_msg *msg)
+{
+        unsigned int tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+        unsigned int head = atomic_load_explicit(&q->head, memory_order_acquire);
+
+        msg->seq = ++q->seq;
+        if (tail - head < q->depth && !jsonapp_queue_overflowing(q)) {
+                q->ring[tail % q->depth] = msg;
+                atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+        } else {
+                jsonapp_queue_push_overflow(q, msg);
+        }
+
+        sem_post(&q->wakeup);
+        return;
+}
+
+/* take everything that is currently queued without coalescing. returns the
+ * number of messages stored in batch, which is not necessarily in order. */
+int jsonapp_queue_drain(struct jsonapp_queue *q, struct jsonapp_msg **batch, int max)
+{
+        unsigned int head;
+        unsigned int tail;
+        struct jsonapp_msg *msg;
+        int n = 0;
+        int i;
+
+        /* overflow first: every ring entry older than what we find there is
+         * then guaranteed to be visible below */
+        for (i = 0; i < JSONAPP_QUEUE_OVERFLOW && n < max; i++) {
+                if ((msg = atomic_exchange_explicit(&q->overflow[i], NULL, memory_order_acq_rel)))
+                        batch[n++] = msg;
+        }
+
+        head = atomic_load_explicit(&q->head, memory_order_relaxed);
+        tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+        while (head != tail && n < max) {
+                batch[n++] = q->ring[head % q->depth];
+                head++;
+        }
+        atomic_store_explicit(&q->head, head, memory_order_release);
+        return n;
+}
+
+static int jsonapp_msg_cmp_seq(const void *a, const void *b)
+{
+        const struct jsonapp_msg *ma = *(const struct jsonapp_msg * const *)a;
+        const struct jsonapp_msg *mb = *(const struct jsonapp_msg * const *)b;
+
+        return (ma->seq > mb->seq) - (ma->seq < mb->seq);
+}
+
+/* consumer side. waits for work and returns the pending messages in arrival
+ * order with superseded ones removed, or -1 once the queue was closed. batch
+ * must have room for jsonapp_queue_batch_size() entries. */
+int jsonapp_queue_pop(struct jsonapp_queue *q, struct jsonapp_msg **batch)
+{
+        int i;
+        int j;
+        int n;
+        int kept;
+
+        while (sem_wait(&q->wakeup) != 0) {
+                if (errno != EINTR)
+                        jsonapp_die("apply queue wait failed");
+        }
+
+        n = jsonapp_queue_drain(q, batch, jsonapp_queue_batch_size(q));
+        if (!n && atomic_load(&q->closed))
+                return -1;
+
+        qsort(batch, n, sizeof *batch, jsonapp_msg_cmp_seq);
+        for (i = 0, kept = 0; i < n; i++) {
+                for (j = i + 1; j < n; j++) {
+                        if (strcmp(batch[i]->topic, batch[j]->topic) == 0)
+                                break;
+                }
+                if (j < n) {
+                        atomic_fetch_add(&q->coalesced, 1);
+                        jsonapp_msg_free(batch[i]);
+                        continue;
+                }
+                batch[kept++] = batch[i];
+        }
+        return kept;
+}
+
+void jsonapp_queue_close(struct jsonapp_queue *q)
+{
+        atomic_store(&q->closed, true);
+        sem_post(&q->wakeup);
+        return;
+}
+
+/* a snapshot for the stats publisher. safe to call from any thread; depth
+ * may be off by the messages moved while it is being read. */
+void jsonapp_queue_get_stats(struct jsonapp_queue *q, struct jsonapp_queue_stats *stats)
+{
+        unsigned int head = atomic_load_explicit(&q->head, memory_order_acquire);
+        unsigned int tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+        int i;
+
+        stats->depth = tail - head;
+        for (i = 0; i < JSONAPP_QUEUE_OVERFLOW; i++) {
+                if (atomic_load_explicit(&q->overflow[i], memory_order_acquire))
+                        stats->depth++;
+        }
+        stats->coalesced = atomic_load_explicit(&q->coalesced, memory_order_relaxed);
+        stats->dropped = atomic_load_explicit(&q->dropped, memory_order_relaxed);
+        return;
+}
@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "json-app.h"
+
+/* per-message scratch memory.
+ *
+ * every backend has an arena of its own on the context it is applied with;
+ * backends that run side by side never share one. whatever a backend builds
+ * while handling a message (section names, formatted values, its uci diff)
+ * is taken from its arena and never freed on its own: the main module
+ * resets all arenas in one go once the message is done.
+ *
+ * an arena is a list of chunks that are bumped through. a chunk that runs
+ * out is followed by one at least twice its size, and a reset keeps only
+ * the newest, largest chunk. after the first few messages the arena is a
+ * single chunk large enough for the biggest message seen, and handing out
+ * memory costs no more than moving an offset. */
+
+#define JSONAPP_ARENA_CHUNK 4096
+
+/* everything is handed out aligned as malloc() would align it */
+union jsonapp_arena_align {
+        long double d;
+        long long ll;
+        void *p;
+};
+
+#define JSONAPP_ARENA_ALIGN __alignof__(union jsonapp_arena_align)
+
+struct jsonapp_arena_chunk {
+        struct jsonapp_arena_chunk *next;
+        size_t size;
+        union jsonapp_arena_align data[];
+};
+
+struct jsonapp_arena {
+        struct jsonapp_arena_chunk *chunk;      /* newest first */
+        size_t off;                             /* into the newest chunk */
+        size_t used;                            /* handed out since the reset */
+};
+
+struct jsonapp_arenas {
+        int nr;
+        struct jsonapp_arena arena[];
+};
+
+/* an arena for every backend in the list. backends find theirs by their
+ * position in the registered list (see jsonapp_arena()). */
+struct jsonapp_arenas *jsonapp_arenas_new(struct jsonapp_parse_backend *backends)
+{
+        struct jsonapp_parse_backend *backend;
+        struct jsonapp_arenas *arenas;
+        int n = 0;
+
+        foreach_parse_backend(backend, backends) {
+                if (backend->index >= n)
+                        n = backend->index + 1;
+        }
+        if (!(arenas = calloc(1, sizeof *arenas + n * sizeof arenas->arena[0])))
+                jsonapp_die("insufficient memory for backend arenas");
+        arenas->nr = n;
+        return arenas;
+}
+
+static void jsonapp_arena_free_chunks(struct jsonapp_arena_chunk *chunk)
+{
+        struct jsonapp_arena_chunk *next;
+
+        for (; chunk; chunk = next) {
+                next = chunk->next;
+                free(chunk);
+        }
+        return;
+}
+
+void jsonapp_arenas_free(struct jsonapp_arenas *arenas)
+{
+        int i;
+
+        if (!arenas)
+                return;
+        for (i = 0; i < arenas->nr; i++)
+                jsonapp_arena_free_chunks(arenas->arena[i].chunk);
+        free(arenas);
+        return;
+}
+
+/* give back everything the backends took for the message that was just
+ * applied. the bytes they took together are kept in jctx->arena_used and
+ * the largest message so far in the stats. */
+void jsonapp_arena_reset(struct jsonapp_parse_ctx *jctx)
+{
+        struct jsonapp_stats *stats = jctx->parent ? &jctx->parent->stats : &jctx->stats;
+        struct jsonapp_arenas *arenas = jctx->arenas;
+        struct jsonapp_arena *arena;
+        unsigned long long peak;
+        size_t used = 0;
+        int i;
+
+        if (!arenas)
+                return;
+        for (i = 0; i < arenas->nr; i++) {
+                arena = &arenas->arena[i];
+                used += arena->used;
+                if (arena->chunk) {
+                        jsonapp_arena_free_chunks(arena->chunk->next);
+                        arena->chunk->next = NULL;
+                }
+                arena->off = 0;
+                arena->used = 0;
+        }
+        jctx->arena_used = used;
+
+        peak = atomic_load_explicit(&stats->arena_peak, memory_order_relaxed);
+        while (used > peak && !atomic_compare_exchange_weak_explicit(&stats->arena_peak, &peak,
+                                                                     used,
+                                                                     memory_order_relaxed,
+                                                                     memory_order_relaxed))
+                ;
+        return;
+}
+
+/* the arena of backend on jctx. backend may be the registered backend or
+ * the copy of it a gateway device applies with. */
+struct jsonapp_arena *jsonapp_arena(struct jsonapp_parse_ctx *jctx,
+                                    struct jsonapp_parse_backend *backend)
+{
+        return &jctx->arenas->arena[backend->index];
+}
+
+/* size zeroed bytes, aligned for any type, that stay valid until the end of
+ * the message */
+void *jsonapp_arena_alloc(struct jsonapp_arena *arena, size_t size)
+{
+        struct jsonapp_arena_chunk *chunk = arena->chunk;
+        size_t chunk_size;
+        void *p;
+
+        size = (size + JSONAPP_ARENA_ALIGN - 1) & ~(JSONAPP_ARENA_ALIGN - 1);
+        if (!chunk || chunk->size - arena->off < size) {
+                chunk_size = chunk ? 2 * chunk->size : JSONAPP_ARENA_CHUNK;
+                while (chunk_size < size)
+                        chunk_size *= 2;
+                if (!(chunk = malloc(sizeof *chunk + chunk_size)))
+                        jsonapp_die("insufficient memory for backend arena");
+                chunk->size = chunk_size;
+                chunk->next = arena->chunk;
+                arena->chunk = chunk;
+                arena->off = 0;
+        }
+        p = (char *)chunk->data + arena->off;
+        arena->off += size;
+        arena->used += size;
+        memset(p, 0, size);
+        return p;
+}
+
+char *jsonapp_arena_strdup(struct jsonapp_arena *arena, const char *s)
+{
+        size_t len = strlen(s) + 1;
+
+        return memcpy(jsonapp_arena_alloc(arena, len), s, len);
+}
+
+/* a string of whatever length fmt comes out at */
+char *jsonapp_arena_printf(struct jsonapp_arena *arena, const char *fmt, ...)
+{
+        va_list ap;
+        char *s;
+        int len;
+
+        va_start(ap, fmt);
+        len = vsnprintf(NULL, 0, fmt, ap);
+        va_end(ap);
+        if (len < 0)
+                jsonapp_die("unable to format \"%s\"", fmt);
+
+        s = jsonapp_arena_alloc(arena, len + 1);
+        va_start(ap, fmt);
+        vsnprintf(s, len + 1, fmt, ap);
+        va_end(ap);
+        return s;
+}
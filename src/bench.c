@@ -0,0 +1,487 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include "json-app.h"
+#include "bench.h"
+
+/* offline replay benchmark.
+ *
+ * runs the registered backends against payloads read from disk, without a
+ * broker, on a scratch uci config directory. every iteration goes through
+ * jsonapp_process_json() exactly like a message from the worker does and the
+ * per-stage timings it leaves in the parse context are collected into
+ * percentiles.
+ *
+ * besides payload files it can replay synthetic configs from bench_gen.c,
+ * either one shape at a time (-g) or as a suite of growing wlan counts (-s)
+ * to show how apply time and memory scale with the size of a WlanGroup. */
+
+#define BENCH_DEFAULT_ITERATIONS 1000
+#define BENCH_DEFAULT_WARMUP 10
+#define BENCH_MAX_GENERATED 16
+
+static const int bench_suite_wlans[] = { 1, 4, 16, 64, 128, 256 };
+
+struct bench_file {
+        char *name;
+        char *data;
+        size_t len;
+};
+
+struct bench_result {
+        size_t len;
+        double p50;
+        double p99;
+        double allocs;
+        double peak_kb;
+};
+
+struct bench_ctx {
+        struct jsonapp_parse_ctx *jctx;
+        char confdir[PATH_MAX];
+        char savedir[PATH_MAX];
+        bool scratch;
+        bool fresh;
+        int iterations;
+        int warmup;
+        struct bench_file *configs;
+        int nr_configs;
+        struct bench_gen_params generated[BENCH_MAX_GENERATED];
+        int nr_generated;
+        bool suite;
+        bool print;
+        bool lazy;
+        int threads;
+};
+
+#ifdef __GLIBC__
+#include <malloc.h>
+
+/* count every allocation made while an iteration runs, including the ones
+ * made inside libjson-c and libuci, and follow the live heap size to find
+ * the high water mark of an iteration */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+/* backends allocate on the apply threads too */
+static atomic_ulong bench_allocs;
+static atomic_ullong bench_alloc_bytes;
+static atomic_size_t bench_heap_live;
+static size_t bench_heap_peak;
+
+static void *bench_account(void *ptr)
+{
+        if (ptr) {
+                bench_heap_live += malloc_usable_size(ptr);
+                if (bench_heap_live > bench_heap_peak)
+                        bench_heap_peak = bench_heap_live;
+        }
+        return ptr;
+}
+
+void *malloc(size_t size)
+{
+        bench_allocs++;
+        bench_alloc_bytes += size;
+        return bench_account(__libc_malloc(size));
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+        bench_allocs++;
+        bench_alloc_bytes += nmemb * size;
+        return bench_account(__libc_calloc(nmemb, size));
+}
+
+void *realloc(void *ptr, size_t size)
+{
+        bench_allocs++;
+        bench_alloc_bytes += size;
+        if (ptr)
+                bench_heap_live -= malloc_usable_size(ptr);
+        return bench_account(__libc_realloc(ptr, size));
+}
+
+void free(void *ptr)
+{
+        if (ptr)
+                bench_heap_live -= malloc_usable_size(ptr);
+        __libc_free(ptr);
+}
+#define BENCH_HAVE_ALLOC_COUNT 1
+#else
+static atomic_ulong bench_allocs;
+static atomic_ullong bench_alloc_bytes;
+static atomic_size_t bench_heap_live;
+static size_t bench_heap_peak;
+#define BENCH_HAVE_ALLOC_COUNT 0
+#endif
+
+static int bench_read_file(const char *path, char **data, size_t *len)
+{
+        FILE *f;
+        long size;
+
+        if (!(f = fopen(path, "rb")))
+                return -1;
+        if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) != 0) {
+                fclose(f);
+                return -1;
+        }
+        if (!(*data = malloc(size + 1)))
+                jsonapp_die("insufficient memory for %s", path);
+        if (fread(*data, 1, size, f) != (size_t)size) {
+                free(*data);
+                fclose(f);
+                return -1;
+        }
+        (*data)[size] = '\0';
+        *len = size;
+        fclose(f);
+        return 0;
+}
+
+static int bench_write_file(const char *dir, const char *name, const char *data, size_t len)
+{
+        char path[PATH_MAX];
+        FILE *f;
+        int err = 0;
+
+        snprintf(path, sizeof path, "%s/%s", dir, name);
+        if (!(f = fopen(path, "w")))
+                return -1;
+        if (fwrite(data, 1, len, f) != len)
+                err = -1;
+        if (fclose(f) != 0)
+                err = -1;
+        return err;
+}
+
+/* remember the starting point so -f can go back to it */
+static void bench_save_confdir(struct bench_ctx *bench)
+{
+        char **configs = NULL;
+        char path[PATH_MAX + NAME_MAX + 2];
+        char **p;
+        int n = 0;
+
+        uci_list_configs(bench->jctx->uci_ctx, &configs);
+        for (p = configs; p && *p; p++)
+                n++;
+        if (!(bench->configs = calloc(n ? n : 1, sizeof *bench->configs)))
+                jsonapp_die("insufficient memory for config snapshot");
+        for (p = configs; p && *p; p++) {
+                struct bench_file *file = &bench->configs[bench->nr_configs];
+                snprintf(path, sizeof path, "%s/%s", bench->confdir, *p);
+                if (bench_read_file(path, &file->data, &file->len) != 0)
+                        continue;
+                if (!(file->name = strdup(*p)))
+                        jsonapp_die("insufficient memory for config snapshot");
+                bench->nr_configs++;
+        }
+        free(configs);
+        return;
+}
+
+static void bench_restore_confdir(struct bench_ctx *bench)
+{
+        int i;
+
+        for (i = 0; i < bench->nr_configs; i++) {
+                struct bench_file *file = &bench->configs[i];
+                if (bench_write_file(bench->confdir, file->name, file->data, file->len) != 0)
+                        jsonapp_die("unable to restore %s/%s", bench->confdir, file->name);
+        }
+        return;
+}
+
+static void bench_cleanup_confdir(struct bench_ctx *bench)
+{
+        int i;
+
+        for (i = 0; i < bench->nr_configs; i++) {
+                free(bench->configs[i].name);
+                free(bench->configs[i].data);
+        }
+        free(bench->configs);
+        bench_gen_scratch_exit(bench->scratch ? bench->confdir : NULL, bench->savedir);
+        return;
+}
+
+static int bench_cmp_u64(const void *a, const void *b)
+{
+        uint64_t x = *(const uint64_t *)a;
+        uint64_t y = *(const uint64_t *)b;
+
+        return (x > y) - (x < y);
+}
+
+static double bench_percentile(const uint64_t *sorted, int n, double pct)
+{
+        return sorted[(int)(pct / 100.0 * (n - 1) + 0.5)] / 1000.0;
+}
+
+static void bench_print_row(const char *name, uint64_t *samples, int n)
+{
+        qsort(samples, n, sizeof *samples, bench_cmp_u64);
+        printf("%-10s %10.1f %10.1f %10.1f %10.1f\n", name,
+               bench_percentile(samples, n, 50),
+               bench_percentile(samples, n, 90),
+               bench_percentile(samples, n, 99),
+               samples[n - 1] / 1000.0);
+        return;
+}
+
+static int bench_run(struct bench_ctx *bench, const char *name, const char *data,
+                     size_t len, struct bench_result *result)
+{
+        uint64_t *samples[JSONAPP_STAGE_MAX + 1];
+        struct jsonapp_msg *msg;
+        unsigned long long alloc_bytes = 0;
+        unsigned long allocs = 0;
+        size_t peak = 0;
+        size_t arena_peak = 0;
+        uint64_t start;
+        int stage;
+        int failed = 0;
+        int i;
+
+        for (stage = 0; stage <= JSONAPP_STAGE_MAX; stage++) {
+                if (!(samples[stage] = calloc(bench->iterations, sizeof *samples[stage])))
+                        jsonapp_die("insufficient memory for samples");
+        }
+        /* the worker gets the payload already copied out of libmosquitto */
+        if (!(msg = jsonapp_msg_new(name, data, len)))
+                jsonapp_die("insufficient memory for message");
+
+        for (i = -bench->warmup; i < bench->iterations; i++) {
+                if (bench->fresh)
+                        bench_restore_confdir(bench);
+
+                bench_allocs = 0;
+                bench_alloc_bytes = 0;
+                bench_heap_peak = bench_heap_live;
+                start = jsonapp_now_ns();
+                if (jsonapp_process_json(bench->jctx, msg) != 0)
+                        failed++;
+                if (i < 0)
+                        continue;
+
+                samples[JSONAPP_STAGE_MAX][i] = jsonapp_now_ns() - start;
+                allocs += bench_allocs;
+                alloc_bytes += bench_alloc_bytes;
+                if (bench_heap_peak - bench_heap_live > peak)
+                        peak = bench_heap_peak - bench_heap_live;
+                if (bench->jctx->arena_used > arena_peak)
+                        arena_peak = bench->jctx->arena_used;
+                for (stage = 0; stage < JSONAPP_STAGE_MAX; stage++)
+                        samples[stage][i] = bench->jctx->stage_ns[stage];
+        }
+
+        printf("%s: %zu bytes, %d iterations (%s)\n", name, len, bench->iterations,
+               bench->fresh ? "fresh config every iteration" : "steady state");
+        printf("%-10s %10s %10s %10s %10s\n", "stage(us)", "p50", "p90", "p99", "max");
+        for (stage = 0; stage < JSONAPP_STAGE_MAX; stage++)
+                bench_print_row(jsonapp_stage_name(stage), samples[stage], bench->iterations);
+        bench_print_row("total", samples[JSONAPP_STAGE_MAX], bench->iterations);
+        if (BENCH_HAVE_ALLOC_COUNT) {
+                printf("allocations/iteration: %.1f (%.0f bytes)\n",
+                       (double)allocs / bench->iterations,
+                       (double)alloc_bytes / bench->iterations);
+                printf("peak heap above baseline: %.1f KiB\n", peak / 1024.0);
+        }
+        printf("backend arenas per message: %.1f KiB at most\n", arena_peak / 1024.0);
+        if (failed)
+                printf("failed iterations: %d\n", failed);
+        printf("\n");
+
+        if (result) {
+                /* bench_print_row() left the samples sorted */
+                result->len = len;
+                result->p50 = bench_percentile(samples[JSONAPP_STAGE_MAX], bench->iterations, 50);
+                result->p99 = bench_percentile(samples[JSONAPP_STAGE_MAX], bench->iterations, 99);
+                result->allocs = (double)allocs / bench->iterations;
+                result->peak_kb = peak / 1024.0;
+        }
+
+        jsonapp_msg_free(msg);
+        for (stage = 0; stage <= JSONAPP_STAGE_MAX; stage++)
+                free(samples[stage]);
+        return failed ? -1 : 0;
+}
+
+static int bench_run_file(struct bench_ctx *bench, const char *path)
+{
+        struct bench_file payload;
+        int err;
+
+        if (bench_read_file(path, &payload.data, &payload.len) != 0) {
+                perror(path);
+                return -1;
+        }
+        err = bench_run(bench, path, payload.data, payload.len, NULL);
+        free(payload.data);
+        return err;
+}
+
+static int bench_run_generated(struct bench_ctx *bench, const struct bench_gen_params *params,
+                               struct bench_result *result)
+{
+        char name[128];
+        size_t len;
+        char *data;
+        int err;
+
+        data = bench_gen_config(params, &len);
+        if (bench->print) {
+                fwrite(data, 1, len, stdout);
+                free(data);
+                return 0;
+        }
+
+        snprintf(name, sizeof name, "generated %d:%d:%d:%d", params->wlans, params->radios,
+                 params->radius_servers, params->guest_acls);
+        err = bench_run(bench, name, data, len, result);
+        free(data);
+        return err;
+}
+
+/* the same wlan shape at growing wlan counts, summarised at the end */
+static int bench_run_suite(struct bench_ctx *bench, const struct bench_gen_params *shape)
+{
+        const int n = sizeof bench_suite_wlans / sizeof bench_suite_wlans[0];
+        struct bench_result results[sizeof bench_suite_wlans / sizeof bench_suite_wlans[0]];
+        struct bench_gen_params params = *shape;
+        int err = 0;
+        int i;
+
+        memset(results, 0, sizeof results);
+        for (i = 0; i < n; i++) {
+                params.wlans = bench_suite_wlans[i];
+                if (bench_run_generated(bench, &params, &results[i]) != 0)
+                        err = -1;
+        }
+        if (bench->print)
+                return err;
+
+        printf("scaling: %d radios, %d radius servers, %d guest acls per wlan%s\n",
+               shape->radios, shape->radius_servers, shape->guest_acls,
+               bench->fresh ? ", fresh config every iteration" : "");
+        printf("%6s %10s %10s %10s %12s %10s\n",
+               "wlans", "bytes", "p50(us)", "p99(us)", "allocs/iter", "peak(KiB)");
+        for (i = 0; i < n; i++) {
+                printf("%6d %10zu %10.1f %10.1f %12.1f %10.1f\n", bench_suite_wlans[i],
+                       results[i].len, results[i].p50, results[i].p99,
+                       results[i].allocs, results[i].peak_kb);
+        }
+        printf("\n");
+        return err;
+}
+
+static void bench_usage(const char *prog)
+{
+        fprintf(stderr, "usage: %s [-n iterations] [-w warmup] [-c confdir] [-f] [-p] [-l] [-j threads]\n"
+                        "       [-g wlans[:radios[:radius[:guest]]]]... [-s] [payload...]\n"
+                        "  -n  measured iterations per payload (default %d)\n"
+                        "  -w  unmeasured warmup iterations (default %d)\n"
+                        "  -c  use an existing config directory instead of a scratch one\n"
+                        "  -f  restore the config directory before every iteration so each\n"
+                        "      one applies and commits the full config\n"
+                        "  -g  replay a generated config with the given number of wlans,\n"
+                        "      radios per wlan (1 or 2), radius servers (>= %d) and guest\n"
+                        "      access entries (>= %d) per wlan\n"
+                        "  -s  scaling suite: the -g shape (or the defaults) at growing\n"
+                        "      wlan counts\n"
+                        "  -p  print the generated configs instead of running them\n"
+                        "  -l  parse with the lazy scanner instead of json_tokener\n"
+                        "  -j  threads to run backends on (default one per cpu)\n",
+                prog, BENCH_DEFAULT_ITERATIONS, BENCH_DEFAULT_WARMUP,
+                BENCH_GEN_MIN_RADIUS, BENCH_GEN_MIN_GUEST);
+        return;
+}
+
+int main(int argc, char **argv)
+{
+        struct bench_gen_params shape;
+        struct bench_ctx bench;
+        int option;
+        int err = 0;
+        int i;
+
+        memset(&bench, 0, sizeof bench);
+        bench.scratch = true;
+        bench.iterations = BENCH_DEFAULT_ITERATIONS;
+        bench.warmup = BENCH_DEFAULT_WARMUP;
+        while ((option = getopt(argc, argv, "n:w:c:fg:splj:")) != -1) {
+                switch (option) {
+                case 'n': bench.iterations = atoi(optarg); break;
+                case 'w': bench.warmup = atoi(optarg); break;
+                case 'c':
+                        snprintf(bench.confdir, sizeof bench.confdir, "%s", optarg);
+                        bench.scratch = false;
+                        break;
+                case 'f': bench.fresh = true; break;
+                case 's': bench.suite = true; break;
+                case 'p': bench.print = true; break;
+                case 'l': bench.lazy = true; break;
+                case 'j': bench.threads = atoi(optarg); break;
+                case 'g':
+                        if (bench.nr_generated == BENCH_MAX_GENERATED ||
+                            bench_gen_parse(optarg, &bench.generated[bench.nr_generated]) != 0) {
+                                bench_usage(argv[0]);
+                                return 1;
+                        }
+                        bench.nr_generated++;
+                        break;
+                default:
+                        bench_usage(argv[0]);
+                        return 1;
+                }
+        }
+        if ((optind >= argc && !bench.nr_generated && !bench.suite) ||
+            bench.iterations <= 0 || bench.warmup < 0) {
+                bench_usage(argv[0]);
+                return 1;
+        }
+
+        /* with -s, -g only sets the per-wlan shape of the suite */
+        bench_gen_parse("1", &shape);
+        if (bench.nr_generated)
+                shape = bench.generated[0];
+
+        if (bench.print) {
+                if (bench.suite)
+                        return bench_run_suite(&bench, &shape) ? 1 : 0;
+                for (i = 0; i < bench.nr_generated; i++)
+                        bench_run_generated(&bench, &bench.generated[i], NULL);
+                return 0;
+        }
+
+        bench_gen_scratch_init("jsonapp-bench", bench.scratch ? bench.confdir : NULL,
+                               bench.savedir);
+        bench.jctx = bench_gen_alloc_context(bench.confdir, bench.savedir, bench.lazy,
+                                             bench.threads);
+        bench_save_confdir(&bench);
+
+        for (i = optind; i < argc; i++) {
+                if (bench_run_file(&bench, argv[i]) != 0)
+                        err = 1;
+        }
+        if (bench.suite) {
+                if (bench_run_suite(&bench, &shape) != 0)
+                        err = 1;
+        } else {
+                for (i = 0; i < bench.nr_generated; i++) {
+                        if (bench_run_generated(&bench, &bench.generated[i], NULL) != 0)
+                                err = 1;
+                }
+        }
+
+        bench_gen_free_context(bench.jctx);
+        bench_cleanup_confdir(&bench);
+        return err;
+}
@@ -0,0 +1,31 @@
+#ifndef __JSONAPP_BENCH_H__
+#define __JSONAPP_BENCH_H__
+
+#include <stddef.h>
+#include <stdbool.h>
+
+struct jsonapp_parse_ctx;
+
+/* shape of a synthetic WlanGroup config. the backends need at least two
+ * radius servers and one guest access entry on the first wlan. */
+struct bench_gen_params {
+        int wlans;              /* wlans in the group */
+        int radios;             /* 1: 5 GHz only, 2: 2.5 GHz and 5 GHz */
+        int radius_servers;     /* radiusServerList entries per wlan */
+        int guest_acls;         /* guestAccessList entries per wlan */
+        int first;              /* number of the first wlan, 1 by default */
+};
+
+#define BENCH_GEN_MIN_RADIUS 2
+#define BENCH_GEN_MIN_GUEST 1
+
+int bench_gen_parse(const char *spec, struct bench_gen_params *params);
+char *bench_gen_config(const struct bench_gen_params *params, size_t *len);
+
+void bench_gen_scratch_init(const char *name, char *confdir, char *savedir);
+void bench_gen_scratch_exit(const char *confdir, const char *savedir);
+struct jsonapp_parse_ctx *bench_gen_alloc_context(const char *confdir, const char *savedir,
+                                                  bool lazy, int threads);
+void bench_gen_free_context(struct jsonapp_parse_ctx *jctx);
+
+#endif
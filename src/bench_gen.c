@@ -0,0 +1,285 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include "json-app.h"
+#include "bench.h"
+
+/* synthetic config generator for jsonapp-bench and jsonapp-test.
+ *
+ * emits a WlanGroup in the same layout the backends parse, with every list
+ * sized from bench_gen_params, so apply time and memory can be measured as
+ * the config grows. values are derived from the indices so the same params
+ * always give the same payload.
+ *
+ * both programs apply what it generates to a scratch config directory with
+ * a parse context of their own; setting those up is shared here too. */
+
+static const char bench_gen_seed_wireless[] =
+        "config wifi-device 'radio0'\n"
+        "\toption type 'mac80211'\n"
+        "\toption band '5g'\n"
+        "\n"
+        "config wifi-device 'radio1'\n"
+        "\toption type 'mac80211'\n"
+        "\toption band '2g'\n"
+        "\n";
+
+static const char bench_gen_seed_chilli[] =
+        "config chilli\n"
+        "\toption disabled '0'\n"
+        "\n";
+
+static const char *bench_gen_radios(int radios)
+{
+        return radios == 1 ? "5 GHz" : "2.5 GHz and 5 GHz";
+}
+
+static void bench_gen_radius(FILE *f, int wlan, int idx, int id)
+{
+        bool accounting = idx % 2;
+
+        fprintf(f, "        {\n"
+                   "          \"createdBy\": \"Admin\",\n"
+                   "          \"lastModifiedBy\": null,\n"
+                   "          \"radiusServerId\": %d,\n"
+                   "          \"wlanId\": %d,\n"
+                   "          \"servers\": [\n"
+                   "            {\n"
+                   "              \"serverId\": %d,\n"
+                   "              \"ip\": \"10.%d.%d.%d\",\n"
+                   "              \"secret\": \"secret%d\",\n"
+                   "              \"port\": \"%s\",\n"
+                   "              \"realm\": \"\"\n"
+                   "            }\n"
+                   "          ],\n"
+                   "          \"timeout\": 3000,\n"
+                   "          \"attempts\": 3,\n"
+                   "          \"type\": \"%s\",\n"
+                   "          \"acctountingMode\": %s,\n"
+                   "          \"acctountingStatus\": %s,\n"
+                   "          \"intrimUpdateTime\": %s,\n"
+                   "          \"createDate\": \"2021-09-16T09:01:52\",\n"
+                   "          \"lastModificationDate\": \"2021-09-16T09:01:52\"\n"
+                   "        }",
+                id, wlan, id,
+                (wlan >> 8) & 0xff, wlan & 0xff, idx + 1, id,
+                accounting ? "1813" : "1812",
+                accounting ? "Accounting server" : "Authentication server",
+                accounting ? "\"Start-Intrim-Stop\"" : "null",
+                accounting ? "\"Active\"" : "null",
+                accounting ? "15" : "null");
+        return;
+}
+
+static void bench_gen_guest(FILE *f, int wlan, int idx, int id)
+{
+        fprintf(f, "        {\n"
+                   "          \"createdBy\": \"Admin\",\n"
+                   "          \"lastModifiedBy\": null,\n"
+                   "          \"guestAccessId\": %d,\n"
+                   "          \"wlanId\": %d,\n"
+                   "          \"status\": \"Active\",\n"
+                   "          \"portalMode\": \"LS Portal\",\n"
+                   "          \"portalType\": \"Standard\",\n"
+                   "          \"portalUrl\": \"http://10.%d.%d.%d:5400\",\n"
+                   "          \"successAction\": \"Original URL\",\n"
+                   "          \"successRedirectUrl\": \"NA\",\n"
+                   "          \"whitelistUrls\": [\n"
+                   "            {\n"
+                   "              \"createdBy\": \"Admin\",\n"
+                   "              \"lastModifiedBy\": null,\n"
+                   "              \"whitelistId\": %d,\n"
+                   "              \"whitelistUrl\": \"\",\n"
+                   "              \"createDate\": \"2021-09-16T09:01:52\",\n"
+                   "              \"lastModificationDate\": \"2021-09-16T09:01:52\"\n"
+                   "            }\n"
+                   "          ]\n"
+                   "        }",
+                id, wlan, (wlan >> 8) & 0xff, wlan & 0xff, idx + 1, id);
+        return;
+}
+
+static void bench_gen_wlan(FILE *f, const struct bench_gen_params *params, int wlan,
+                           int *radius_id, int *guest_id)
+{
+        int i;
+
+        fprintf(f, "    {\n"
+                   "      \"createdBy\": \"Admin\",\n"
+                   "      \"lastModifiedBy\": null,\n"
+                   "      \"wlanId\": %d,\n"
+                   "      \"wlanName\": \"wlan%d\",\n"
+                   "      \"ssidName\": \"ssid%d\",\n"
+                   "      \"status\": \"Active\",\n"
+                   "      \"vlan\": %d,\n"
+                   "      \"security\": \"%s\",\n"
+                   "      \"passphrase\": \"secret%d\",\n"
+                   "      \"radios\": \"%s\",\n"
+                   "      \"createDate\": \"2021-09-16T09:01:51\",\n"
+                   "      \"lastModificationDate\": \"2021-09-16T09:01:51\",\n"
+                   "      \"radiusServerList\": [\n",
+                wlan, wlan, wlan, 1 + wlan % 4094,
+                wlan % 2 ? "WPA2 Preshared Key" : "Open", wlan,
+                bench_gen_radios(params->radios));
+        for (i = 0; i < params->radius_servers; i++) {
+                bench_gen_radius(f, wlan, i, ++*radius_id);
+                fprintf(f, i + 1 < params->radius_servers ? ",\n" : "\n");
+        }
+        fprintf(f, "      ],\n"
+                   "      \"guestAccessList\": [\n");
+        for (i = 0; i < params->guest_acls; i++) {
+                bench_gen_guest(f, wlan, i, ++*guest_id);
+                fprintf(f, i + 1 < params->guest_acls ? ",\n" : "\n");
+        }
+        fprintf(f, "      ]\n"
+                   "    }");
+        return;
+}
+
+/* parse "wlans[:radios[:radius[:guest]]]" into params. omitted fields keep
+ * the defaults of a typical site. */
+int bench_gen_parse(const char *spec, struct bench_gen_params *params)
+{
+        int n;
+
+        params->wlans = 1;
+        params->radios = 2;
+        params->radius_servers = BENCH_GEN_MIN_RADIUS;
+        params->guest_acls = BENCH_GEN_MIN_GUEST;
+        params->first = 1;
+
+        n = sscanf(spec, "%d:%d:%d:%d", &params->wlans, &params->radios,
+                   &params->radius_servers, &params->guest_acls);
+        if (n < 1 || params->wlans < 1 ||
+            params->radios < 1 || params->radios > 2 ||
+            params->radius_servers < BENCH_GEN_MIN_RADIUS ||
+            params->guest_acls < BENCH_GEN_MIN_GUEST)
+                return -1;
+        return 0;
+}
+
+/* returns a malloc'ed, nul terminated payload and stores its length in len */
+char *bench_gen_config(const struct bench_gen_params *params, size_t *len)
+{
+        int radius_id = 0;
+        int guest_id = 0;
+        char *buf = NULL;
+        FILE *f;
+        int i;
+
+        if (!(f = open_memstream(&buf, len)))
+                jsonapp_die("insufficient memory for generated config");
+
+        fprintf(f, "{\n"
+                   "  \"WlanGroup\": {\n"
+                   "  \"createdBy\": \"Admin\",\n"
+                   "  \"lastModifiedBy\": \"Admin\",\n"
+                   "  \"wlanGroupId\": 1,\n"
+                   "  \"wlanGroupName\": \"bench\",\n"
+                   "  \"wlanGroupDescription\": \"%d wlans, %d radios, %d radius, %d guest\",\n"
+                   "  \"status\": \"Active\",\n"
+                   "  \"wlans\": [\n",
+                params->wlans, params->radios, params->radius_servers, params->guest_acls);
+        for (i = params->first; i < params->first + params->wlans; i++) {
+                bench_gen_wlan(f, params, i, &radius_id, &guest_id);
+                fprintf(f, i + 1 < params->first + params->wlans ? ",\n" : "\n");
+        }
+        fprintf(f, "  ],\n"
+                   "  \"createDate\": \"2021-09-16T09:02:46\",\n"
+                   "  \"lastModificationDate\": \"2021-09-16T09:08:24\"\n"
+                   "  },\n"
+                   "  \"timestamp\": \"2021-09-16 09:08:40:7760\",\n"
+                   "  \"status\": 200\n"
+                   "}\n");
+        if (fclose(f) != 0 || !buf)
+                jsonapp_die("insufficient memory for generated config");
+        return buf;
+}
+
+static int bench_gen_write(const char *dir, const char *name, const char *data, mode_t mode)
+{
+        char path[PATH_MAX];
+        FILE *f;
+        int err = 0;
+
+        snprintf(path, sizeof path, "%s/%s", dir, name);
+        if (!(f = fopen(path, "w")))
+                return -1;
+        if (fputs(data, f) == EOF)
+                err = -1;
+        if (fclose(f) != 0 || chmod(path, mode) != 0)
+                err = -1;
+        return err;
+}
+
+static int bench_gen_unlink(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+        return remove(path);
+}
+
+/* create /tmp/<name>.XXXXXX as confdir, seeded with the packages the
+ * backends expect, and /tmp/<name>-delta.XXXXXX as savedir. both buffers
+ * hold PATH_MAX bytes; without confdir only the savedir is made. */
+void bench_gen_scratch_init(const char *name, char *confdir, char *savedir)
+{
+        if (confdir) {
+                snprintf(confdir, PATH_MAX, "/tmp/%s.XXXXXX", name);
+                if (!mkdtemp(confdir))
+                        jsonapp_die("unable to create scratch config directory");
+                if (bench_gen_write(confdir, "wireless", bench_gen_seed_wireless, 0600) ||
+                    bench_gen_write(confdir, "chilli", bench_gen_seed_chilli, 0640))
+                        jsonapp_die("unable to seed %s", confdir);
+        }
+        snprintf(savedir, PATH_MAX, "/tmp/%s-delta.XXXXXX", name);
+        if (!mkdtemp(savedir))
+                jsonapp_die("unable to create scratch delta directory");
+        return;
+}
+
+/* remove what bench_gen_scratch_init() made, and anything put there since */
+void bench_gen_scratch_exit(const char *confdir, const char *savedir)
+{
+        nftw(savedir, bench_gen_unlink, 8, FTW_DEPTH | FTW_PHYS);
+        if (confdir)
+                nftw(confdir, bench_gen_unlink, 8, FTW_DEPTH | FTW_PHYS);
+        return;
+}
+
+/* a parse context with the registered backends on confdir and savedir,
+ * set up like jsonapp_alloc_context() but without a broker, a worker or
+ * the reload thread */
+struct jsonapp_parse_ctx *bench_gen_alloc_context(const char *confdir, const char *savedir,
+                                                  bool lazy, int threads)
+{
+        struct jsonapp_parse_ctx *jctx;
+
+        if (!(jctx = calloc(1, sizeof *jctx)))
+                jsonapp_die("insufficient memory for json parse context");
+        if (!(jctx->uci_ctx = uci_alloc_context()))
+                jsonapp_die("insufficient memory for uci context");
+        jctx->lazy_parse = lazy;
+        jctx->max_inflated = JSONAPP_MAX_INFLATED;
+        jctx->apply_threads = threads;
+        uci_set_confdir(jctx->uci_ctx, confdir);
+        uci_set_savedir(jctx->uci_ctx, savedir);
+        jsonapp_uci_cache_init(jctx);
+        jsonapp_init_backends(jctx);
+        return jctx;
+}
+
+void bench_gen_free_context(struct jsonapp_parse_ctx *jctx)
+{
+        jsonapp_map_exit(jctx);
+        jsonapp_exit_backends();
+        jsonapp_uci_cache_exit(jctx);
+        jsonapp_sched_exit(jctx);
+        uci_free_context(jctx->uci_ctx);
+        json_tokener_free(jctx->tokener);
+        jsonapp_inflate_exit(jctx);
+        jsonapp_arenas_free(jctx->arenas);
+        free(jctx);
+        return;
+}
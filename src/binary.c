@@ -0,0 +1,596 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "json-app.h"
+
+/* binary encodings of a push.
+ *
+ * on metered links a controller may send the WlanGroup as cbor (rfc 8949)
+ * or messagepack instead of json text; both drop the whitespace and encode
+ * lengths instead of quoting. they are decoded straight into the json-c tree
+ * the backends already consume, so everything after parsing is the same
+ * whatever the encoding.
+ *
+ * mqtt 3.1.1 has no content type, so the encoding is told from the first
+ * byte. a push is always a map: json text starts with '{' or whitespace, a
+ * cbor map with 0xa0-0xbf (or the self-described cbor tag d9 d9 f7 in
+ * front) and a messagepack map with 0x80-0x8f, 0xde or 0xdf. compressed
+ * json (see compress.c) is told by the zstd magic or a zlib or gzip header,
+ * none of which can start a json document either. */
+
+struct jsonapp_decoder {
+        struct jsonapp_parse_ctx *jctx;
+        const char *name;
+        const unsigned char *start;
+        const unsigned char *p;
+        const unsigned char *end;
+        int depth;
+};
+
+enum jsonapp_encoding jsonapp_msg_encoding(const struct jsonapp_msg *msg)
+{
+        const unsigned char *p = (const unsigned char *)msg->parts->data;
+        int len = msg->parts->len;
+
+        if (!len)
+                return JSONAPP_ENCODING_JSON;
+        if (len >= 4 && p[0] == 0x28 && p[1] == 0xb5 && p[2] == 0x2f && p[3] == 0xfd)
+                return JSONAPP_ENCODING_ZSTD;
+        if (len >= 2 && p[0] == 0x1f && p[1] == 0x8b)
+                return JSONAPP_ENCODING_DEFLATE;
+        /* zlib: deflate with a window of at most 32k and a header check */
+        if (len >= 2 && (p[0] & 0x0f) == 8 && (p[0] >> 4) <= 7 &&
+            ((p[0] << 8) | p[1]) % 31 == 0)
+                return JSONAPP_ENCODING_DEFLATE;
+        if ((p[0] >= 0xa0 && p[0] <= 0xbf) ||
+            (len >= 3 && p[0] == 0xd9 && p[1] == 0xd9 && p[2] == 0xf7))
+                return JSONAPP_ENCODING_CBOR;
+        if ((p[0] >= 0x80 && p[0] <= 0x8f) || p[0] == 0xde || p[0] == 0xdf)
+                return JSONAPP_ENCODING_MSGPACK;
+        return JSONAPP_ENCODING_JSON;
+}
+
+static int jsonapp_dec_fail(struct jsonapp_decoder *d, const char *why)
+{
+        return jsonapp_invalid(d->jctx, "unable to decode %s message: %s at offset %ld",
+                               d->name, why, (long)(d->p - d->start));
+}
+
+static bool jsonapp_dec_has(struct jsonapp_decoder *d, uint64_t n)
+{
+        return (uint64_t)(d->end - d->p) >= n;
+}
+
+/* room for n items of at least size bytes each. checked before anything is
+ * allocated for a container, so a bogus count cannot make us try. */
+static bool jsonapp_dec_has_items(struct jsonapp_decoder *d, uint64_t n, int size)
+{
+        return n <= (uint64_t)(d->end - d->p) / size;
+}
+
+/* big endian unsigned of n bytes. the caller checked they are there. */
+static uint64_t jsonapp_dec_uint(struct jsonapp_decoder *d, int n)
+{
+        uint64_t v = 0;
+
+        while (n--)
+                v = v << 8 | *d->p++;
+        return v;
+}
+
+/* the n byte length or count that follows */
+static int jsonapp_dec_len(struct jsonapp_decoder *d, int n, uint64_t *len)
+{
+        if (!jsonapp_dec_has(d, n))
+                return jsonapp_dec_fail(d, "truncated");
+        *len = jsonapp_dec_uint(d, n);
+        return 0;
+}
+
+static int jsonapp_dec_string(struct jsonapp_decoder *d, uint64_t len, struct json_object **obj)
+{
+        if (!jsonapp_dec_has(d, len))
+                return jsonapp_dec_fail(d, "truncated string");
+        *obj = json_object_new_string_len((const char *)d->p, len);
+        d->p += len;
+        return 0;
+}
+
+static int jsonapp_dec_double(struct jsonapp_decoder *d, double v, struct json_object **obj)
+{
+        /* json has no way to say these */
+        if (!isfinite(v))
+                return jsonapp_dec_fail(d, "non-finite number");
+        *obj = json_object_new_double(v);
+        return 0;
+}
+
+/* keys are not nul terminated in either encoding */
+static void jsonapp_dec_add(struct json_object *map, const unsigned char *key, size_t len,
+                            struct json_object *val)
+{
+        char buf[64];
+        char *k = buf;
+
+        if (len >= sizeof buf && !(k = malloc(len + 1)))
+                jsonapp_die("insufficient memory for binary decoder");
+        memcpy(k, key, len);
+        k[len] = '\0';
+        json_object_object_add(map, k, val);
+        if (k != buf)
+                free(k);
+        return;
+}
+
+static int jsonapp_dec_enter(struct jsonapp_decoder *d)
+{
+        if (d->depth == JSONAPP_MAX_DEPTH)
+                return jsonapp_dec_fail(d, "nesting too deep");
+        d->depth++;
+        return 0;
+}
+
+/* messagepack */
+
+static int jsonapp_msgpack_value(struct jsonapp_decoder *d, struct json_object **obj);
+
+/* a map key must be a string; it is used in place */
+static int jsonapp_msgpack_key(struct jsonapp_decoder *d, const unsigned char **key,
+                               uint64_t *len)
+{
+        unsigned char b;
+
+        if (!jsonapp_dec_has(d, 1))
+                return jsonapp_dec_fail(d, "truncated");
+        b = *d->p;
+        if (b >= 0xa0 && b <= 0xbf) {
+                d->p++;
+                *len = b & 0x1f;
+        } else if (b >= 0xd9 && b <= 0xdb) {
+                d->p++;
+                if (jsonapp_dec_len(d, 1 << (b - 0xd9), len) != 0)
+                        return -1;
+        } else {
+                return jsonapp_dec_fail(d, "map key is not a string");
+        }
+        if (!jsonapp_dec_has(d, *len))
+                return jsonapp_dec_fail(d, "truncated string");
+        *key = d->p;
+        d->p += *len;
+        return 0;
+}
+
+static int jsonapp_msgpack_map(struct jsonapp_decoder *d, uint64_t n, struct json_object **obj)
+{
+        struct json_object *val;
+        const unsigned char *key = NULL;
+        uint64_t len = 0;
+        uint64_t i;
+
+        if (!jsonapp_dec_has_items(d, n, 2))
+                return jsonapp_dec_fail(d, "truncated map");
+        if (jsonapp_dec_enter(d) != 0)
+                return -1;
+        if (!(*obj = json_object_new_object()))
+                jsonapp_die("insufficient memory for binary decoder");
+        for (i = 0; i < n; i++) {
+                if (jsonapp_msgpack_key(d, &key, &len) != 0)
+                        return -1;
+                if (jsonapp_msgpack_value(d, &val) != 0) {
+                        json_object_put(val);
+                        return -1;
+                }
+                jsonapp_dec_add(*obj, key, len, val);
+        }
+        d->depth--;
+        return 0;
+}
+
+static int jsonapp_msgpack_array(struct jsonapp_decoder *d, uint64_t n, struct json_object **obj)
+{
+        struct json_object *val;
+        uint64_t i;
+
+        if (!jsonapp_dec_has_items(d, n, 1))
+                return jsonapp_dec_fail(d, "truncated array");
+        if (jsonapp_dec_enter(d) != 0)
+                return -1;
+        if (!(*obj = json_object_new_array()))
+                jsonapp_die("insufficient memory for binary decoder");
+        for (i = 0; i < n; i++) {
+                if (jsonapp_msgpack_value(d, &val) != 0) {
+                        json_object_put(val);
+                        return -1;
+                }
+                json_object_array_add(*obj, val);
+        }
+        d->depth--;
+        return 0;
+}
+
+/* on error *obj holds what was decoded so far, for the caller to put */
+static int jsonapp_msgpack_value(struct jsonapp_decoder *d, struct json_object **obj)
+{
+        unsigned char b;
+        uint64_t n;
+        uint32_t f32;
+        uint64_t f64;
+        float f;
+        double v;
+        int width;
+
+        *obj = NULL;
+        if (!jsonapp_dec_has(d, 1))
+                return jsonapp_dec_fail(d, "truncated");
+        b = *d->p++;
+        if (b <= 0x7f || b >= 0xe0) {
+                *obj = json_object_new_int64((int8_t)b);
+                return 0;
+        }
+        if (b <= 0x8f)
+                return jsonapp_msgpack_map(d, b & 0x0f, obj);
+        if (b <= 0x9f)
+                return jsonapp_msgpack_array(d, b & 0x0f, obj);
+        if (b <= 0xbf)
+                return jsonapp_dec_string(d, b & 0x1f, obj);
+
+        switch (b) {
+        case 0xc0:
+                return 0;
+        case 0xc2:
+        case 0xc3:
+                *obj = json_object_new_boolean(b == 0xc3);
+                return 0;
+        case 0xc4:      /* bin 8/16/32, kept as a string */
+        case 0xc5:
+        case 0xc6:
+                if (jsonapp_dec_len(d, 1 << (b - 0xc4), &n) != 0)
+                        return -1;
+                return jsonapp_dec_string(d, n, obj);
+        case 0xca:
+                if (!jsonapp_dec_has(d, 4))
+                        return jsonapp_dec_fail(d, "truncated");
+                f32 = jsonapp_dec_uint(d, 4);
+                memcpy(&f, &f32, sizeof f);
+                return jsonapp_dec_double(d, f, obj);
+        case 0xcb:
+                if (!jsonapp_dec_has(d, 8))
+                        return jsonapp_dec_fail(d, "truncated");
+                f64 = jsonapp_dec_uint(d, 8);
+                memcpy(&v, &f64, sizeof v);
+                return jsonapp_dec_double(d, v, obj);
+        case 0xcc:      /* uint 8/16/32/64 */
+        case 0xcd:
+        case 0xce:
+        case 0xcf:
+                if (jsonapp_dec_len(d, 1 << (b - 0xcc), &n) != 0)
+                        return -1;
+                if (n > INT64_MAX)
+                        return jsonapp_dec_fail(d, "integer out of range");
+                *obj = json_object_new_int64(n);
+                return 0;
+        case 0xd0:      /* int 8/16/32/64 */
+        case 0xd1:
+        case 0xd2:
+        case 0xd3:
+                width = 1 << (b - 0xd0);
+                if (jsonapp_dec_len(d, width, &n) != 0)
+                        return -1;
+                if (width < 8 && (n & (1ull << (width * 8 - 1))))
+                        n |= ~0ull << (width * 8);
+                *obj = json_object_new_int64((int64_t)n);
+                return 0;
+        case 0xd9:      /* str 8/16/32 */
+        case 0xda:
+        case 0xdb:
+                if (jsonapp_dec_len(d, 1 << (b - 0xd9), &n) != 0)
+                        return -1;
+                return jsonapp_dec_string(d, n, obj);
+        case 0xdc:
+        case 0xdd:
+                if (jsonapp_dec_len(d, b == 0xdc ? 2 : 4, &n) != 0)
+                        return -1;
+                return jsonapp_msgpack_array(d, n, obj);
+        case 0xde:
+        case 0xdf:
+                if (jsonapp_dec_len(d, b == 0xde ? 2 : 4, &n) != 0)
+                        return -1;
+                return jsonapp_msgpack_map(d, n, obj);
+        }
+        d->p--;
+        return jsonapp_dec_fail(d, "unsupported type");
+}
+
+/* cbor */
+
+#define JSONAPP_CBOR_BREAK 0xff
+#define JSONAPP_CBOR_INDEFINITE 31
+
+static int jsonapp_cbor_value(struct jsonapp_decoder *d, struct json_object **obj);
+
+/* the argument that follows an initial byte with additional info ai */
+static int jsonapp_cbor_arg(struct jsonapp_decoder *d, unsigned char ai, uint64_t *arg)
+{
+        if (ai < 24) {
+                *arg = ai;
+                return 0;
+        }
+        if (ai > 27) {
+                d->p--;
+                return jsonapp_dec_fail(d, "invalid length");
+        }
+        return jsonapp_dec_len(d, 1 << (ai - 24), arg);
+}
+
+static bool jsonapp_cbor_at_break(struct jsonapp_decoder *d)
+{
+        if (d->p < d->end && *d->p == JSONAPP_CBOR_BREAK) {
+                d->p++;
+                return true;
+        }
+        return false;
+}
+
+/* a string sent in chunks of the same major type, ended by a break */
+static int jsonapp_cbor_chunked_string(struct jsonapp_decoder *d, unsigned char major,
+                                       struct json_object **obj)
+{
+        unsigned char b;
+        uint64_t len;
+        size_t size = 0;
+        char *buf = NULL;
+        char *tmp;
+
+        while (!jsonapp_cbor_at_break(d)) {
+                if (!jsonapp_dec_has(d, 1) || (*d->p >> 5) != major ||
+                    (*d->p & 0x1f) == JSONAPP_CBOR_INDEFINITE) {
+                        free(buf);
+                        return jsonapp_dec_fail(d, "invalid string chunk");
+                }
+                b = *d->p++;
+                if (jsonapp_cbor_arg(d, b & 0x1f, &len) != 0 || !jsonapp_dec_has(d, len)) {
+                        free(buf);
+                        return jsonapp_dec_fail(d, "truncated string");
+                }
+                if (!(tmp = realloc(buf, size + len + 1)))
+                        jsonapp_die("insufficient memory for binary decoder");
+                buf = tmp;
+                memcpy(buf + size, d->p, len);
+                size += len;
+                d->p += len;
+        }
+        *obj = json_object_new_string_len(buf ? buf : "", size);
+        free(buf);
+        return 0;
+}
+
+/* keys are used in place when they are plain text strings */
+static int jsonapp_cbor_pair(struct jsonapp_decoder *d, struct json_object *map)
+{
+        struct json_object *key;
+        struct json_object *val;
+        const unsigned char *str;
+        unsigned char b;
+        uint64_t len;
+
+        if (!jsonapp_dec_has(d, 1))
+                return jsonapp_dec_fail(d, "truncated map");
+        b = *d->p;
+        if ((b >> 5) == 3 && (b & 0x1f) != JSONAPP_CBOR_INDEFINITE) {
+                d->p++;
+                if (jsonapp_cbor_arg(d, b & 0x1f, &len) != 0)
+                        return -1;
+                if (!jsonapp_dec_has(d, len))
+                        return jsonapp_dec_fail(d, "truncated string");
+                str = d->p;
+                d->p += len;
+                if (jsonapp_cbor_value(d, &val) != 0) {
+                        json_object_put(val);
+                        return -1;
+                }
+                jsonapp_dec_add(map, str, len, val);
+                return 0;
+        }
+
+        if (jsonapp_cbor_value(d, &key) != 0 || !json_object_is_type(key, json_type_string)) {
+                json_object_put(key);
+                return jsonapp_dec_fail(d, "map key is not a string");
+        }
+        if (jsonapp_cbor_value(d, &val) != 0) {
+                json_object_put(key);
+                json_object_put(val);
+                return -1;
+        }
+        json_object_object_add(map, json_object_get_string(key), val);
+        json_object_put(key);
+        return 0;
+}
+
+static int jsonapp_cbor_map(struct jsonapp_decoder *d, unsigned char ai, struct json_object **obj)
+{
+        uint64_t n = 0;
+        uint64_t i;
+
+        if (ai != JSONAPP_CBOR_INDEFINITE) {
+                if (jsonapp_cbor_arg(d, ai, &n) != 0)
+                        return -1;
+                if (!jsonapp_dec_has_items(d, n, 2))
+                        return jsonapp_dec_fail(d, "truncated map");
+        }
+        if (jsonapp_dec_enter(d) != 0)
+                return -1;
+        if (!(*obj = json_object_new_object()))
+                jsonapp_die("insufficient memory for binary decoder");
+        for (i = 0; ai == JSONAPP_CBOR_INDEFINITE ? !jsonapp_cbor_at_break(d) : i < n; i++) {
+                if (jsonapp_cbor_pair(d, *obj) != 0)
+                        return -1;
+        }
+        d->depth--;
+        return 0;
+}
+
+static int jsonapp_cbor_array(struct jsonapp_decoder *d, unsigned char ai,
+                              struct json_object **obj)
+{
+        struct json_object *val;
+        uint64_t n = 0;
+        uint64_t i;
+
+        if (ai != JSONAPP_CBOR_INDEFINITE) {
+                if (jsonapp_cbor_arg(d, ai, &n) != 0)
+                        return -1;
+                if (!jsonapp_dec_has_items(d, n, 1))
+                        return jsonapp_dec_fail(d, "truncated array");
+        }
+        if (jsonapp_dec_enter(d) != 0)
+                return -1;
+        if (!(*obj = json_object_new_array()))
+                jsonapp_die("insufficient memory for binary decoder");
+        for (i = 0; ai == JSONAPP_CBOR_INDEFINITE ? !jsonapp_cbor_at_break(d) : i < n; i++) {
+                if (jsonapp_cbor_value(d, &val) != 0) {
+                        json_object_put(val);
+                        return -1;
+                }
+                json_object_array_add(*obj, val);
+        }
+        d->depth--;
+        return 0;
+}
+
+/* ieee 754 half precision, without pulling in libm for ldexp() */
+static double jsonapp_cbor_half(uint16_t h)
+{
+        int exp = (h >> 10) & 0x1f;
+        int mant = h & 0x3ff;
+        double v;
+
+        if (exp == 0)
+                v = mant / 16777216.0;
+        else if (exp == 31)
+                v = mant ? NAN : INFINITY;
+        else if (exp >= 25)
+                v = (double)(mant + 1024) * (1 << (exp - 25));
+        else
+                v = (mant + 1024) / (double)(1 << (25 - exp));
+        return h & 0x8000 ? -v : v;
+}
+
+static int jsonapp_cbor_simple(struct jsonapp_decoder *d, unsigned char ai,
+                               struct json_object **obj)
+{
+        uint32_t f32;
+        uint64_t f64;
+        float f;
+        double v;
+
+        switch (ai) {
+        case 20:
+        case 21:
+                *obj = json_object_new_boolean(ai == 21);
+                return 0;
+        case 22:        /* null */
+        case 23:        /* undefined */
+                return 0;
+        case 25:
+                if (!jsonapp_dec_has(d, 2))
+                        return jsonapp_dec_fail(d, "truncated");
+                return jsonapp_dec_double(d, jsonapp_cbor_half(jsonapp_dec_uint(d, 2)), obj);
+        case 26:
+                if (!jsonapp_dec_has(d, 4))
+                        return jsonapp_dec_fail(d, "truncated");
+                f32 = jsonapp_dec_uint(d, 4);
+                memcpy(&f, &f32, sizeof f);
+                return jsonapp_dec_double(d, f, obj);
+        case 27:
+                if (!jsonapp_dec_has(d, 8))
+                        return jsonapp_dec_fail(d, "truncated");
+                f64 = jsonapp_dec_uint(d, 8);
+                memcpy(&v, &f64, sizeof v);
+                return jsonapp_dec_double(d, v, obj);
+        case JSONAPP_CBOR_INDEFINITE:
+                d->p--;
+                return jsonapp_dec_fail(d, "unexpected break");
+        }
+        d->p--;
+        return jsonapp_dec_fail(d, "unsupported simple value");
+}
+
+/* on error *obj holds what was decoded so far, for the caller to put */
+static int jsonapp_cbor_value(struct jsonapp_decoder *d, struct json_object **obj)
+{
+        unsigned char major;
+        unsigned char ai;
+        uint64_t arg;
+        int err;
+
+        *obj = NULL;
+        if (!jsonapp_dec_has(d, 1))
+                return jsonapp_dec_fail(d, "truncated");
+        major = *d->p >> 5;
+        ai = *d->p & 0x1f;
+        d->p++;
+
+        switch (major) {
+        case 0:
+        case 1:
+                if (jsonapp_cbor_arg(d, ai, &arg) != 0)
+                        return -1;
+                if (arg > INT64_MAX)
+                        return jsonapp_dec_fail(d, "integer out of range");
+                *obj = json_object_new_int64(major ? -1 - (int64_t)arg : (int64_t)arg);
+                return 0;
+        case 2:         /* byte strings are kept as strings */
+        case 3:
+                if (ai == JSONAPP_CBOR_INDEFINITE)
+                        return jsonapp_cbor_chunked_string(d, major, obj);
+                if (jsonapp_cbor_arg(d, ai, &arg) != 0)
+                        return -1;
+                return jsonapp_dec_string(d, arg, obj);
+        case 4:
+                return jsonapp_cbor_array(d, ai, obj);
+        case 5:
+                return jsonapp_cbor_map(d, ai, obj);
+        case 6:
+                /* tags, like the self-described cbor one, carry nothing the
+                 * backends need */
+                if (jsonapp_cbor_arg(d, ai, &arg) != 0 || jsonapp_dec_enter(d) != 0)
+                        return -1;
+                err = jsonapp_cbor_value(d, obj);
+                d->depth--;
+                return err;
+        default:
+                return jsonapp_cbor_simple(d, ai, obj);
+        }
+}
+
+/* decode a binary push into the tree json_tokener would have built from the
+ * same document in json. returns NULL with the reason recorded by
+ * jsonapp_invalid() if it is malformed. */
+struct json_object *jsonapp_decode(struct jsonapp_parse_ctx *jctx, const struct jsonapp_msg *msg,
+                                   enum jsonapp_encoding encoding)
+{
+        struct jsonapp_decoder d = { .jctx = jctx };
+        struct json_object *root;
+        int err;
+
+        d.name = encoding == JSONAPP_ENCODING_CBOR ? "cbor" : "messagepack";
+        if (msg->parts->next) {
+                jsonapp_invalid(jctx, "unable to decode %s message: it was sent in parts", d.name);
+                return NULL;
+        }
+        d.start = d.p = (const unsigned char *)msg->parts->data;
+        d.end = d.start + msg->parts->len;
+
+        if (encoding == JSONAPP_ENCODING_CBOR)
+                err = jsonapp_cbor_value(&d, &root);
+        else
+                err = jsonapp_msgpack_value(&d, &root);
+        if (!err && d.p != d.end)
+                err = jsonapp_dec_fail(&d, "trailing data");
+        if (err) {
+                json_object_put(root);
+                return NULL;
+        }
+        return root;
+}
@@ -4,15 +4,27 @@
 #include <sys/types.h>
 #include <string.h>
 
-struct uci_package *hotspot_package;
+/* only the first wlan is used: server0 of its first two radius servers and
+ * its first guest access entry */
+static const struct jsonapp_map chilli_map[] = {
+        { "WlanGroup.wlans[0].radiusServerList[0].servers[0].ip", json_type_string,
+          "chilli.@chilli[0].HS_RADIUS" },
+        { "WlanGroup.wlans[0].radiusServerList[0].servers[0].secret", json_type_string,
+          "chilli.@chilli[0].HS_RADSECRET" },
+        { "WlanGroup.wlans[0].radiusServerList[0].servers[0].ip", json_type_string,
+          "chilli.@chilli[0].HS_UAMALLOW" },
+        { "WlanGroup.wlans[0].radiusServerList[0].servers[0].port", json_type_string,
+          "chilli.@chilli[0].HS_PORT" },
+        { "WlanGroup.wlans[0].radiusServerList[1].servers[0].ip", json_type_string,
+          "chilli.@chilli[0].HS_RADIUS2" },
+        { "WlanGroup.wlans[0].guestAccessList[0].portalUrl", json_type_string,
+          "chilli.@chilli[0].HS_UAMHOMEPAGE" },
+        { NULL }
+};
 
-static void reset_chilli_uci(struct jsonapp_parse_ctx *jctx)
-{
-        if (uci_load(jctx->uci_ctx, "chilli", &hotspot_package) != UCI_OK) {
-                jsonapp_die("error loading /etc/config/chilli");
-        }
-        return;
-}
+static const char *const chilli_packages[] = { "chilli", NULL };
+
+static struct jsonapp_parse_backend chilli_parse_backend;
 
 static struct jsonapp_parse_ctx *chilli_init_context(struct jsonapp_parse_ctx *jctx)
 {
@@ -20,82 +32,58 @@ static struct jsonapp_parse_ctx *chilli_init_context(struct jsonapp_parse_ctx *j
 
         /* find /etc/config/hotspot.
          *
-         * if it exists, reset it completely. we will replace all contents 
-         * using the input json file.
+         * if it exists, load it once. it stays cached for the lifetime of
+         * the process and is only reloaded when it changes on disk.
          *
          * if it does not exist, error gross. this is assumed to exist!
          */
-        has_config = jsonapp_has_config(jctx, "chilli", reset_chilli_uci, false);
+        has_config = jsonapp_has_config(jctx, "chilli", NULL, false);
         if (!has_config)
                 jsonapp_die("cannot find /etc/config/chilli");
+        if (!jsonapp_uci_package(jctx, "chilli"))
+                jsonapp_die("error loading /etc/config/chilli");
         return jctx;
 }
 
-void chilli_set_option(struct jsonapp_parse_ctx *jctx,
-                       struct json_object *obj,
-                       char *obj_member,
-                       char *option_name,
-                       enum json_type expected_type)
-{
-        char tuple[512];
-        struct json_object *member;
-        struct uci_ptr ptr;
-        int err;
-        member = jsonapp_object_get_object_by_name(obj, obj_member, expected_type);
-        sprintf(tuple, "chilli.@chilli[0].%s=%s", option_name,
-                       json_object_get_string(member));
-        err = uci_lookup_ptr(jctx->uci_ctx, &ptr, tuple, true);
-        if (err) {
-        	printf("not found");
-        }
-        uci_set(jctx->uci_ctx, &ptr);
-        return;
-}
-
 static int chilli_process_json(struct jsonapp_parse_ctx *jctx, struct json_object *root)
 {
-        struct json_object *wlan;
-        struct json_object *radius;
-        struct json_object *guest_acl;
-        struct json_object *server;
-
-        /* process only 1 wlan object */
-        wlan = jsonapp_get_wlans(jsonapp_get_wlangrp(root));
-        wlan = json_object_array_get_idx(wlan, 0);
+        struct uci_package *hotspot_package;
+        struct jsonapp_diff *diff;
+        int changes;
 
-        /* process server0 in radiusserver0 */
-        radius = json_object_array_get_idx(jsonapp_get_radius_servers(wlan), 0);
-        server = json_object_array_get_idx(jsonapp_get_servers(radius), 0);
-        chilli_set_option(jctx, server, "ip", "HS_RADIUS", json_type_string);
-        chilli_set_option(jctx, server, "secret", "HS_RADSECRET", json_type_string);
-        chilli_set_option(jctx, server, "ip", "HS_UAMALLOW", json_type_string);
-        chilli_set_option(jctx, server, "port", "HS_PORT", json_type_string);
+        if (!(hotspot_package = jsonapp_uci_package(jctx, "chilli")))
+                return -1;
 
-        /* process server0 in radiusserver1 */
-        radius = json_object_array_get_idx(jsonapp_get_radius_servers(wlan), 1);
-        server = json_object_array_get_idx(jsonapp_get_servers(radius), 0);
-        chilli_set_option(jctx, server, "ip", "HS_RADIUS2", json_type_string);      
+        /* only the HS_* options in chilli_map are managed in chilli.@chilli[0] */
+        diff = jsonapp_diff_new(jsonapp_arena(jctx, &chilli_parse_backend), NULL);
+        jsonapp_map_to_diff(jctx, &chilli_parse_backend, "chilli", diff);
 
-        /* guest access list */
-        guest_acl = jsonapp_get_guest_acl_list(wlan);
-        guest_acl = json_object_array_get_idx(guest_acl, 0);
-        chilli_set_option(jctx, guest_acl, "portalUrl", "HS_UAMHOMEPAGE", json_type_string);
-        
-        uci_save(jctx->uci_ctx, hotspot_package);
-        uci_commit(jctx->uci_ctx, &hotspot_package, true);
-        return 0;
+        changes = jsonapp_diff_apply(jctx, hotspot_package, diff);
+        if (changes > 0)
+                jsonapp_uci_stage(jctx, hotspot_package);
+        return changes;
 }
 
-static void chilli_exit_context(struct jsonapp_parse_ctx *jctx)
+/* chilli reads its HS_* options only when it starts */
+static int chilli_reload(struct jsonapp_parse_ctx *jctx, struct jsonapp_change **changes, int nr)
 {
-        uci_unload(jctx->uci_ctx, hotspot_package);
-        return;
+        static char *const restart[] = { "/etc/init.d/chilli", "restart", NULL };
+        int i;
+
+        for (i = 0; i < nr; i++) {
+                if (changes[i]->option && strncmp(changes[i]->option, "HS_", 3) == 0)
+                        return jsonapp_reload_run(restart);
+        }
+        return 0;
 }
 
 static struct jsonapp_parse_backend chilli_parse_backend = {
+        .name = "chilli",
         .init = chilli_init_context,
+        .map = chilli_map,
+        .packages = chilli_packages,
         .process_json = chilli_process_json,
-        .exit = chilli_exit_context,
+        .reload = chilli_reload,
 };
 
 static void __jsonapp_init__ chilli_engine_init(void)
@@ -0,0 +1,248 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD_H
+#include <zstd.h>
+#endif
+#include "json-app.h"
+
+/* compressed pushes.
+ *
+ * a WlanGroup with many wlans is mostly repeated member names and shrinks
+ * 10-20x with deflate or zstd, so the controller may send the json text
+ * compressed. it is never inflated into a buffer of its own: every chunk
+ * that comes out of the decompressor goes straight into the tokener, so
+ * only the compressed push and one chunk are held at a time. what the
+ * push inflates to is limited by -z (max_inflated); decompression stops as
+ * soon as it goes over, so a small push cannot make us inflate gigabytes.
+ *
+ * zlib and gzip streams are inflated by zlib, zstd frames only if the
+ * agent was built with zstd. */
+
+#define JSONAPP_INFLATE_CHUNK (16 * 1024)
+
+struct jsonapp_inflater {
+        z_stream zs;
+#ifdef HAVE_ZSTD_H
+        ZSTD_DCtx *zds;
+#endif
+        char out[JSONAPP_INFLATE_CHUNK];
+};
+
+/* where the tokener is while the output comes in */
+struct jsonapp_inflate_state {
+        struct jsonapp_parse_ctx *jctx;
+        const char *name;
+        struct json_object *root;
+        size_t inflated;
+        bool done;                              /* the document is complete */
+};
+
+/* a decompressor for pushes inflating to at most max_inflated bytes. the
+ * gateway keeps one per worker; see gateway.c. */
+struct jsonapp_inflater *jsonapp_inflater_new(int max_inflated)
+{
+        struct jsonapp_inflater *inf;
+
+        if (!(inf = calloc(1, sizeof *inf)))
+                jsonapp_die("insufficient memory for decompressor");
+        /* 32 added to the window bits takes zlib and gzip headers alike */
+        if (inflateInit2(&inf->zs, 15 + 32) != Z_OK)
+                jsonapp_die("unable to set up zlib: %s", inf->zs.msg ? inf->zs.msg : "");
+#ifdef HAVE_ZSTD_H
+        {
+                int window_log = 10;
+
+                if (!(inf->zds = ZSTD_createDCtx()))
+                        jsonapp_die("insufficient memory for zstd context");
+                /* the window never needs to be larger than what the push may
+                 * inflate to; refuse frames asking for more memory than that */
+                while (window_log < 27 && (1 << window_log) < max_inflated)
+                        window_log++;
+                ZSTD_DCtx_setParameter(inf->zds, ZSTD_d_windowLogMax, window_log);
+        }
+#endif
+        return inf;
+}
+
+void jsonapp_inflater_free(struct jsonapp_inflater *inf)
+{
+        if (!inf)
+                return;
+        inflateEnd(&inf->zs);
+#ifdef HAVE_ZSTD_H
+        ZSTD_freeDCtx(inf->zds);
+#endif
+        free(inf);
+        return;
+}
+
+void jsonapp_inflate_init(struct jsonapp_parse_ctx *jctx)
+{
+        if (!jctx->inflater)
+                jctx->inflater = jsonapp_inflater_new(jctx->max_inflated);
+        return;
+}
+
+void jsonapp_inflate_exit(struct jsonapp_parse_ctx *jctx)
+{
+        jsonapp_inflater_free(jctx->inflater);
+        jctx->inflater = NULL;
+        return;
+}
+
+/* hand len freshly inflated bytes to the tokener. once the document is
+ * complete only whitespace may follow, as for plain json. */
+static int jsonapp_inflate_feed(struct jsonapp_inflate_state *st, const char *data, size_t len)
+{
+        struct jsonapp_parse_ctx *jctx = st->jctx;
+        struct json_tokener *tok = jctx->tokener;
+        enum json_tokener_error jerr;
+        size_t offset = st->inflated;
+        size_t i = 0;
+
+        if (!len)
+                return 0;
+        st->inflated += len;
+        if (st->inflated > (size_t)jctx->max_inflated)
+                return jsonapp_invalid(jctx, "unable to decompress %s message: "
+                                       "larger than %d bytes once inflated",
+                                       st->name, jctx->max_inflated);
+        if (!st->done) {
+                st->root = json_tokener_parse_ex(tok, data, len);
+                jerr = json_tokener_get_error(tok);
+                if (jerr == json_tokener_continue)
+                        return 0;
+                i = json_tokener_get_parse_end(tok);
+                if (jerr != json_tokener_success)
+                        return jsonapp_invalid(jctx, "unable to parse json message: "
+                                               "%s at offset %zu of the inflated %s message",
+                                               json_tokener_error_desc(jerr), offset + i,
+                                               st->name);
+                st->done = true;
+        }
+        for (; i < len; i++) {
+                if (!strchr(" \t\r\n", data[i]))
+                        return jsonapp_invalid(jctx, "unable to parse json message: "
+                                               "trailing data at offset %zu of the inflated "
+                                               "%s message", offset + i, st->name);
+        }
+        return 0;
+}
+
+static int jsonapp_inflate_zlib(struct jsonapp_inflate_state *st, const struct jsonapp_msg *msg)
+{
+        struct jsonapp_inflater *inf = st->jctx->inflater;
+        const struct jsonapp_msg_part *part;
+        z_stream *zs = &inf->zs;
+        size_t consumed = 0;
+        int ret = Z_OK;
+
+        inflateReset(zs);
+        for (part = msg->parts; part && ret != Z_STREAM_END; part = part->next) {
+                zs->next_in = (unsigned char *)part->data;
+                zs->avail_in = part->len;
+                do {
+                        zs->next_out = (unsigned char *)inf->out;
+                        zs->avail_out = sizeof inf->out;
+                        ret = inflate(zs, Z_NO_FLUSH);
+                        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+                                return jsonapp_invalid(st->jctx, "unable to decompress %s "
+                                                       "message: %s at offset %zu", st->name,
+                                                       zs->msg ? zs->msg : "corrupt stream",
+                                                       consumed + part->len - zs->avail_in);
+                        if (jsonapp_inflate_feed(st, inf->out,
+                                                 sizeof inf->out - zs->avail_out) != 0)
+                                return -1;
+                } while (ret != Z_STREAM_END && (zs->avail_in || !zs->avail_out));
+                consumed += part->len - zs->avail_in;
+        }
+
+        if (ret != Z_STREAM_END)
+                return jsonapp_invalid(st->jctx, "unable to decompress %s message: "
+                                       "truncated after %zu bytes", st->name, consumed);
+        /* the final part of a push sent in parts may be empty */
+        while (part && !part->len)
+                part = part->next;
+        if (zs->avail_in || part)
+                return jsonapp_invalid(st->jctx, "unable to decompress %s message: "
+                                       "trailing data at offset %zu", st->name, consumed);
+        return 0;
+}
+
+#ifdef HAVE_ZSTD_H
+static int jsonapp_inflate_zstd(struct jsonapp_inflate_state *st, const struct jsonapp_msg *msg)
+{
+        struct jsonapp_inflater *inf = st->jctx->inflater;
+        const struct jsonapp_msg_part *part;
+        ZSTD_inBuffer in = { NULL, 0, 0 };
+        ZSTD_outBuffer out;
+        size_t consumed = 0;
+        size_t ret = 1;
+
+        ZSTD_DCtx_reset(inf->zds, ZSTD_reset_session_only);
+        for (part = msg->parts; part && ret; part = part->next) {
+                in.src = part->data;
+                in.size = part->len;
+                in.pos = 0;
+                do {
+                        out.dst = inf->out;
+                        out.size = sizeof inf->out;
+                        out.pos = 0;
+                        ret = ZSTD_decompressStream(inf->zds, &out, &in);
+                        if (ZSTD_isError(ret))
+                                return jsonapp_invalid(st->jctx, "unable to decompress %s "
+                                                       "message: %s at offset %zu", st->name,
+                                                       ZSTD_getErrorName(ret),
+                                                       consumed + in.pos);
+                        if (jsonapp_inflate_feed(st, inf->out, out.pos) != 0)
+                                return -1;
+                } while (ret && (in.pos < in.size || out.pos == out.size));
+                consumed += in.pos;
+        }
+
+        /* 0 is returned once a frame is complete and flushed */
+        if (ret)
+                return jsonapp_invalid(st->jctx, "unable to decompress %s message: "
+                                       "truncated after %zu bytes", st->name, consumed);
+        while (part && !part->len)
+                part = part->next;
+        if (in.pos < in.size || part)
+                return jsonapp_invalid(st->jctx, "unable to decompress %s message: "
+                                       "trailing data at offset %zu", st->name, consumed);
+        return 0;
+}
+#endif
+
+/* inflate a compressed push straight into the tokener. returns the tree
+ * json_tokener would have built from the inflated text, or NULL with the
+ * reason recorded by jsonapp_invalid(). */
+struct json_object *jsonapp_inflate(struct jsonapp_parse_ctx *jctx, const struct jsonapp_msg *msg,
+                                    enum jsonapp_encoding encoding)
+{
+        struct jsonapp_inflate_state st = { .jctx = jctx };
+        int err;
+
+        json_tokener_reset(jctx->tokener);
+        if (encoding == JSONAPP_ENCODING_ZSTD) {
+                st.name = "zstd";
+#ifdef HAVE_ZSTD_H
+                err = jsonapp_inflate_zstd(&st, msg);
+#else
+                err = jsonapp_invalid(jctx, "unable to decompress zstd message: "
+                                      "built without zstd");
+#endif
+        } else {
+                st.name = "deflate";
+                err = jsonapp_inflate_zlib(&st, msg);
+        }
+        if (!err && !st.done)
+                err = jsonapp_invalid(jctx, "unable to parse json message: incomplete after "
+                                      "%zu bytes inflated", st.inflated);
+        if (err) {
+                json_object_put(st.root);
+                return NULL;
+        }
+        return st.root;
+}
@@ -0,0 +1,349 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "json-app.h"
+
+/* gateway mode (-G <root>): one process, and one broker connection, for
+ * every device below adopt/device/+.
+ *
+ * each device is known by the mac in its topic and has a config directory
+ * <root>/<mac> of its own, with a context and copies of the backends of its
+ * own that are created with the first push for it. the main loop keeps the
+ * devices in a hash table and shards them by mac over a pool of workers,
+ * one per cpu or as many as -j says. a device always goes to the same
+ * worker, so its pushes are applied one after the other and in order while
+ * other devices apply on the other workers.
+ *
+ * a worker has a run queue of devices rather than of messages. a device
+ * holds the newest push not applied yet and is on the queue at most once;
+ * a push that comes in before the one before it was taken replaces it, as
+ * the apply queue coalesces pushes for a topic. a burst of pushes for
+ * thousands of devices therefore queues one push per device and never
+ * drops any.
+ *
+ * only so many device contexts stay loaded (-C); each worker keeps its
+ * share of them in least recently applied order and frees the context of
+ * the device that was applied longest ago to make room for another. a
+ * device whose context was freed gets a new one with its next push, which
+ * finds the device's snapshot and packages where the old one left them. */
+
+#define JSONAPP_GATEWAY_BUCKETS 1024            /* power of two */
+
+struct jsonapp_gateway_worker {
+        struct jsonapp_gateway *gw;
+        pthread_t thread;
+        pthread_mutex_t lock;
+        pthread_cond_t cond;                    /* a device was queued or the gateway stops */
+        struct jsonapp_device *head;
+        struct jsonapp_device *tail;
+        unsigned int depth;
+        unsigned int coalesced;
+        bool stop;
+        /* devices with a context, least recently applied first */
+        struct jsonapp_device *lru_head;
+        struct jsonapp_device *lru_tail;
+        int nr_contexts;
+        int max_contexts;
+        /* lent to the context of the device being applied */
+        struct json_tokener *tokener;
+        struct jsonapp_inflater *inflater;
+        struct jsonapp_arenas *arenas;
+};
+
+struct jsonapp_gateway {
+        struct jsonapp_parse_ctx *jctx;
+        struct jsonapp_device *buckets[JSONAPP_GATEWAY_BUCKETS];
+        struct jsonapp_gateway_worker *workers;
+        int nr_workers;
+        int nr_devices;                         /* main loop only */
+};
+
+/* adopt/device/<12 lowercase hex digits> */
+static int jsonapp_gateway_parse_mac(const char *topic, uint8_t *mac)
+{
+        static const char prefix[] = "adopt/device/";
+        const char *p;
+        int i;
+
+        if (strncmp(topic, prefix, sizeof prefix - 1) != 0)
+                return -1;
+        p = topic + sizeof prefix - 1;
+        /* in lowercase, as the device's own topics, so that the result goes
+         * to the topic the push came in on */
+        for (i = 0; i < 12; i++) {
+                if (!isdigit((unsigned char)p[i]) && (p[i] < 'a' || p[i] > 'f'))
+                        return -1;
+        }
+        if (p[12])
+                return -1;
+        for (i = 0; i < 6; i++)
+                sscanf(p + 2 * i, "%2hhx", &mac[i]);
+        return 0;
+}
+
+/* the device a push on topic is for, added on its first push. returns NULL
+ * for a topic that does not name a device. main loop only. */
+struct jsonapp_device *jsonapp_gateway_device(struct jsonapp_parse_ctx *jctx, const char *topic)
+{
+        struct jsonapp_gateway *gw = jctx->gateway;
+        struct jsonapp_device *device;
+        uint8_t mac[6];
+        uint64_t hash;
+
+        if (jsonapp_gateway_parse_mac(topic, mac) != 0) {
+                fprintf(stderr, "ignoring push on %s. not a device topic\n", topic);
+                return NULL;
+        }
+        hash = jsonapp_fnv1a(JSONAPP_FNV1A_INIT, mac, sizeof mac);
+        for (device = gw->buckets[hash % JSONAPP_GATEWAY_BUCKETS]; device; device = device->next) {
+                if (memcmp(device->mac, mac, sizeof mac) == 0)
+                        return device;
+        }
+
+        if (!(device = calloc(1, sizeof *device))) {
+                fprintf(stderr, "insufficient memory. dropping message for %s\n", topic);
+                return NULL;
+        }
+        memcpy(device->mac, mac, sizeof mac);
+        device->worker = &gw->workers[hash % gw->nr_workers];
+        device->next = gw->buckets[hash % JSONAPP_GATEWAY_BUCKETS];
+        gw->buckets[hash % JSONAPP_GATEWAY_BUCKETS] = device;
+        gw->nr_devices++;
+        return device;
+}
+
+/* hand a complete push for device to its worker. main loop only. */
+void jsonapp_gateway_push(struct jsonapp_device *device, struct jsonapp_msg *msg)
+{
+        struct jsonapp_gateway_worker *w = device->worker;
+        struct jsonapp_msg *old;
+
+        msg->seq = ++device->seq;
+        pthread_mutex_lock(&w->lock);
+        if ((old = device->msg))
+                w->coalesced++;
+        device->msg = msg;
+        if (!device->queued) {
+                device->queued = true;
+                device->run_next = NULL;
+                if (w->tail)
+                        w->tail->run_next = device;
+                else
+                        w->head = device;
+                w->tail = device;
+                w->depth++;
+                pthread_cond_signal(&w->cond);
+        }
+        pthread_mutex_unlock(&w->lock);
+        jsonapp_msg_free(old);
+        return;
+}
+
+static void jsonapp_gateway_lru_unlink(struct jsonapp_gateway_worker *w,
+                                       struct jsonapp_device *device)
+{
+        if (device->lru_prev)
+                device->lru_prev->lru_next = device->lru_next;
+        else
+                w->lru_head = device->lru_next;
+        if (device->lru_next)
+                device->lru_next->lru_prev = device->lru_prev;
+        else
+                w->lru_tail = device->lru_prev;
+        device->lru_prev = NULL;
+        device->lru_next = NULL;
+        return;
+}
+
+static void jsonapp_gateway_lru_append(struct jsonapp_gateway_worker *w,
+                                       struct jsonapp_device *device)
+{
+        device->lru_prev = w->lru_tail;
+        device->lru_next = NULL;
+        if (w->lru_tail)
+                w->lru_tail->lru_next = device;
+        else
+                w->lru_head = device;
+        w->lru_tail = device;
+        return;
+}
+
+/* the context of device, loaded and made the most recently used one */
+static struct jsonapp_parse_ctx *jsonapp_gateway_context(struct jsonapp_gateway_worker *w,
+                                                         struct jsonapp_device *device)
+{
+        struct jsonapp_device *idle;
+
+        if (device->jctx) {
+                jsonapp_gateway_lru_unlink(w, device);
+                jsonapp_gateway_lru_append(w, device);
+                return device->jctx;
+        }
+        if (w->nr_contexts >= w->max_contexts && (idle = w->lru_head)) {
+                jsonapp_gateway_lru_unlink(w, idle);
+                jsonapp_free_device_context(idle->jctx);
+                idle->jctx = NULL;
+                w->nr_contexts--;
+        }
+        if (!(device->jctx = jsonapp_alloc_device_context(w->gw->jctx, device->mac)))
+                return NULL;
+        jsonapp_gateway_lru_append(w, device);
+        w->nr_contexts++;
+        return device->jctx;
+}
+
+static void jsonapp_gateway_apply(struct jsonapp_gateway_worker *w,
+                                  struct jsonapp_device *device,
+                                  struct jsonapp_msg *msg)
+{
+        struct jsonapp_parse_ctx *jctx;
+
+        if (!(jctx = jsonapp_gateway_context(w, device))) {
+                fprintf(stderr, "no config directory for %s. dropping message\n", msg->topic);
+                return;
+        }
+        jctx->tokener = w->tokener;
+        jctx->inflater = w->inflater;
+        jctx->arenas = w->arenas;
+        jsonapp_apply(jctx, msg);
+        jctx->tokener = NULL;
+        jctx->inflater = NULL;
+        jctx->arenas = NULL;
+        return;
+}
+
+/* apply the newest push of every queued device until the gateway stops and
+ * nothing is left */
+static void *jsonapp_gateway_worker(void *arg)
+{
+        struct jsonapp_gateway_worker *w = arg;
+        struct jsonapp_device *device;
+        struct jsonapp_msg *msg;
+
+        pthread_mutex_lock(&w->lock);
+        for (;;) {
+                if (!(device = w->head)) {
+                        if (w->stop)
+                                break;
+                        pthread_cond_wait(&w->cond, &w->lock);
+                        continue;
+                }
+                if (!(w->head = device->run_next))
+                        w->tail = NULL;
+                w->depth--;
+                device->queued = false;
+                msg = device->msg;
+                device->msg = NULL;
+                pthread_mutex_unlock(&w->lock);
+
+                jsonapp_gateway_apply(w, device, msg);
+                jsonapp_msg_free(msg);
+                pthread_mutex_lock(&w->lock);
+        }
+        pthread_mutex_unlock(&w->lock);
+        return NULL;
+}
+
+void jsonapp_gateway_init(struct jsonapp_parse_ctx *jctx)
+{
+        struct jsonapp_gateway_worker *w;
+        struct jsonapp_gateway *gw;
+        struct stat st;
+        int i;
+
+        if (stat(jctx->gateway_root, &st) != 0 || !S_ISDIR(st.st_mode))
+                jsonapp_die("gross error: %s is not a directory", jctx->gateway_root);
+        if (!(gw = calloc(1, sizeof *gw)))
+                jsonapp_die("insufficient memory for gateway");
+        gw->jctx = jctx;
+        if ((gw->nr_workers = jctx->apply_threads) <= 0)
+                gw->nr_workers = sysconf(_SC_NPROCESSORS_ONLN);
+        if (gw->nr_workers <= 0)
+                gw->nr_workers = 1;
+        if (!(gw->workers = calloc(gw->nr_workers, sizeof *gw->workers)))
+                jsonapp_die("insufficient memory for gateway workers");
+        jctx->gateway = gw;
+
+        for (i = 0; i < gw->nr_workers; i++) {
+                w = &gw->workers[i];
+                w->gw = gw;
+                /* the share of the contexts of every worker, rounded up */
+                w->max_contexts = (jctx->gateway_contexts + gw->nr_workers - 1) / gw->nr_workers;
+                pthread_mutex_init(&w->lock, NULL);
+                pthread_cond_init(&w->cond, NULL);
+                if (!(w->tokener = json_tokener_new_ex(JSONAPP_MAX_DEPTH)))
+                        jsonapp_die("insufficient memory for json tokener");
+                w->inflater = jsonapp_inflater_new(jctx->max_inflated);
+                w->arenas = jsonapp_arenas_new(jctx->backends);
+                if (pthread_create(&w->thread, NULL, jsonapp_gateway_worker, w) != 0)
+                        jsonapp_die("unable to start gateway worker");
+        }
+        fprintf(stderr, "serving every device below %s on %d workers, %d contexts at most\n",
+                jctx->gateway_root, gw->nr_workers, gw->nr_workers * gw->workers[0].max_contexts);
+        return;
+}
+
+/* let the workers finish what is queued and free every device */
+void jsonapp_gateway_exit(struct jsonapp_parse_ctx *jctx)
+{
+        struct jsonapp_gateway *gw = jctx->gateway;
+        struct jsonapp_gateway_worker *w;
+        struct jsonapp_device *device;
+        int i;
+
+        if (!gw)
+                return;
+        for (i = 0; i < gw->nr_workers; i++) {
+                w = &gw->workers[i];
+                pthread_mutex_lock(&w->lock);
+                w->stop = true;
+                pthread_cond_signal(&w->cond);
+                pthread_mutex_unlock(&w->lock);
+        }
+        for (i = 0; i < gw->nr_workers; i++) {
+                w = &gw->workers[i];
+                pthread_join(w->thread, NULL);
+                json_tokener_free(w->tokener);
+                jsonapp_inflater_free(w->inflater);
+                jsonapp_arenas_free(w->arenas);
+                pthread_cond_destroy(&w->cond);
+                pthread_mutex_destroy(&w->lock);
+        }
+
+        for (i = 0; i < JSONAPP_GATEWAY_BUCKETS; i++) {
+                while ((device = gw->buckets[i])) {
+                        gw->buckets[i] = device->next;
+                        jsonapp_free_device_context(device->jctx);
+                        jsonapp_msg_free(device->pending);
+                        jsonapp_msg_free(device->msg);
+                        free(device);
+                }
+        }
+        free(gw->workers);
+        free(gw);
+        jctx->gateway = NULL;
+        return;
+}
+
+/* the workers' run queues summed up for the stats publisher; depth counts
+ * devices waiting for their push to be applied. returns the number of
+ * devices known. main loop only. */
+int jsonapp_gateway_get_stats(struct jsonapp_parse_ctx *jctx, struct jsonapp_queue_stats *stats)
+{
+        struct jsonapp_gateway *gw = jctx->gateway;
+        struct jsonapp_gateway_worker *w;
+        int i;
+
+        memset(stats, 0, sizeof *stats);
+        for (i = 0; i < gw->nr_workers; i++) {
+                w = &gw->workers[i];
+                pthread_mutex_lock(&w->lock);
+                stats->depth += w->depth;
+                stats->coalesced += w->coalesced;
+                pthread_mutex_unlock(&w->lock);
+        }
+        return gw->nr_devices;
+}
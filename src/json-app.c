@@ -1,5 +1,6 @@
 #include <mosquitto.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -7,7 +8,8 @@
 #include <unistd.h>
 #include <unistd.h>
 #include <dirent.h>
-#include <signal.h>
+#include <errno.h>
+#include <limits.h>
 #include "json-app.h"
 
 static struct jsonapp_parse_backend *backend_list;
@@ -42,16 +44,22 @@ void jsonapp_register_backend(struct jsonapp_parse_backend *backend)
 static void jsonapp_exit_backend(struct jsonapp_parse_backend *backend)
 {
         struct jsonapp_parse_ctx *jctx = backend->jctx;
-        backend->exit(jctx);
+
+        /* never initialized in gateway mode */
+        if (jctx && backend->exit)
+                backend->exit(jctx);
         return;
 }
 
-static int jsonapp_process_json(struct jsonapp_parse_backend *backend, char *json_msg)
+void jsonapp_exit_backends(void)
 {
-        struct jsonapp_parse_ctx *jctx = backend->jctx;
-        struct json_object *root = json_tokener_parse(json_msg);
-        backend->process_json(jctx, root);
-        return 0;
+        struct jsonapp_parse_backend *backend;
+
+        foreach_parse_backend(backend, backend_list) {
+                jsonapp_exit_backend(backend);
+        }
+        jsonapp_map_free_plan();
+        return;
 }
 
 static int jsonapp_init_backend(struct jsonapp_parse_ctx *jctx, 
@@ -62,6 +70,293 @@ static int jsonapp_init_backend(struct jsonapp_parse_ctx *jctx,
         return 0;
 }
 
+/* the mapping plan is compiled once, for the registered backends, and
+ * shared by every context applying them */
+static void jsonapp_compile_backends(struct jsonapp_parse_ctx *jctx)
+{
+        struct jsonapp_parse_backend *backend;
+        int i = 0;
+
+        foreach_parse_backend(backend, backend_list)
+                backend->index = i++;
+        if (!jctx->backends)
+                jctx->backends = backend_list;
+        jsonapp_map_compile(backend_list);
+        if (jctx->lazy_parse && !jsonapp_map_covers(backend_list)) {
+                fprintf(stderr, "not every backend has a mapping table. "
+                                "parsing messages in full\n");
+                jctx->lazy_parse = false;
+        }
+        return;
+}
+
+/* backends are initialized once and stay loaded until the process exits */
+void jsonapp_init_backends(struct jsonapp_parse_ctx *jctx)
+{
+        struct jsonapp_parse_backend *backend;
+
+        jsonapp_compile_backends(jctx);
+        jsonapp_map_init(jctx);
+        jctx->arenas = jsonapp_arenas_new(jctx->backends);
+        if (!jctx->tokener && !(jctx->tokener = json_tokener_new_ex(JSONAPP_MAX_DEPTH)))
+                jsonapp_die("insufficient memory for json tokener");
+        jsonapp_inflate_init(jctx);
+        jsonapp_sched_init(jctx, jctx->backends);
+        foreach_parse_backend(backend, jctx->backends) {
+                jsonapp_init_backend(jctx, backend);
+        }
+        return;
+}
+
+/* a copy of every registered backend for a device's context. what a backend
+ * remembers of the last message (input_hash, its uci context, ...) is the
+ * device's own, the rest is shared. the copies are a single allocation. */
+static void jsonapp_clone_backends(struct jsonapp_parse_ctx *jctx)
+{
+        struct jsonapp_parse_backend *backend;
+        struct jsonapp_parse_backend *clones;
+        int n = 0;
+        int i = 0;
+
+        foreach_parse_backend(backend, backend_list)
+                n++;
+        if (!n)
+                return;
+        if (!(clones = calloc(n, sizeof *clones)))
+                jsonapp_die("insufficient memory for device backends");
+        foreach_parse_backend(backend, backend_list) {
+                clones[i].name = backend->name;
+                clones[i].map = backend->map;
+                clones[i].map_base = backend->map_base;
+                clones[i].packages = backend->packages;
+                clones[i].index = backend->index;
+                clones[i].jctx = jctx;
+                clones[i].validate = backend->validate;
+                clones[i].process_json = backend->process_json;
+                clones[i].next = i + 1 < n ? &clones[i + 1] : NULL;
+                i++;
+        }
+        jctx->backends = clones;
+        return;
+}
+
+/* 64 bit fnv-1a. start with JSONAPP_FNV1A_INIT and feed the previous result
+ * back in to hash data that is not in one piece. */
+uint64_t jsonapp_fnv1a(uint64_t hash, const void *data, size_t len)
+{
+        const unsigned char *p = data;
+        size_t i;
+
+        for (i = 0; i < len; i++) {
+                hash ^= p[i];
+                hash *= 0x100000001b3ull;
+        }
+        return hash;
+}
+
+/* hash of the payload, to tell the controller which config an apply result
+ * belongs to and to recognise the config applied last. a push sent in parts
+ * hashes like the whole. */
+static uint64_t jsonapp_hash_payload(const struct jsonapp_msg *msg)
+{
+        const struct jsonapp_msg_part *part;
+        uint64_t hash = JSONAPP_FNV1A_INIT;
+
+        for (part = msg->parts; part; part = part->next)
+                hash = jsonapp_fnv1a(hash, part->data, part->len);
+        return hash;
+}
+
+/* feed exactly the bytes of every part of msg through the reusable tokener.
+ * a push sent in parts is parsed as it was sent, without joining the parts
+ * into one buffer first. */
+static struct json_object *jsonapp_parse_msg(struct jsonapp_parse_ctx *jctx,
+                                             const struct jsonapp_msg *msg)
+{
+        struct json_tokener *tok = jctx->tokener;
+        const struct jsonapp_msg_part *part;
+        struct json_object *root = NULL;
+        enum json_tokener_error jerr = json_tokener_continue;
+        size_t offset = 0;
+        size_t end;
+
+        json_tokener_reset(tok);
+        for (part = msg->parts; part; part = part->next) {
+                root = json_tokener_parse_ex(tok, part->data, part->len);
+                if ((jerr = json_tokener_get_error(tok)) != json_tokener_continue)
+                        break;
+                offset += part->len;
+        }
+
+        if (jerr == json_tokener_continue) {
+                jsonapp_invalid(jctx, "unable to parse json message: incomplete after %zu bytes",
+                                offset);
+                return NULL;
+        }
+        end = json_tokener_get_parse_end(tok);
+        if (jerr != json_tokener_success) {
+                jsonapp_invalid(jctx, "unable to parse json message: %s at offset %zu",
+                                json_tokener_error_desc(jerr), offset + end);
+                return NULL;
+        }
+
+        /* nothing but whitespace may follow the document */
+        for (; part; part = part->next, end = 0) {
+                for (; end < (size_t)part->len; end++) {
+                        if (!strchr(" \t\r\n", part->data[end])) {
+                                jsonapp_invalid(jctx, "unable to parse json message: "
+                                                "trailing data at offset %zu", offset + end);
+                                json_object_put(root);
+                                return NULL;
+                        }
+                }
+                offset += part->len;
+        }
+        return root;
+}
+
+/* parse the message exactly once (in full, or with -l only the parts on the
+ * mapping plan; cbor and messagepack are decoded in full, compressed json is
+ * inflated into the tokener), collect the members named in the backends'
+ * mapping tables in a single walk, let every backend validate it and only
+ * then hand the same tree to every backend. a message that does not parse
+ * or validate is rejected as a whole with the reason in jctx->error.
+ *
+ * the root belongs to this function: it is released with json_object_put()
+ * after the last backend returns. backends only borrow it for the duration
+ * of process_json(); anything they want to keep past that needs its own
+ * reference taken with json_object_get(). */
+int jsonapp_process_json(struct jsonapp_parse_ctx *jctx, const struct jsonapp_msg *msg)
+{
+        struct jsonapp_parse_backend *backend;
+        enum jsonapp_encoding encoding;
+        struct json_object *root;
+        uint64_t start;
+        uint64_t nested;
+        uint64_t elapsed;
+        bool ran = false;
+        int err = 0;
+
+        jsonapp_stage_reset(jctx);
+        jctx->error[0] = '\0';
+        foreach_parse_backend(backend, jctx->backends) {
+                backend->applied = false;
+                backend->skipped = false;
+                backend->result = 0;
+        }
+        jctx->msg_hash = jsonapp_hash_payload(msg);
+        jctx->written_bytes = 0;
+
+        /* pick up edits made to the packages since the last message before
+         * anything trusts the cache to be current */
+        start = jsonapp_now_ns();
+        jsonapp_uci_cache_poll(jctx);
+        jsonapp_stage_add(jctx, JSONAPP_STAGE_INIT, start);
+
+        /* the config applied last, redelivered after a restart */
+        if (jsonapp_snapshot_current(jctx, jctx->backends)) {
+                foreach_parse_backend(backend, jctx->backends)
+                        backend->skipped = true;
+                return 0;
+        }
+
+        start = jsonapp_now_ns();
+        /* the scanner needs the push in one piece */
+        encoding = jsonapp_msg_encoding(msg);
+        if (encoding == JSONAPP_ENCODING_DEFLATE || encoding == JSONAPP_ENCODING_ZSTD)
+                root = jsonapp_inflate(jctx, msg, encoding);
+        else if (encoding != JSONAPP_ENCODING_JSON)
+                root = jsonapp_decode(jctx, msg, encoding);
+        else if (jctx->lazy_parse && !msg->parts->next)
+                root = jsonapp_scan(jctx, msg->parts->data, msg->parts->len);
+        else
+                root = jsonapp_parse_msg(jctx, msg);
+        jsonapp_stage_add(jctx, JSONAPP_STAGE_PARSE, start);
+        if (!root) {
+                /* keeps the more precise reason from the scanner */
+                jsonapp_invalid(jctx, "unable to parse json message");
+                fprintf(stderr, "rejecting message: %s\n", jctx->error);
+                return -1;
+        }
+
+        start = jsonapp_now_ns();
+        if (jsonapp_map_walk(jctx, root) != 0)
+                err = -1;
+        foreach_parse_backend(backend, jctx->backends) {
+                if (err)
+                        break;
+                if (backend->validate && backend->validate(jctx, root) != 0) {
+                        if (!jctx->error[0])
+                                jsonapp_invalid(jctx, "rejected by %s", backend->name);
+                        err = -1;
+                        break;
+                }
+        }
+        jsonapp_stage_add(jctx, JSONAPP_STAGE_VALIDATE, start);
+        if (err) {
+                fprintf(stderr, "rejecting message: %s\n", jctx->error);
+                jsonapp_arena_reset(jctx);
+                json_object_put(root);
+                return err;
+        }
+
+        /* a backend whose inputs are the same as last time would only find
+         * its packages as it left them */
+        foreach_parse_backend(backend, jctx->backends) {
+                if (!backend->map || !backend->packages)
+                        continue;
+                backend->next_input_hash = jsonapp_map_fingerprint(jctx, backend);
+                backend->skipped = backend->input_known &&
+                                   backend->next_input_hash == backend->input_hash &&
+                                   jsonapp_uci_cache_current(jctx, backend->packages);
+        }
+
+        /* package loads, saves and commits made by the backends are
+         * accounted to their own stages and not to process */
+        start = jsonapp_now_ns();
+        nested = jctx->stage_ns[JSONAPP_STAGE_INIT] +
+                 jctx->stage_ns[JSONAPP_STAGE_SAVE] +
+                 jctx->stage_ns[JSONAPP_STAGE_COMMIT];
+        err = jsonapp_sched_run(jctx, root);
+        /* backends running side by side can spend more time in the nested
+         * stages together than has passed */
+        nested = jctx->stage_ns[JSONAPP_STAGE_INIT] +
+                 jctx->stage_ns[JSONAPP_STAGE_SAVE] +
+                 jctx->stage_ns[JSONAPP_STAGE_COMMIT] - nested;
+        elapsed = jsonapp_now_ns() - start;
+        if (elapsed > nested)
+                jctx->stage_ns[JSONAPP_STAGE_PROCESS] += elapsed - nested;
+
+        /* all or nothing: what the backends staged is only committed if
+         * every one of them succeeded */
+        if (err)
+                jsonapp_uci_txn_abort(jctx);
+        else if (jsonapp_uci_txn_commit(jctx) < 0)
+                err = -1;
+
+        /* a rollback reloads every package, so nothing is known afterwards */
+        foreach_parse_backend(backend, jctx->backends) {
+                if (err)
+                        backend->input_known = false;
+                else if (backend->applied && backend->map && backend->packages) {
+                        backend->input_hash = backend->next_input_hash;
+                        backend->input_known = true;
+                }
+                ran |= backend->applied;
+        }
+        /* the snapshot only needs writing if a backend may have left its
+         * packages different from what it says */
+        jctx->applied_known = !err;
+        if (!err && (ran || jctx->applied_hash != jctx->msg_hash)) {
+                jctx->applied_hash = jctx->msg_hash;
+                jsonapp_snapshot_save(jctx, jctx->backends);
+        }
+
+        jsonapp_arena_reset(jctx);
+        json_object_put(root);
+        return err;
+}
+
 int jsonapp_has_config(struct jsonapp_parse_ctx *jctx, char *name, 
                        void (*reset_uci)(struct jsonapp_parse_ctx *jctx),
                        bool create)
@@ -89,7 +384,7 @@ int jsonapp_has_config(struct jsonapp_parse_ctx *jctx, char *name,
                         int fd;
                         const mode_t config_perm = S_IRUSR | S_IWUSR;
                         fprintf(stderr, "%s does not currently exist. creating it...\n", name);
-                        snprintf(new_config, sizeof(new_config), "/etc/config/%s", name);
+                        snprintf(new_config, sizeof(new_config), "%s/%s", jctx->uci_ctx->confdir, name);
                         fd = openat(AT_FDCWD, new_config, O_WRONLY|O_CREAT|O_NONBLOCK, config_perm);
                         if (fd == -1) {
                                 perror("error");
@@ -156,24 +451,52 @@ static int jsonapp_get_mac(char *iface, uint8_t *mac)
         return not_found;
 }
 
-static void jsonapp_generate_new_client_id(char *client_id, int len)
+/* the client id stays the same across restarts so the broker keeps our
+ * session, and with it the pushes sent while we were away */
+static void jsonapp_generate_client_id(struct jsonapp_mqtt_ctx *mqtt)
+{
+        uint8_t *ptr = mqtt->mac_address;
+        snprintf(mqtt->jsonapp_client_id, sizeof mqtt->jsonapp_client_id,
+                 "jsonapp%.2x%.2x%.2x%.2x%.2x%.2x",
+                 ptr[0], ptr[1], ptr[2], ptr[3], ptr[4], ptr[5]);
+        return;
+}
+
+/* the topic pushes come in on: the device's own, or every device's in
+ * gateway mode */
+static void jsonapp_get_subscription(struct jsonapp_parse_ctx *jctx, char *topic, int len)
 {
-        pid_t pid = getpid();
-        snprintf(client_id, len, "jsonapp%u",pid);
+        if (jctx->gateway)
+                snprintf(topic, len, "adopt/device/+");
+        else
+                jsonapp_get_topic(&jctx->mqtt, topic, len);
         return;
 }
 
+/* subscribe on every (re)connect, at qos 1 so the broker queues pushes for
+ * our persistent session while we are away. it already knows the
+ * subscriptions of a resumed session; making them again is harmless and
+ * covers a broker that lost the session. */
 static void jsonapp_mqtt_connect_cb(struct mosquitto *mosq, void *arg, int rc)
 {
+        struct jsonapp_parse_ctx *jctx = arg;
+        char mqtt_topic[256];
+
         if (rc != 0) {
-                jsonapp_die("failed to connect to mqtt server");
+                fprintf(stderr, "mqtt server refused the connection: %s\n",
+                        mosquitto_connack_string(rc));
+                return;
         }
         printf("connected to mqtt server!\n");
 
+        jsonapp_get_subscription(jctx, mqtt_topic, sizeof mqtt_topic);
+        mosquitto_subscribe(mosq, NULL, mqtt_topic, 1);
+        strncat(mqtt_topic, "/part", sizeof mqtt_topic - strlen(mqtt_topic) - 1);
+        mosquitto_subscribe(mosq, NULL, mqtt_topic, 1);
         return;
 }
 
-static void jsonapp_get_topic(struct jsonapp_mqtt_ctx *mctx, char *topic, int len)
+void jsonapp_get_topic(struct jsonapp_mqtt_ctx *mctx, char *topic, int len)
 {
         uint8_t *ptr = mctx->mac_address;
         snprintf(topic, len, "adopt/device/%.2x%.2x%.2x%.2x%.2x%.2x",
@@ -186,27 +509,213 @@ static void jsonapp_mqtt_subscribe_cb(struct mosquitto *mosq,
                                       const int *granted_qos)
 {
         struct jsonapp_parse_ctx *jctx = arg;
-        struct jsonapp_mqtt_ctx *mctx = &jctx->mqtt;
         char mqtt_topic[256];
-        jsonapp_get_topic(mctx, mqtt_topic, sizeof mqtt_topic);
+        jsonapp_get_subscription(jctx, mqtt_topic, sizeof mqtt_topic);
         printf("subscribed to topic: %s\n", mqtt_topic);
         return;
 }
 
+/* <topic>/part carries a piece of a push; the piece sent on <topic> itself
+ * completes it */
+static bool jsonapp_is_part_topic(const char *topic, size_t *base_len)
+{
+        size_t len = strlen(topic);
+
+        if (len <= 5 || strcmp(topic + len - 5, "/part") != 0)
+                return false;
+        *base_len = len - 5;
+        return true;
+}
+
 static void jsonapp_mqtt_msg_cb(struct mosquitto *mosq, void *arg,
                                 const struct mosquitto_message *msg)
 {
         struct jsonapp_parse_ctx *jctx = arg;
+        struct jsonapp_mqtt_ctx *mqtt = &jctx->mqtt;
+        struct jsonapp_msg **pending = &mqtt->pending;
+        bool *discarding = &mqtt->discarding;
+        struct jsonapp_device *device = NULL;
+        struct jsonapp_msg *jmsg;
+        char topic[256];
+        size_t base_len;
+        bool part;
+        int len;
+
+        jsonapp_stats_received(jctx, msg->payloadlen);
+
+        part = jsonapp_is_part_topic(msg->topic, &base_len);
+        snprintf(topic, sizeof topic, "%.*s", part ? (int)base_len : (int)strlen(msg->topic),
+                 msg->topic);
+
+        /* in gateway mode every device assembles its own pushes */
+        if (jctx->gateway) {
+                if (!(device = jsonapp_gateway_device(jctx, topic)))
+                        return;
+                pending = &device->pending;
+                discarding = &device->discarding;
+        }
+
+        /* a push that grows past the limit is dropped as a whole, including
+         * the parts of it that are still to come */
+        len = *pending ? (*pending)->payloadlen : 0;
+        if (*discarding || msg->payloadlen > jctx->max_payload - len) {
+                if (!*discarding) {
+                        fprintf(stderr, "push for %s exceeds %d bytes. dropping it\n",
+                                topic, jctx->max_payload);
+                        jsonapp_stats_oversized(jctx);
+                }
+                jsonapp_msg_free(*pending);
+                *pending = NULL;
+                *discarding = part;
+                return;
+        }
+
+        if (!*pending) {
+                *pending = jsonapp_msg_new(topic, msg->payload, msg->payloadlen);
+        } else if (jsonapp_msg_append(*pending, msg->payload, msg->payloadlen) != 0) {
+                jsonapp_msg_free(*pending);
+                *pending = NULL;
+        }
+        if (!*pending) {
+                fprintf(stderr, "insufficient memory. dropping message for %s\n", topic);
+                *discarding = part;
+                return;
+        }
+        if (part)
+                return;
+
+        /* never apply on the main loop; hand it to the apply worker */
+        jmsg = *pending;
+        *pending = NULL;
+        if (device)
+                jsonapp_gateway_push(device, jmsg);
+        else
+                jsonapp_queue_push(jctx->queue, jmsg);
+        return;
+}
+
+/* report the outcome of msg on <topic>/result. mosquitto_publish() only
+ * queues the record; the main loop sends it once woken up, so the worker
+ * moves on to the next message right away. */
+static void jsonapp_publish_result(struct jsonapp_parse_ctx *jctx,
+                                   const struct jsonapp_msg *msg,
+                                   uint64_t start_ns, int err)
+{
         struct jsonapp_parse_backend *backend;
-        char *json_message = (char *)msg->payload;
-        foreach_parse_backend(backend, backend_list) {
-                jsonapp_init_backend(jctx, backend);
-                jsonapp_process_json(backend, json_message);
-                jsonapp_exit_backend(backend);
+        struct json_object *root;
+        struct json_object *backends;
+        struct json_object *obj;
+        const char *payload;
+        char topic[256];
+        char hash[17];
+        bool changed = false;
+        bool applied = false;
+        uint64_t now = jsonapp_now_ns();
+        int rc;
+
+        backends = json_object_new_array();
+        foreach_parse_backend(backend, jctx->backends) {
+                if (!backend->applied && !backend->skipped)
+                        continue;
+                if (backend->applied)
+                        applied = true;
+                obj = json_object_new_object();
+                json_object_object_add(obj, "name", json_object_new_string(backend->name));
+                json_object_object_add(obj, "status", json_object_new_string(
+                                        backend->skipped ? "skipped" :
+                                        backend->result < 0 ? "failed" : "ok"));
+                json_object_object_add(obj, "changed", json_object_new_boolean(backend->result > 0));
+                json_object_array_add(backends, obj);
+                if (backend->result > 0)
+                        changed = true;
+        }
+
+        snprintf(hash, sizeof hash, "%016llx", (unsigned long long)jctx->msg_hash);
+        root = json_object_new_object();
+        json_object_object_add(root, "seq", json_object_new_int64(msg->seq));
+        json_object_object_add(root, "hash", json_object_new_string(hash));
+        json_object_object_add(root, "status", json_object_new_string(
+                                !err ? "ok" : applied ? "failed" : "invalid"));
+        json_object_object_add(root, "changed", json_object_new_boolean(changed));
+        json_object_object_add(root, "queued_us",
+                               json_object_new_int64((start_ns - msg->recv_ns) / 1000));
+        json_object_object_add(root, "apply_us", json_object_new_int64((now - start_ns) / 1000));
+        json_object_object_add(root, "written_bytes", json_object_new_int64(jctx->written_bytes));
+        json_object_object_add(root, "backends", backends);
+        if (jctx->error[0])
+                json_object_object_add(root, "error", json_object_new_string(jctx->error));
+
+        jsonapp_get_topic(&jctx->mqtt, topic, sizeof topic);
+        strncat(topic, "/result", sizeof topic - strlen(topic) - 1);
+        payload = json_object_to_json_string(root);
+        rc = mosquitto_publish(jctx->mqtt.mosq, NULL, topic, strlen(payload), payload, 1, false);
+        if (rc == MOSQ_ERR_SUCCESS)
+                jsonapp_reactor_wake(jctx);
+        else
+                fprintf(stderr, "error publishing apply result: %s\n", mosquitto_strerror(rc));
+        json_object_put(root);
+        return;
+}
+
+/* apply msg and report the outcome */
+void jsonapp_apply(struct jsonapp_parse_ctx *jctx, const struct jsonapp_msg *msg)
+{
+        uint64_t start = jsonapp_now_ns();
+        int err;
+
+        err = jsonapp_process_json(jctx, msg);
+        jsonapp_stats_applied(jctx, msg, start, err);
+        jsonapp_publish_result(jctx, msg, start, err);
+        return;
+}
+
+/* the apply worker owns the uci side of things: only this thread parses
+ * messages and touches the backends once they are initialized. */
+static void *jsonapp_apply_worker(void *arg)
+{
+        struct jsonapp_parse_ctx *jctx = arg;
+        struct jsonapp_msg **batch;
+        int n;
+        int i;
+
+        if (!(batch = calloc(jsonapp_queue_batch_size(jctx->queue), sizeof *batch)))
+                jsonapp_die("insufficient memory for apply worker");
+
+        while ((n = jsonapp_queue_pop(jctx->queue, batch)) >= 0) {
+                for (i = 0; i < n; i++) {
+                        if (batch[i]->refresh) {
+                                jsonapp_uci_cache_refresh(jctx);
+                                jsonapp_msg_free(batch[i]);
+                                continue;
+                        }
+                        jsonapp_apply(jctx, batch[i]);
+                        jsonapp_msg_free(batch[i]);
+                }
+        }
+        free(batch);
+        return NULL;
+}
+
+static void jsonapp_start_worker(struct jsonapp_parse_ctx *jctx)
+{
+        jctx->queue = jsonapp_queue_new(JSONAPP_QUEUE_DEPTH);
+        if (pthread_create(&jctx->worker, NULL, jsonapp_apply_worker, jctx) != 0) {
+                jsonapp_die("unable to start apply worker");
         }
         return;
 }
 
+static void jsonapp_stop_worker(struct jsonapp_parse_ctx *jctx)
+{
+        if (!jctx->queue)
+                return;
+        jsonapp_queue_close(jctx->queue);
+        pthread_join(jctx->worker, NULL);
+        jsonapp_queue_free(jctx->queue);
+        jctx->queue = NULL;
+        return;
+}
+
 static void jsonapp_print_mqtt_settings(struct jsonapp_mqtt_ctx *mqtt)
 {
         fprintf(stderr, "network interface: %s\n", mqtt->iface_name);
@@ -219,7 +728,6 @@ static void jsonapp_print_mqtt_settings(struct jsonapp_mqtt_ctx *mqtt)
 static void jsonapp_init_mqtt(struct jsonapp_parse_ctx *jctx)
 {
         struct jsonapp_mqtt_ctx *mqtt;
-        char mqtt_topic[256];
 
         mqtt = &jctx->mqtt;
         if (!mqtt->iface_name) {
@@ -233,19 +741,22 @@ static void jsonapp_init_mqtt(struct jsonapp_parse_ctx *jctx)
         }
 
         mosquitto_lib_init();
-        jsonapp_generate_new_client_id(mqtt->jsonapp_client_id, sizeof(mqtt->jsonapp_client_id));
-        mqtt->mosq = mosquitto_new(mqtt->jsonapp_client_id, true, jctx);
+        jsonapp_generate_client_id(mqtt);
+        mqtt->mosq = mosquitto_new(mqtt->jsonapp_client_id, false, jctx);
         mosquitto_username_pw_set(mqtt->mosq, mqtt->user, mqtt->password);
         mosquitto_connect_callback_set(mqtt->mosq, jsonapp_mqtt_connect_cb);
         mosquitto_subscribe_callback_set(mqtt->mosq, jsonapp_mqtt_subscribe_cb);
         mosquitto_message_callback_set(mqtt->mosq, jsonapp_mqtt_msg_cb);
-        int err = mosquitto_connect(mqtt->mosq, mqtt->host, 1883, 60);
+        /* network i/o is driven by jsonapp_reactor_run(); the apply worker
+         * publishes from its own thread, which then only queues the packet */
+        mosquitto_threaded_set(mqtt->mosq, true);
+        jsonapp_reactor_init(jctx);
+        int err = mosquitto_connect(mqtt->mosq, mqtt->host, 1883, JSONAPP_MQTT_KEEPALIVE);
         if (err != MOSQ_ERR_SUCCESS) {
-                fprintf(stderr, "error connecting to mqtt server!");
+                fprintf(stderr, "error connecting to mqtt server: %s. retrying...\n",
+                        mosquitto_strerror(err));
         }
-        jsonapp_get_topic(mqtt, mqtt_topic, sizeof mqtt_topic);
-        mosquitto_subscribe(mqtt->mosq, NULL, mqtt_topic, 0);
-
+        mqtt->connected = err == MOSQ_ERR_SUCCESS;
         return;
 }
 
@@ -259,12 +770,15 @@ static void jsonapp_init_mqtt_defaults(struct jsonapp_mqtt_ctx *mqtt)
 
 static void jsonapp_exit_mqtt(struct jsonapp_parse_ctx *jctx)
 {
+        jsonapp_msg_free(jctx->mqtt.pending);
+        jctx->mqtt.pending = NULL;
+        jsonapp_reactor_exit(jctx);
         mosquitto_destroy(jctx->mqtt.mosq);
         mosquitto_lib_cleanup();
         return;
 }
 
-static struct jsonapp_parse_ctx 
+struct jsonapp_parse_ctx 
 *jsonapp_alloc_context(int argc, char **argv)
 {
         static struct jsonapp_parse_ctx *jctx = NULL;
@@ -280,12 +794,27 @@ static struct jsonapp_parse_ctx
         memset(jctx, 0, sizeof *jctx);
         mqtt = &jctx->mqtt;
         jsonapp_init_mqtt_defaults(mqtt);
-        while((option = getopt(argc, argv, "n:u:p:h:")) != -1) {
+        mqtt->wake_fd = -1;
+        jsonapp_stats_init(jctx);
+        jctx->stats_interval = JSONAPP_STATS_INTERVAL;
+        jctx->max_payload = JSONAPP_MAX_PAYLOAD;
+        jctx->max_inflated = JSONAPP_MAX_INFLATED;
+        jctx->snapshot_path = JSONAPP_SNAPSHOT_PATH;
+        jctx->gateway_contexts = JSONAPP_GATEWAY_CONTEXTS;
+        while((option = getopt(argc, argv, "n:u:p:h:s:lm:z:j:S:G:C:")) != -1) {
                 switch(option) {
                 case 'n': mqtt->iface_name = optarg; break;
                 case 'u': mqtt->user = optarg; break;
                 case 'p': mqtt->password = optarg; break;
                 case 'h': mqtt->host = optarg; break;
+                case 's': jctx->stats_interval = atoi(optarg); break;
+                case 'l': jctx->lazy_parse = true; break;
+                case 'm': jctx->max_payload = atoi(optarg); break;
+                case 'z': jctx->max_inflated = atoi(optarg); break;
+                case 'j': jctx->apply_threads = atoi(optarg); break;
+                case 'S': jctx->snapshot_path = optarg[0] ? optarg : NULL; break;
+                case 'G': jctx->gateway_root = optarg; break;
+                case 'C': jctx->gateway_contexts = atoi(optarg); break;
                 case '?':
                         if (optopt == 'n') {
                                 jsonapp_die("-n expects a network interface name.");
@@ -295,133 +824,187 @@ static struct jsonapp_parse_ctx
                                 fprintf(stderr, "-p expects a password. if not used, \"guest\" is used.");
                         } else if (optopt == 'h') {
                                 fprintf(stderr, "-h expects a hotname or IP address. if not used, \"localhost\" is used.");
+                        } else if (optopt == 's') {
+                                fprintf(stderr, "-s expects the stats interval in seconds. 0 turns stats off.");
+                        } else if (optopt == 'm') {
+                                fprintf(stderr, "-m expects the largest push to accept in bytes.");
+                        } else if (optopt == 'z') {
+                                fprintf(stderr, "-z expects the largest size a compressed push may inflate to in bytes.");
+                        } else if (optopt == 'j') {
+                                fprintf(stderr, "-j expects the number of threads to run backends on. if not used, one per cpu is used.");
+                        } else if (optopt == 'S') {
+                                fprintf(stderr, "-S expects the file to keep the last applied config's snapshot in. \"\" turns it off.");
+                        } else if (optopt == 'G') {
+                                fprintf(stderr, "-G expects the directory to keep a config directory per device in.");
+                        } else if (optopt == 'C') {
+                                fprintf(stderr, "-C expects the number of device contexts to keep loaded in gateway mode.");
                         } else {
                                 jsonapp_die("encountered illegal option");
                         }
                 }
         }
 
-        jsonapp_init_mqtt(jctx);
+        if (jctx->max_payload <= 0)
+                jsonapp_die("-m expects a size in bytes greater than 0");
+        if (jctx->max_inflated <= 0)
+                jsonapp_die("-z expects a size in bytes greater than 0");
+        if (jctx->gateway_contexts <= 0)
+                jsonapp_die("-C expects a number of device contexts greater than 0");
+
+        /* a gateway has no config of its own; every device it serves gets
+         * a context of its own with the first push for it */
+        if (jctx->gateway_root) {
+                jctx->inotify_fd = -1;
+                jsonapp_compile_backends(jctx);
+                jsonapp_gateway_init(jctx);
+                jsonapp_init_mqtt(jctx);
+                return jctx;
+        }
+
         if (!(jctx->uci_ctx = uci_alloc_context())){
                 jsonapp_die("insufficient memory for uci context");
         }
+        jsonapp_uci_cache_init(jctx);
+        jsonapp_init_backends(jctx);
+        jsonapp_snapshot_load(jctx, jctx->backends);
+        jsonapp_reload_init(jctx);
+        jsonapp_start_worker(jctx);
+        jsonapp_init_mqtt(jctx);
         return jctx;
 }
 
-static void jsonapp_free_context(struct jsonapp_parse_ctx *jctx)
+/* let the workers apply what is queued and the reload hooks run, so the
+ * last results are published before jsonapp_disconnect() flushes them.
+ * safe to call more than once. */
+void jsonapp_stop_workers(struct jsonapp_parse_ctx *jctx)
 {
-        uci_free_context(jctx->uci_ctx);
-        jsonapp_exit_mqtt(jctx);
-        free(jctx);
+        if (jctx->gateway)
+                jsonapp_gateway_exit(jctx);
+        else
+                jsonapp_stop_worker(jctx);
+        jsonapp_reload_exit(jctx);
         return;
 }
 
-struct json_object *jsonapp_object_get_object_by_name(struct json_object *parent, char *name,
-                                                      enum json_type expected_json_type)
+void jsonapp_free_context(struct jsonapp_parse_ctx *jctx)
 {
-        struct json_object *obj;
-        obj = json_object_object_get(parent, name);
-        if (json_object_get_type(obj) != expected_json_type) {
-                jsonapp_die("%s formatting error.", name);
-        }
-        return obj;
-}
-
-void jsonapp_process_array(struct jsonapp_parse_ctx *jctx,
-                           struct json_object *obj_arr,
-                           void *user_data,
-                           void (*process_member)(struct jsonapp_parse_ctx *jctx,
-                                                  struct json_object *obj,
-                                                  void *user_data))
-{
-        int i;
-        int n;
-
-        n = json_object_array_length(obj_arr);
-        for (i=0; i<n; i++) {
-                struct json_object *member_obj = json_object_array_get_idx(obj_arr, i);
-                if (!process_member)
-                        jsonapp_die("no processor for member defined");
-                process_member(jctx, member_obj, user_data);
-        }
+        jsonapp_stop_workers(jctx);
+        jsonapp_exit_mqtt(jctx);
+        jsonapp_map_exit(jctx);
+        jsonapp_exit_backends();
+        jsonapp_uci_cache_exit(jctx);
+        jsonapp_sched_exit(jctx);
+        if (jctx->uci_ctx)
+                uci_free_context(jctx->uci_ctx);
+        if (jctx->tokener)
+                json_tokener_free(jctx->tokener);
+        jsonapp_inflate_exit(jctx);
+        jsonapp_arenas_free(jctx->arenas);
+        free(jctx);
         return;
 }
 
-
-void jsonapp_set_new_option(struct jsonapp_parse_ctx *jctx,
-                            struct json_object *obj,
-                            char *obj_member,
-                            enum json_type expected_type,
-                            struct uci_package *pkg, 
-                            struct uci_section *section,
-                            char *option, char *value)
+/* the context a gateway applies a device's pushes with, on the device's
+ * config directory <gateway root>/<mac>. it is created and used on the
+ * worker the device is sharded to only, which lends it the tokener, the
+ * decompressor and the backends' arenas for the duration of an apply.
+ * nothing watches the directory; packages are checked with stat() before
+ * use instead.
+ *
+ * the directory and an empty file for every package a backend lists are
+ * created if missing. returns NULL if either cannot be made, which only
+ * costs the device its push; jsonapp_has_config() would take the whole
+ * gateway down instead. */
+struct jsonapp_parse_ctx *jsonapp_alloc_device_context(struct jsonapp_parse_ctx *parent,
+                                                       const uint8_t *mac)
 {
-        struct uci_ptr optr;
-        struct json_object *member_obj;
-
-        memset(&optr, 0, sizeof(optr));
-        optr.package = pkg->e.name;
-        optr.section = section->e.name;
-        optr.option = option;
-        if (value) {
-                optr.value = value;
-        } else {
-                member_obj = jsonapp_object_get_object_by_name(obj, obj_member, expected_type);
-                optr.value = json_object_get_string(member_obj);
+        struct jsonapp_parse_backend *backend;
+        struct jsonapp_parse_ctx *jctx;
+        const char *const *p;
+        char confdir[PATH_MAX];
+        char file[PATH_MAX + NAME_MAX + 2];
+        char *path;
+        int fd;
+
+        snprintf(confdir, sizeof confdir, "%s/%.2x%.2x%.2x%.2x%.2x%.2x", parent->gateway_root,
+                 mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+        if (mkdir(confdir, 0755) != 0 && errno != EEXIST) {
+                perror(confdir);
+                return NULL;
         }
-        uci_set(jctx->uci_ctx, &optr);
-        return;
-}
-
-/* potentially non-async-signal safe procedure since functions called here 
- * _might_ use function like printf(), fprintf(), etc */
-struct jsonapp_parse_ctx *jctx = NULL;
-static void signal_handler(int sig)
-{
-        char topic[256];
-        if (jctx) {
-                jsonapp_get_topic(&jctx->mqtt, topic, sizeof topic);
-                mosquitto_unsubscribe(jctx->mqtt.mosq, NULL, topic);
-                mosquitto_disconnect(jctx->mqtt.mosq);
+        foreach_parse_backend(backend, parent->backends) {
+                for (p = backend->packages; p && *p; p++) {
+                        snprintf(file, sizeof file, "%s/%s", confdir, *p);
+                        if ((fd = open(file, O_WRONLY | O_CREAT | O_CLOEXEC,
+                                       S_IRUSR | S_IWUSR)) == -1) {
+                                perror(file);
+                                return NULL;
+                        }
+                        close(fd);
+                }
         }
-        exit(-1);
-        return;
-}
-
-struct json_object *jsonapp_get_wlangrp(struct json_object *root)
-{
-        return jsonapp_object_get_object_by_name(root, "WlanGroup", json_type_object);
-}
-
-struct json_object *jsonapp_get_wlans(struct json_object *wlangrp)
-{
-         return jsonapp_object_get_object_by_name(wlangrp, "wlans", json_type_array);       
-}
-
-struct json_object *jsonapp_get_radius_servers(struct json_object *wlans)
-{
-        return jsonapp_object_get_object_by_name(wlans, "radiusServerList", json_type_array);
-}
 
-struct json_object *jsonapp_get_servers(struct json_object *radius_server)
-{
-        return jsonapp_object_get_object_by_name(radius_server, "servers", json_type_array);
+        if (!(jctx = calloc(1, sizeof *jctx)))
+                jsonapp_die("insufficient memory for device context");
+        jctx->parent = parent;
+        jctx->lazy_parse = parent->lazy_parse;
+        jctx->max_payload = parent->max_payload;
+        jctx->max_inflated = parent->max_inflated;
+        /* devices apply side by side already */
+        jctx->apply_threads = 1;
+        jctx->mqtt.mosq = parent->mqtt.mosq;
+        jctx->mqtt.wake_fd = parent->mqtt.wake_fd;
+        memcpy(jctx->mqtt.mac_address, mac, sizeof jctx->mqtt.mac_address);
+
+        if (!(jctx->uci_ctx = uci_alloc_context()))
+                jsonapp_die("insufficient memory for uci context");
+        uci_set_confdir(jctx->uci_ctx, confdir);
+        /* what other uci users save in the default delta directory is for
+         * the gateway's own config, never for a device's */
+        if (asprintf(&path, "%s/.uci", confdir) < 0)
+                jsonapp_die("insufficient memory for device context");
+        uci_set_savedir(jctx->uci_ctx, path);
+        free(path);
+        jsonapp_clone_backends(jctx);
+        jsonapp_uci_cache_init(jctx);
+        jsonapp_map_init(jctx);
+        jsonapp_sched_init(jctx, jctx->backends);
+
+        if (parent->snapshot_path) {
+                if (asprintf(&path, "%s/%s", confdir, JSONAPP_DEVICE_SNAPSHOT) < 0)
+                        jsonapp_die("insufficient memory for device context");
+                jctx->snapshot_path = path;
+                jsonapp_snapshot_load(jctx, jctx->backends);
+        }
+        return jctx;
 }
 
-struct json_object *jsonapp_get_guest_acl_list(struct json_object *wlans)
+void jsonapp_free_device_context(struct jsonapp_parse_ctx *jctx)
 {
-        return jsonapp_object_get_object_by_name(wlans, "guestAccessList", json_type_array);
+        if (!jctx)
+                return;
+        jsonapp_map_exit(jctx);
+        jsonapp_uci_cache_exit(jctx);
+        jsonapp_sched_exit(jctx);
+        uci_free_context(jctx->uci_ctx);
+        free((char *)jctx->snapshot_path);
+        free(jctx->backends);
+        free(jctx);
+        return;
 }
 
-int main(int argc, char **argv)
+/* the subscriptions are left in place: the broker keeps queueing pushes
+ * for the session until we are back */
+void jsonapp_disconnect(struct jsonapp_parse_ctx *jctx)
 {
-        jctx = jsonapp_alloc_context(argc, argv);
+        int i;
 
-        if (signal(SIGINT, signal_handler) == SIG_ERR) {
-                jsonapp_die("jsonapp error trapping SIGINT");
+        mosquitto_disconnect(jctx->mqtt.mosq);
+        /* the main loop is gone; push out what is still queued, results
+         * included, as far as the socket takes it */
+        for (i = 0; i < 16 && mosquitto_want_write(jctx->mqtt.mosq); i++) {
+                if (mosquitto_loop_write(jctx->mqtt.mosq, 1) != MOSQ_ERR_SUCCESS)
+                        break;
         }
-        mosquitto_loop_forever(jctx->mqtt.mosq, -1, 1);
-        jsonapp_free_context(jctx);
-        return 0;
+        return;
 }
-
@@ -1,7 +1,12 @@
 #ifndef __JSON_APP_H__
 #define __JSON_APP_H__
 #include <stdarg.h>
+#include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include <json-c/json.h>
 #include <uci.h>
 #include <mosquitto.h>
@@ -10,12 +15,154 @@
         __attribute__((constructor))
 
 struct jsonapp_parse_ctx;
+struct jsonapp_uci_pkg;
+struct jsonapp_diff;
+struct jsonapp_diff_sect;
+struct jsonapp_queue;
+struct jsonapp_map_result;
+struct jsonapp_inflater;
+struct jsonapp_sched;
+struct jsonapp_gateway;
+struct jsonapp_gateway_worker;
+struct jsonapp_arena;
+struct jsonapp_arenas;
+struct jsonapp_reload;
 
+#define JSONAPP_QUEUE_DEPTH 16
+#define JSONAPP_QUEUE_OVERFLOW 4
+#define JSONAPP_MQTT_KEEPALIVE 60
+#define JSONAPP_SNAPSHOT_PATH "/etc/jsonapp.snapshot"
+#define JSONAPP_DEVICE_SNAPSHOT ".jsonapp.snapshot"     /* in a device's confdir */
+#define JSONAPP_GATEWAY_CONTEXTS 1024                   /* device contexts kept loaded */
+
+/* limits on what a push may look like. larger pushes are dropped on
+ * receive, before anything is allocated for them. */
+#define JSONAPP_MAX_PAYLOAD (1024 * 1024)
+#define JSONAPP_MAX_DEPTH 32
+#define JSONAPP_MAX_INFLATED (4 * 1024 * 1024)   /* of a compressed push */
+
+enum jsonapp_encoding {
+        JSONAPP_ENCODING_JSON,
+        JSONAPP_ENCODING_CBOR,
+        JSONAPP_ENCODING_MSGPACK,
+        JSONAPP_ENCODING_DEFLATE,               /* json text, zlib or gzip framed */
+        JSONAPP_ENCODING_ZSTD,                  /* json text, zstd frame */
+};
+
+/* one mqtt payload. data is nul terminated past len for the lazy scanner. */
+struct jsonapp_msg_part {
+        struct jsonapp_msg_part *next;
+        int len;
+        char data[];
+};
+
+/* a received push, copied out of the main loop. it is usually a single
+ * part; a push sent in pieces on <topic>/part keeps one per piece. */
+struct jsonapp_msg {
+        char *topic;
+        struct jsonapp_msg_part *parts;
+        struct jsonapp_msg_part *last;
+        int payloadlen;                         /* of all parts */
+        unsigned long seq;
+        uint64_t recv_ns;
+        bool refresh;                           /* not a push: reload changed packages */
+};
+
+/* one json member a backend reads. target, if set, is the uci option the
+ * value goes to as package.@type[n].option (see map.c). */
+struct jsonapp_map {
+        const char *path;
+        enum json_type type;
+        const char *target;
+        bool optional;
+};
+
+/* one change jsonapp_diff_apply() made to a package that was committed.
+ * option is NULL for a change to the section itself: old and value are
+ * then its type before and after, NULL for a section that was added or
+ * deleted. otherwise they are the option's string value before and after,
+ * NULL for an option that was added or deleted. a deleted section comes
+ * with the deletion of each of its options. */
+struct jsonapp_change {
+        struct jsonapp_change *next;
+        const char *package;
+        const char *section;
+        const char *type;
+        const char *option;
+        const char *old;
+        const char *value;
+};
+
+/* init() is called once at startup and the optional exit() once at
+ * shutdown; backends stay loaded in between and get their uci packages
+ * from the package cache (jsonapp_uci_package()) on every message.
+ *
+ * map is an optional table of the json members the backend reads, ended by
+ * an entry without a path. the tables of all backends are walked once per
+ * message before validation; a required member that is missing or of the
+ * wrong type rejects the message.
+ *
+ * validate() is optional. it is called for every backend before any backend
+ * processes the message and returns -1, after recording the reason with
+ * jsonapp_invalid(), if the message lacks anything process_json() relies on.
+ * a message that fails validation is not applied at all.
+ *
+ * a backend with both a map table and a packages list is taken to read
+ * nothing of the message but its table. it is skipped when what its table
+ * finds is the same as in the last message applied and its packages did not
+ * change on disk since; see jsonapp_map_fingerprint().
+ *
+ * packages lists the uci packages the backend loads, ended by NULL. a
+ * backend may not use any other package. backends without a package in
+ * common run at the same time, each with the packages on a uci context of
+ * its own (see sched.c); a backend without the list runs alone.
+ *
+ * process_json() returns the number of uci changes it made, 0 when the config
+ * already matched, or -1 on error. changed packages are handed to
+ * jsonapp_uci_stage() instead of being committed; the main module commits
+ * them for all backends at once. the main module keeps the
+ * outcome of the last message in result/applied for the apply result.
+ *
+ * reload() is optional. after a commit it is called with the changes to
+ * the packages the backend lists, if there were any, to restart only what
+ * they affect; it may reorder the array. it runs on a thread of its own
+ * (see reload.c) while the next message is applied, so it does not use
+ * the cached packages, and returns -1 if the reload failed. it is not
+ * called in gateway mode.
+ *
+ * validate() and process_json() take scratch memory (names, formatted
+ * values, the uci diff) from the backend's arena, jsonapp_arena(). it is
+ * given back as a whole once the message is done; see arena.c.
+ *
+ * in gateway mode (-G) every device applies with a copy of the backend of
+ * its own and neither init() nor exit() is called; process_json() finds
+ * the device's packages through the jctx it is passed. backends keep no
+ * per message state outside of it.
+ *
+ * process_json() receives a root that is shared by every registered backend
+ * and owned by the main module. it is only valid for the duration of the call
+ * and must not be released by the backend; take a reference with
+ * json_object_get() to keep any part of it around. */
 struct jsonapp_parse_backend {
         struct jsonapp_parse_backend *next;
+        const char *name;
+        const struct jsonapp_map *map;
+        int map_base;
+        const char *const *packages;
+        int index;                              /* in the registered list */
         struct jsonapp_parse_ctx *jctx;
+        struct uci_context *uci_ctx;
+        int state;
+        int result;
+        bool applied;
+        bool skipped;                           /* inputs unchanged, not run */
+        uint64_t input_hash;                    /* of the last message applied */
+        uint64_t next_input_hash;               /* of the current message */
+        bool input_known;
         struct jsonapp_parse_ctx *(*init)(struct jsonapp_parse_ctx *jctx);
+        int (*validate)(struct jsonapp_parse_ctx *jctx, struct json_object *root);
         int (*process_json)(struct jsonapp_parse_ctx *jctx, struct json_object *root);
+        int (*reload)(struct jsonapp_parse_ctx *jctx, struct jsonapp_change **changes, int nr);
         void (*exit)(struct jsonapp_parse_ctx *jctx);
 };
 
@@ -27,44 +174,283 @@ struct jsonapp_mqtt_ctx {
         uint8_t mac_address[6];
         struct mosquitto *mosq;
         char jsonapp_client_id[64];
+        /* main loop only: parts of a push still being received */
+        struct jsonapp_msg *pending;
+        bool discarding;
+        bool connected;
+        int wake_fd;                            /* see jsonapp_reactor_wake() */
+};
+
+/* a device served in gateway mode. the main loop finds it by mac and hands
+ * its pushes to the worker it is sharded to; see gateway.c. */
+struct jsonapp_device {
+        struct jsonapp_device *next;            /* in its hash bucket */
+        uint8_t mac[6];
+        struct jsonapp_gateway_worker *worker;
+        /* main loop only: parts of a push still being received */
+        struct jsonapp_msg *pending;
+        bool discarding;
+        unsigned long seq;                      /* of the last push */
+        /* under the worker's lock */
+        struct jsonapp_device *run_next;
+        struct jsonapp_msg *msg;                /* newest push not applied yet */
+        bool queued;
+        /* worker only, created with the first push and freed again when
+         * other devices need the room */
+        struct jsonapp_parse_ctx *jctx;
+        struct jsonapp_device *lru_prev;
+        struct jsonapp_device *lru_next;
+};
+
+enum jsonapp_stage {
+        JSONAPP_STAGE_PARSE,
+        JSONAPP_STAGE_VALIDATE,
+        JSONAPP_STAGE_INIT,
+        JSONAPP_STAGE_PROCESS,
+        JSONAPP_STAGE_SAVE,
+        JSONAPP_STAGE_COMMIT,
+        JSONAPP_STAGE_MAX
+};
+
+/* log2 latency histogram: bucket 0 counts samples below 1us, bucket n those
+ * in [2^(n-1), 2^n) us and the last one everything above that */
+#define JSONAPP_HIST_BUCKETS 24
+
+struct jsonapp_hist {
+        atomic_ullong count;
+        atomic_ullong sum_us;
+        atomic_ullong max_us;
+        atomic_ullong bucket[JSONAPP_HIST_BUCKETS];
+};
+
+#define JSONAPP_STATS_INTERVAL 60
+
+/* counters since startup. written by the main loop, the apply worker and
+ * the reload thread, read by the stats publisher; all of them are relaxed
+ * atomics. */
+struct jsonapp_stats {
+        atomic_ullong received;
+        atomic_ullong received_bytes;
+        atomic_ullong applied;
+        atomic_ullong applied_bytes;
+        atomic_ullong failed;
+        atomic_ullong oversized;                /* dropped for exceeding -m */
+        atomic_ullong written_bytes;            /* to the config directory */
+        atomic_ullong arena_peak;               /* most arena bytes a message used */
+        struct jsonapp_hist queue;              /* receive to start of apply */
+        struct jsonapp_hist stage[JSONAPP_STAGE_MAX];
+        struct jsonapp_hist total;              /* receive to end of apply */
+        struct jsonapp_hist reload;             /* of a backend's reload() */
+        atomic_ullong reload_failed;
+        /* publisher private */
+        uint64_t start_ns;
+        uint64_t last_ns;
+        unsigned long long last_applied;
+        unsigned long long last_bytes;
+};
+
+struct jsonapp_queue_stats {
+        unsigned int depth;
+        unsigned int coalesced;
+        unsigned int dropped;
 };
 
 struct jsonapp_parse_ctx {
         struct jsonapp_parse_backend *backend;
+        struct jsonapp_parse_backend *backends; /* the ones applied with this context */
+        struct jsonapp_parse_ctx *parent;       /* of a gateway device's context */
+        const char *gateway_root;               /* -G: a confdir per device below it */
+        int gateway_contexts;                   /* -C: device contexts kept loaded */
+        struct jsonapp_gateway *gateway;
         struct uci_context *uci_ctx;
+        struct jsonapp_uci_pkg *packages;
+        int inotify_fd;
+        struct jsonapp_queue *queue;
+        pthread_t worker;
+        struct jsonapp_sched *sched;
+        struct jsonapp_reload *reload;          /* NULL: changes are not recorded */
+        int apply_threads;                      /* 0 for one per cpu */
+        atomic_ullong stage_ns[JSONAPP_STAGE_MAX];
+        char error[256];                        /* why the last message was rejected */
+        struct jsonapp_map_result *map_results;
+        struct jsonapp_arenas *arenas;          /* one per backend, reset per message */
+        size_t arena_used;                      /* by the backends for the last message */
+        bool lazy_parse;                        /* jsonapp_scan() instead of json_tokener */
+        struct json_tokener *tokener;           /* reused for every message */
+        int max_payload;
+        struct jsonapp_inflater *inflater;
+        int max_inflated;
+        uint64_t msg_hash;                      /* of the payload being applied */
+        size_t written_bytes;                   /* to the config directory for it */
+        const char *snapshot_path;              /* NULL for none */
+        uint64_t applied_hash;                  /* of the last payload applied */
+        bool applied_known;
+        struct jsonapp_stats stats;
+        int stats_interval;
         struct jsonapp_mqtt_ctx mqtt;
 };
 
 void jsonapp_die(const char *fmt, ...);
 
+#define JSONAPP_FNV1A_INIT 0xcbf29ce484222325ull
+uint64_t jsonapp_fnv1a(uint64_t hash, const void *data, size_t len);
+
+struct jsonapp_parse_ctx *jsonapp_alloc_context(int argc, char **argv);
+void jsonapp_stop_workers(struct jsonapp_parse_ctx *jctx);
+void jsonapp_free_context(struct jsonapp_parse_ctx *jctx);
+struct jsonapp_parse_ctx *jsonapp_alloc_device_context(struct jsonapp_parse_ctx *parent,
+                                                       const uint8_t *mac);
+void jsonapp_free_device_context(struct jsonapp_parse_ctx *jctx);
+void jsonapp_apply(struct jsonapp_parse_ctx *jctx, const struct jsonapp_msg *msg);
+void jsonapp_disconnect(struct jsonapp_parse_ctx *jctx);
+void jsonapp_get_topic(struct jsonapp_mqtt_ctx *mctx, char *topic, int len);
+void jsonapp_init_backends(struct jsonapp_parse_ctx *jctx);
+void jsonapp_exit_backends(void);
+int jsonapp_process_json(struct jsonapp_parse_ctx *jctx, const struct jsonapp_msg *msg);
+
 void jsonapp_register_backend(struct jsonapp_parse_backend *backend);
 int jsonapp_has_config(struct jsonapp_parse_ctx *jctx, char *name, 
                        void (*reset_uci)(struct jsonapp_parse_ctx *jctx),
                        bool create);
 
-struct json_object *jsonapp_object_get_object_by_name(struct json_object *parent, char *name,
-                                                      enum json_type expected_json_type);
-
-void jsonapp_process_array(struct jsonapp_parse_ctx *jctx,
-                           struct json_object *obj_arr,
-                           void *user_data,
-                           void (*process_member)(struct jsonapp_parse_ctx *jctx,
-                                                  struct json_object *obj,
-                                                  void *user_data));
-
-void jsonapp_set_new_option(struct jsonapp_parse_ctx *jctx,
-                            struct json_object *obj,
-                            char *obj_member,
-                            enum json_type expected_type,
-                            struct uci_package *pkg, 
-                            struct uci_section *section,
-                            char *option, char *value);
-
-struct json_object *jsonapp_get_wlangrp(struct json_object *root);
-struct json_object *jsonapp_get_wlans(struct json_object *wlangrp);
-struct json_object *jsonapp_get_radius_servers(struct json_object *wlans);
-struct json_object *jsonapp_get_guest_acl_list(struct json_object *wlans);
-struct json_object *jsonapp_get_servers(struct json_object *radius_server);
+void jsonapp_uci_cache_init(struct jsonapp_parse_ctx *jctx);
+void jsonapp_uci_cache_exit(struct jsonapp_parse_ctx *jctx);
+void jsonapp_uci_cache_poll(struct jsonapp_parse_ctx *jctx);
+bool jsonapp_uci_cache_current(struct jsonapp_parse_ctx *jctx, const char *const *names);
+void jsonapp_uci_cache_seed(struct jsonapp_parse_ctx *jctx, const char *name,
+                            const struct stat *st);
+void jsonapp_uci_cache_save_stamps(struct jsonapp_parse_ctx *jctx, FILE *f);
+void jsonapp_uci_cache_claim(struct jsonapp_parse_ctx *jctx, const char *name,
+                             struct uci_context *ctx);
+void jsonapp_uci_cache_invalidate(struct jsonapp_parse_ctx *jctx);
+void jsonapp_uci_cache_refresh(struct jsonapp_parse_ctx *jctx);
+struct uci_package *jsonapp_uci_package(struct jsonapp_parse_ctx *jctx, const char *name);
+struct uci_section *jsonapp_uci_lookup_section(struct jsonapp_parse_ctx *jctx,
+                                               struct uci_package *pkg, const char *name);
+struct uci_section *jsonapp_uci_lookup_anon(struct jsonapp_parse_ctx *jctx,
+                                            struct uci_package *pkg, const char *type, int pos);
+void jsonapp_uci_section_added(struct jsonapp_parse_ctx *jctx, struct uci_package *pkg,
+                               struct uci_section *s);
+void jsonapp_uci_sections_changed(struct jsonapp_parse_ctx *jctx, struct uci_package *pkg);
+void jsonapp_uci_record_change(struct jsonapp_parse_ctx *jctx, struct uci_package *pkg,
+                               const char *section, const char *type, const char *option,
+                               const char *old, const char *value);
+void jsonapp_uci_stage(struct jsonapp_parse_ctx *jctx, struct uci_package *pkg);
+int jsonapp_uci_txn_commit(struct jsonapp_parse_ctx *jctx);
+void jsonapp_uci_txn_abort(struct jsonapp_parse_ctx *jctx);
+
+int jsonapp_invalid(struct jsonapp_parse_ctx *jctx, const char *fmt, ...)
+        __attribute__((format(printf, 2, 3)));
+const char *jsonapp_check_string(struct jsonapp_parse_ctx *jctx, const char *str,
+                                 const char *where, int max_len, bool ident);
+
+void jsonapp_map_compile(struct jsonapp_parse_backend *backends);
+bool jsonapp_map_covers(struct jsonapp_parse_backend *backends);
+void jsonapp_map_free_plan(void);
+void jsonapp_map_init(struct jsonapp_parse_ctx *jctx);
+void jsonapp_map_exit(struct jsonapp_parse_ctx *jctx);
+int jsonapp_map_walk(struct jsonapp_parse_ctx *jctx, struct json_object *root);
+uint64_t jsonapp_map_fingerprint(struct jsonapp_parse_ctx *jctx,
+                                 struct jsonapp_parse_backend *backend);
+int jsonapp_map_count(struct jsonapp_parse_ctx *jctx, struct jsonapp_parse_backend *backend,
+                      int entry);
+struct json_object *jsonapp_map_value(struct jsonapp_parse_ctx *jctx,
+                                      struct jsonapp_parse_backend *backend,
+                                      int entry, int n);
+const char *jsonapp_map_string(struct jsonapp_parse_ctx *jctx,
+                               struct jsonapp_parse_backend *backend,
+                               int entry, int n);
+void jsonapp_map_to_diff(struct jsonapp_parse_ctx *jctx, struct jsonapp_parse_backend *backend,
+                         const char *package, struct jsonapp_diff *diff);
+
+struct json_object *jsonapp_scan(struct jsonapp_parse_ctx *jctx, const char *json, size_t len);
+
+enum jsonapp_encoding jsonapp_msg_encoding(const struct jsonapp_msg *msg);
+struct json_object *jsonapp_decode(struct jsonapp_parse_ctx *jctx, const struct jsonapp_msg *msg,
+                                   enum jsonapp_encoding encoding);
+
+void jsonapp_sched_init(struct jsonapp_parse_ctx *jctx, struct jsonapp_parse_backend *backends);
+void jsonapp_sched_exit(struct jsonapp_parse_ctx *jctx);
+int jsonapp_sched_run(struct jsonapp_parse_ctx *jctx, struct json_object *root);
+
+struct jsonapp_inflater *jsonapp_inflater_new(int max_inflated);
+void jsonapp_inflater_free(struct jsonapp_inflater *inf);
+void jsonapp_inflate_init(struct jsonapp_parse_ctx *jctx);
+void jsonapp_inflate_exit(struct jsonapp_parse_ctx *jctx);
+struct json_object *jsonapp_inflate(struct jsonapp_parse_ctx *jctx, const struct jsonapp_msg *msg,
+                                    enum jsonapp_encoding encoding);
+
+struct jsonapp_arenas *jsonapp_arenas_new(struct jsonapp_parse_backend *backends);
+void jsonapp_arenas_free(struct jsonapp_arenas *arenas);
+void jsonapp_arena_reset(struct jsonapp_parse_ctx *jctx);
+struct jsonapp_arena *jsonapp_arena(struct jsonapp_parse_ctx *jctx,
+                                    struct jsonapp_parse_backend *backend);
+void *jsonapp_arena_alloc(struct jsonapp_arena *arena, size_t size);
+char *jsonapp_arena_strdup(struct jsonapp_arena *arena, const char *s);
+char *jsonapp_arena_printf(struct jsonapp_arena *arena, const char *fmt, ...)
+        __attribute__((format(printf, 2, 3)));
+
+struct jsonapp_diff *jsonapp_diff_new(struct jsonapp_arena *arena, const char *managed_type);
+struct jsonapp_diff_sect *jsonapp_diff_section(struct jsonapp_diff *diff,
+                                               const char *name, const char *type);
+struct jsonapp_diff_sect *jsonapp_diff_anon_section(struct jsonapp_diff *diff,
+                                                    const char *type, int index);
+void jsonapp_diff_option(struct jsonapp_diff_sect *sect, const char *option,
+                         const char *value);
+int jsonapp_diff_apply(struct jsonapp_parse_ctx *jctx, struct uci_package *pkg,
+                       struct jsonapp_diff *diff);
+
+uint64_t jsonapp_now_ns(void);
+const char *jsonapp_stage_name(enum jsonapp_stage stage);
+void jsonapp_stage_reset(struct jsonapp_parse_ctx *jctx);
+void jsonapp_stage_add(struct jsonapp_parse_ctx *jctx, enum jsonapp_stage stage,
+                       uint64_t start_ns);
+void jsonapp_stats_init(struct jsonapp_parse_ctx *jctx);
+void jsonapp_stats_received(struct jsonapp_parse_ctx *jctx, int payloadlen);
+void jsonapp_stats_oversized(struct jsonapp_parse_ctx *jctx);
+void jsonapp_stats_applied(struct jsonapp_parse_ctx *jctx, const struct jsonapp_msg *msg,
+                           uint64_t start_ns, int err);
+void jsonapp_stats_reloaded(struct jsonapp_parse_ctx *jctx, uint64_t start_ns);
+void jsonapp_stats_publish(struct jsonapp_parse_ctx *jctx);
+
+struct jsonapp_msg *jsonapp_msg_new(const char *topic, const void *payload, int payloadlen);
+int jsonapp_msg_append(struct jsonapp_msg *msg, const void *payload, int payloadlen);
+void jsonapp_msg_free(struct jsonapp_msg *msg);
+struct jsonapp_queue *jsonapp_queue_new(unsigned int depth);
+void jsonapp_queue_free(struct jsonapp_queue *q);
+int jsonapp_queue_batch_size(struct jsonapp_queue *q);
+void jsonapp_queue_push(struct jsonapp_queue *q, struct jsonapp_msg *msg);
+int jsonapp_queue_drain(struct jsonapp_queue *q, struct jsonapp_msg **batch, int max);
+int jsonapp_queue_pop(struct jsonapp_queue *q, struct jsonapp_msg **batch);
+void jsonapp_queue_close(struct jsonapp_queue *q);
+void jsonapp_queue_get_stats(struct jsonapp_queue *q, struct jsonapp_queue_stats *stats);
+
+void jsonapp_snapshot_load(struct jsonapp_parse_ctx *jctx,
+                           struct jsonapp_parse_backend *backends);
+void jsonapp_snapshot_save(struct jsonapp_parse_ctx *jctx,
+                           struct jsonapp_parse_backend *backends);
+bool jsonapp_snapshot_current(struct jsonapp_parse_ctx *jctx,
+                              struct jsonapp_parse_backend *backends);
+
+void jsonapp_reactor_init(struct jsonapp_parse_ctx *jctx);
+void jsonapp_reactor_exit(struct jsonapp_parse_ctx *jctx);
+void jsonapp_reactor_run(struct jsonapp_parse_ctx *jctx);
+void jsonapp_reactor_wake(struct jsonapp_parse_ctx *jctx);
+
+struct jsonapp_change *jsonapp_change_new(const char *package, const char *section,
+                                          const char *type, const char *option,
+                                          const char *old, const char *value);
+void jsonapp_change_free(struct jsonapp_change *changes);
+void jsonapp_reload_init(struct jsonapp_parse_ctx *jctx);
+void jsonapp_reload_exit(struct jsonapp_parse_ctx *jctx);
+void jsonapp_reload_push(struct jsonapp_parse_ctx *jctx, struct jsonapp_change *changes);
+int jsonapp_reload_run(char *const argv[]);
+
+void jsonapp_gateway_init(struct jsonapp_parse_ctx *jctx);
+void jsonapp_gateway_exit(struct jsonapp_parse_ctx *jctx);
+struct jsonapp_device *jsonapp_gateway_device(struct jsonapp_parse_ctx *jctx, const char *topic);
+void jsonapp_gateway_push(struct jsonapp_device *device, struct jsonapp_msg *msg);
+int jsonapp_gateway_get_stats(struct jsonapp_parse_ctx *jctx, struct jsonapp_queue_stats *stats);
 
 #define foreach_parse_backend(_backend, _backend_list) \
         for ((_backend) = (_backend_list); _backend; _backend = _backend->next)
@@ -0,0 +1,26 @@
+#include <signal.h>
+#include <pthread.h>
+#include "json-app.h"
+
+int main(int argc, char **argv)
+{
+        struct jsonapp_parse_ctx *jctx;
+        sigset_t sigs;
+
+        /* block the shutdown signals before any thread is started. they are
+         * only ever picked up through the signalfd of the main loop, never
+         * in the middle of an apply on the worker. */
+        sigemptyset(&sigs);
+        sigaddset(&sigs, SIGINT);
+        sigaddset(&sigs, SIGTERM);
+        if (pthread_sigmask(SIG_BLOCK, &sigs, NULL) != 0) {
+                jsonapp_die("jsonapp error trapping SIGINT");
+        }
+
+        jctx = jsonapp_alloc_context(argc, argv);
+        jsonapp_reactor_run(jctx);
+        jsonapp_stop_workers(jctx);
+        jsonapp_disconnect(jctx);
+        jsonapp_free_context(jctx);
+        return 0;
+}
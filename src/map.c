@@ -0,0 +1,460 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "json-app.h"
+#include "map.h"
+
+/* declarative json -> uci mappings.
+ *
+ * backends list the json members they read in a table of struct
+ * jsonapp_map. at startup the tables of all registered backends are
+ * compiled into one traversal plan: a tree of path steps in which common
+ * prefixes like WlanGroup.wlans[0] are shared. for every message the plan is
+ * walked once, looking up each member a single time, and the values found
+ * are collected per table entry in the parse context. backends then read
+ * them with jsonapp_map_value() or let jsonapp_map_to_diff() turn the entries
+ * that name a uci target straight into desired options.
+ *
+ * a path is a dot separated list of member names, each optionally followed
+ * by [n] for the n'th array element or [*] for every element:
+ *
+ *      WlanGroup.wlans[0].radiusServerList[1].servers[0].ip
+ *
+ * a target is package.@type[n].option; with [*] the section index is taken
+ * from the element of the innermost [*] in the path. */
+
+struct jsonapp_map_match {
+        struct json_object *obj;
+        int idx;
+};
+
+struct jsonapp_map_result {
+        struct jsonapp_map_match *matches;
+        int nr;
+        int size;
+};
+
+struct jsonapp_plan_node jsonapp_plan_root = { .index = -1, .where = "root" };
+struct jsonapp_plan_slot *jsonapp_plan_slots;
+int jsonapp_plan_nr_slots;
+
+static void *jsonapp_map_alloc(size_t size)
+{
+        void *p;
+
+        if (!(p = calloc(1, size)))
+                jsonapp_die("insufficient memory for json mapping plan");
+        return p;
+}
+
+static char *jsonapp_map_strndup(const char *s, size_t len)
+{
+        char *dup;
+
+        if (!(dup = strndup(s, len)))
+                jsonapp_die("insufficient memory for json mapping plan");
+        return dup;
+}
+
+static struct jsonapp_plan_node *jsonapp_plan_step(struct jsonapp_plan_node *parent,
+                                                   const char *path, size_t path_len,
+                                                   const char *key, size_t key_len,
+                                                   int index)
+{
+        struct jsonapp_plan_node *node;
+
+        for (node = parent->child; node; node = node->next) {
+                if (key && node->key && strlen(node->key) == key_len &&
+                    strncmp(node->key, key, key_len) == 0)
+                        return node;
+                if (!key && !node->key && node->index == index)
+                        return node;
+        }
+
+        node = jsonapp_map_alloc(sizeof *node);
+        if (key) {
+                node->key = jsonapp_map_strndup(key, key_len);
+                node->key_len = key_len;
+        }
+        node->index = index;
+        node->wildcard = parent->wildcard || (!key && index == -1);
+        node->where = jsonapp_map_strndup(path, path_len);
+        node->next = parent->child;
+        parent->child = node;
+        return node;
+}
+
+/* add the steps of path below the root and return the last one */
+static struct jsonapp_plan_node *jsonapp_plan_add_path(const char *path, bool required)
+{
+        struct jsonapp_plan_node *node = &jsonapp_plan_root;
+        const char *p = path;
+        const char *key;
+        char *end;
+        long index;
+
+        while (*p) {
+                key = p;
+                while (*p && *p != '.' && *p != '[')
+                        p++;
+                if (p == key)
+                        jsonapp_die("bad json mapping path: %s", path);
+                node = jsonapp_plan_step(node, path, p - path, key, p - key, 0);
+                node->required |= required;
+
+                while (*p == '[') {
+                        if (p[1] == '*' && p[2] == ']') {
+                                index = -1;
+                                end = (char *)p + 2;
+                        } else {
+                                index = strtol(p + 1, &end, 10);
+                                if (end == p + 1 || *end != ']' || index < 0)
+                                        jsonapp_die("bad json mapping path: %s", path);
+                        }
+                        p = end + 1;
+                        node = jsonapp_plan_step(node, path, p - path, NULL, 0, index);
+                        node->required |= required;
+                }
+
+                if (*p == '.') {
+                        if (!*++p)
+                                jsonapp_die("bad json mapping path: %s", path);
+                } else if (*p) {
+                        jsonapp_die("bad json mapping path: %s", path);
+                }
+        }
+        return node;
+}
+
+/* split package.@type[n].option */
+static void jsonapp_plan_parse_target(struct jsonapp_plan_slot *slot, const char *target)
+{
+        const char *section = strchr(target, '.');
+        const char *bracket = section ? strchr(section, '[') : NULL;
+        const char *option = bracket ? strchr(bracket, '.') : NULL;
+        char *end;
+
+        if (!option || section[1] != '@')
+                jsonapp_die("bad uci mapping target: %s", target);
+
+        slot->package = jsonapp_map_strndup(target, section - target);
+        slot->type = jsonapp_map_strndup(section + 2, bracket - section - 2);
+        if (bracket[1] == '*' && bracket[2] == ']') {
+                slot->index = -1;
+                end = (char *)bracket + 2;
+        } else {
+                slot->index = strtol(bracket + 1, &end, 10);
+        }
+        if (*end != ']' || end + 1 != option || !option[1] || !*slot->type)
+                jsonapp_die("bad uci mapping target: %s", target);
+        slot->option = jsonapp_map_strndup(option + 1, strlen(option + 1));
+        return;
+}
+
+/* compile the tables of every backend in the list into the traversal plan */
+void jsonapp_map_compile(struct jsonapp_parse_backend *backends)
+{
+        struct jsonapp_parse_backend *backend;
+        struct jsonapp_plan_node *node;
+        struct jsonapp_plan_leaf *leaf;
+        const struct jsonapp_map *map;
+        int nr_slots = 0;
+        int slot = 0;
+
+        if (jsonapp_plan_slots)
+                return;
+
+        foreach_parse_backend(backend, backends) {
+                for (map = backend->map; map && map->path; map++)
+                        nr_slots++;
+        }
+        jsonapp_plan_slots = jsonapp_map_alloc((nr_slots ? nr_slots : 1) *
+                                               sizeof *jsonapp_plan_slots);
+
+        foreach_parse_backend(backend, backends) {
+                backend->map_base = slot;
+                for (map = backend->map; map && map->path; map++, slot++) {
+                        jsonapp_plan_slots[slot].map = map;
+                        if (map->target)
+                                jsonapp_plan_parse_target(&jsonapp_plan_slots[slot], map->target);
+
+                        node = jsonapp_plan_add_path(map->path, !map->optional);
+                        leaf = jsonapp_map_alloc(sizeof *leaf);
+                        leaf->slot = slot;
+                        leaf->next = node->leaves;
+                        node->leaves = leaf;
+                }
+        }
+        jsonapp_plan_nr_slots = nr_slots;
+        return;
+}
+
+/* true if every backend reads the message through a mapping table only,
+ * which is what the lazy scanner needs */
+bool jsonapp_map_covers(struct jsonapp_parse_backend *backends)
+{
+        struct jsonapp_parse_backend *backend;
+
+        foreach_parse_backend(backend, backends) {
+                if (!backend->map)
+                        return false;
+        }
+        return true;
+}
+
+static void jsonapp_plan_free_node(struct jsonapp_plan_node *node)
+{
+        struct jsonapp_plan_node *child;
+        struct jsonapp_plan_leaf *leaf;
+
+        while ((child = node->child)) {
+                node->child = child->next;
+                jsonapp_plan_free_node(child);
+                free(child->key);
+                free(child->where);
+                free(child);
+        }
+        while ((leaf = node->leaves)) {
+                node->leaves = leaf->next;
+                free(leaf);
+        }
+        return;
+}
+
+void jsonapp_map_free_plan(void)
+{
+        int i;
+
+        jsonapp_plan_free_node(&jsonapp_plan_root);
+        for (i = 0; i < jsonapp_plan_nr_slots; i++) {
+                free(jsonapp_plan_slots[i].package);
+                free(jsonapp_plan_slots[i].type);
+                free(jsonapp_plan_slots[i].option);
+        }
+        free(jsonapp_plan_slots);
+        jsonapp_plan_slots = NULL;
+        jsonapp_plan_nr_slots = 0;
+        return;
+}
+
+void jsonapp_map_init(struct jsonapp_parse_ctx *jctx)
+{
+        int n = jsonapp_plan_nr_slots;
+
+        jctx->map_results = jsonapp_map_alloc((n ? n : 1) * sizeof *jctx->map_results);
+        return;
+}
+
+void jsonapp_map_exit(struct jsonapp_parse_ctx *jctx)
+{
+        int i;
+
+        if (!jctx->map_results)
+                return;
+        for (i = 0; i < jsonapp_plan_nr_slots; i++)
+                free(jctx->map_results[i].matches);
+        free(jctx->map_results);
+        jctx->map_results = NULL;
+        return;
+}
+
+static void jsonapp_map_add_match(struct jsonapp_map_result *result,
+                                  struct json_object *obj, int idx)
+{
+        struct jsonapp_map_match *matches;
+
+        if (result->nr == result->size) {
+                result->size = result->size ? result->size * 2 : 4;
+                if (!(matches = realloc(result->matches, result->size * sizeof *matches)))
+                        jsonapp_die("insufficient memory for json mapping results");
+                result->matches = matches;
+        }
+        result->matches[result->nr].obj = obj;
+        result->matches[result->nr].idx = idx;
+        result->nr++;
+        return;
+}
+
+/* report a problem at node if the step below it that ran into it leads to a
+ * required entry. returns 0 if it does not matter. */
+static int jsonapp_plan_missing(struct jsonapp_parse_ctx *jctx, bool required,
+                                struct jsonapp_plan_node *node, int idx, const char *what)
+{
+        if (!required)
+                return 0;
+        if (node->wildcard)
+                return jsonapp_invalid(jctx, "%s: %s (element %d)", node->where, what, idx);
+        return jsonapp_invalid(jctx, "%s: %s", node->where, what);
+}
+
+/* obj is the value at node. idx is the element of the innermost [*] */
+static int jsonapp_plan_visit(struct jsonapp_parse_ctx *jctx, struct jsonapp_plan_node *node,
+                              struct json_object *obj, int idx)
+{
+        struct jsonapp_plan_node *child;
+        struct jsonapp_plan_leaf *leaf;
+        const struct jsonapp_map *map;
+        struct json_object *member;
+        enum json_type type = json_object_get_type(obj);
+        char what[64];
+        int n;
+        int i;
+
+        for (leaf = node->leaves; leaf; leaf = leaf->next) {
+                map = jsonapp_plan_slots[leaf->slot].map;
+                if (type == map->type) {
+                        jsonapp_map_add_match(&jctx->map_results[leaf->slot], obj, idx);
+                } else if (!map->optional) {
+                        snprintf(what, sizeof what, "expected %s, got %s",
+                                 json_type_to_name(map->type), json_type_to_name(type));
+                        return jsonapp_plan_missing(jctx, true, node, idx, what);
+                }
+        }
+
+        for (child = node->child; child; child = child->next) {
+                if (child->key) {
+                        if (type != json_type_object) {
+                                if (jsonapp_plan_missing(jctx, child->required, node, idx,
+                                                         "expected object"))
+                                        return -1;
+                                continue;
+                        }
+                        if (!json_object_object_get_ex(obj, child->key, &member)) {
+                                if (jsonapp_plan_missing(jctx, child->required, child, idx,
+                                                         "missing"))
+                                        return -1;
+                                continue;
+                        }
+                        if (jsonapp_plan_visit(jctx, child, member, idx))
+                                return -1;
+                        continue;
+                }
+
+                if (type != json_type_array) {
+                        if (jsonapp_plan_missing(jctx, child->required, node, idx,
+                                                 "expected array"))
+                                return -1;
+                        continue;
+                }
+                n = json_object_array_length(obj);
+                if (child->index == -1) {
+                        for (i = 0; i < n; i++) {
+                                member = json_object_array_get_idx(obj, i);
+                                if (jsonapp_plan_visit(jctx, child, member, i))
+                                        return -1;
+                        }
+                } else if (child->index < n) {
+                        member = json_object_array_get_idx(obj, child->index);
+                        if (jsonapp_plan_visit(jctx, child, member, idx))
+                                return -1;
+                } else {
+                        snprintf(what, sizeof what, "expected at least %d entries",
+                                 child->index + 1);
+                        if (jsonapp_plan_missing(jctx, child->required, node, idx, what))
+                                return -1;
+                }
+        }
+        return 0;
+}
+
+/* collect the values of every table entry from root in one pass. returns -1,
+ * with the reason recorded by jsonapp_invalid(), when a required member is
+ * missing or of the wrong type. */
+int jsonapp_map_walk(struct jsonapp_parse_ctx *jctx, struct json_object *root)
+{
+        int i;
+
+        for (i = 0; i < jsonapp_plan_nr_slots; i++)
+                jctx->map_results[i].nr = 0;
+        return jsonapp_plan_visit(jctx, &jsonapp_plan_root, root, 0);
+}
+
+/* fingerprint of what the backend's table found in the message: every value
+ * with its type and the array element it was found in. a backend that reads
+ * nothing but its table sees no difference between two messages with the
+ * same fingerprint. */
+uint64_t jsonapp_map_fingerprint(struct jsonapp_parse_ctx *jctx,
+                                 struct jsonapp_parse_backend *backend)
+{
+        struct jsonapp_map_result *result;
+        const struct jsonapp_map *map;
+        struct json_object *obj;
+        enum json_type type;
+        uint64_t hash = JSONAPP_FNV1A_INIT;
+        const char *str;
+        size_t len;
+        int i;
+
+        for (map = backend->map; map && map->path; map++) {
+                result = &jctx->map_results[backend->map_base + (map - backend->map)];
+                hash = jsonapp_fnv1a(hash, &result->nr, sizeof result->nr);
+                for (i = 0; i < result->nr; i++) {
+                        obj = result->matches[i].obj;
+                        type = json_object_get_type(obj);
+                        if (type == json_type_string) {
+                                str = json_object_get_string(obj);
+                                len = json_object_get_string_len(obj);
+                        } else {
+                                str = json_object_to_json_string_ext(obj, JSON_C_TO_STRING_PLAIN);
+                                len = strlen(str);
+                        }
+                        hash = jsonapp_fnv1a(hash, &result->matches[i].idx,
+                                             sizeof result->matches[i].idx);
+                        hash = jsonapp_fnv1a(hash, &type, sizeof type);
+                        hash = jsonapp_fnv1a(hash, &len, sizeof len);
+                        hash = jsonapp_fnv1a(hash, str, len);
+                }
+        }
+        return hash;
+}
+
+/* number of values found for entry of the backend's table */
+int jsonapp_map_count(struct jsonapp_parse_ctx *jctx, struct jsonapp_parse_backend *backend,
+                      int entry)
+{
+        return jctx->map_results[backend->map_base + entry].nr;
+}
+
+/* the n'th value found for entry, in document order. only valid while the
+ * message is being processed. */
+struct json_object *jsonapp_map_value(struct jsonapp_parse_ctx *jctx,
+                                      struct jsonapp_parse_backend *backend,
+                                      int entry, int n)
+{
+        struct jsonapp_map_result *result = &jctx->map_results[backend->map_base + entry];
+
+        return n < result->nr ? result->matches[n].obj : NULL;
+}
+
+const char *jsonapp_map_string(struct jsonapp_parse_ctx *jctx,
+                               struct jsonapp_parse_backend *backend,
+                               int entry, int n)
+{
+        return json_object_get_string(jsonapp_map_value(jctx, backend, entry, n));
+}
+
+/* add every value of the backend's entries that target package to diff */
+void jsonapp_map_to_diff(struct jsonapp_parse_ctx *jctx, struct jsonapp_parse_backend *backend,
+                         const char *package, struct jsonapp_diff *diff)
+{
+        struct jsonapp_map_result *result;
+        struct jsonapp_plan_slot *slot;
+        struct jsonapp_diff_sect *sect;
+        const struct jsonapp_map *map;
+        int i;
+
+        for (map = backend->map; map && map->path; map++) {
+                slot = &jsonapp_plan_slots[backend->map_base + (map - backend->map)];
+                if (!map->target || strcmp(slot->package, package) != 0)
+                        continue;
+                result = &jctx->map_results[backend->map_base + (map - backend->map)];
+                for (i = 0; i < result->nr; i++) {
+                        sect = jsonapp_diff_anon_section(diff, slot->type,
+                                                         slot->index == -1 ?
+                                                         result->matches[i].idx : slot->index);
+                        jsonapp_diff_option(sect, slot->option,
+                                            json_object_get_string(result->matches[i].obj));
+                }
+        }
+        return;
+}
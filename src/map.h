@@ -0,0 +1,39 @@
+#ifndef __JSONAPP_MAP_H__
+#define __JSONAPP_MAP_H__
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/* the compiled mapping plan, shared by map.c and the lazy scanner */
+
+struct jsonapp_plan_leaf {
+        struct jsonapp_plan_leaf *next;
+        int slot;
+};
+
+struct jsonapp_plan_node {
+        struct jsonapp_plan_node *child;
+        struct jsonapp_plan_node *next;
+        char *key;                      /* object member, NULL for an array step */
+        size_t key_len;
+        int index;                      /* array step: element, -1 for every one */
+        bool required;                  /* a required entry lies below */
+        bool wildcard;                  /* there is a [*] on the way here */
+        char *where;                    /* the path up to here, for errors */
+        struct jsonapp_plan_leaf *leaves;
+};
+
+/* a compiled table entry */
+struct jsonapp_plan_slot {
+        const struct jsonapp_map *map;
+        char *package;
+        char *type;
+        int index;                      /* -1 for the element of the innermost [*] */
+        char *option;
+};
+
+extern struct jsonapp_plan_node jsonapp_plan_root;
+extern struct jsonapp_plan_slot *jsonapp_plan_slots;
+extern int jsonapp_plan_nr_slots;
+
+#endif
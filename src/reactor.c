@@ -0,0 +1,327 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include "json-app.h"
+
+/* the main loop.
+ *
+ * all mqtt i/o runs on the main thread, which sleeps in epoll_wait() until
+ * one of these is ready:
+ *
+ *   - the broker socket: readable, and writable while libmosquitto has
+ *     packets queued
+ *   - a signalfd for SIGINT and SIGTERM
+ *   - a timerfd for mosquitto_loop_misc(), which sends the keepalive pings,
+ *     and one for reconnecting with backoff after the connection dropped
+ *   - a timerfd for the stats
+ *   - the eventfd the apply worker writes after queueing an apply result,
+ *     so it is sent right away
+ *   - the inotify fd of the config directory. changes are collected for
+ *     JSONAPP_CONFIG_DEBOUNCE_MS and then handed to the apply worker, which
+ *     reloads the packages that changed before the next push needs them.
+ *
+ * nothing polls; an idle agent wakes up for the keepalive and the stats. */
+
+#define JSONAPP_MISC_INTERVAL (JSONAPP_MQTT_KEEPALIVE / 4)
+#define JSONAPP_RECONNECT_MIN 1
+#define JSONAPP_RECONNECT_MAX 60
+#define JSONAPP_CONFIG_DEBOUNCE_MS 500
+
+enum {
+        JSONAPP_EV_MQTT,
+        JSONAPP_EV_SIGNAL,
+        JSONAPP_EV_MISC,
+        JSONAPP_EV_RECONNECT,
+        JSONAPP_EV_STATS,
+        JSONAPP_EV_WAKE,
+        JSONAPP_EV_CONFIG,
+        JSONAPP_EV_DEBOUNCE,
+};
+
+struct jsonapp_reactor {
+        struct jsonapp_parse_ctx *jctx;
+        int epfd;
+        int sigfd;
+        int misc_fd;
+        int reconnect_fd;
+        int stats_fd;
+        int debounce_fd;
+        int sock;                               /* -1 while disconnected */
+        bool want_write;
+        int backoff;
+        bool stop;
+};
+
+static void jsonapp_reactor_add(struct jsonapp_reactor *r, int fd, uint32_t events, int tag)
+{
+        struct epoll_event ev = { .events = events, .data.u32 = tag };
+
+        if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev) != 0)
+                jsonapp_die("unable to watch fd %d: %s", fd, strerror(errno));
+        return;
+}
+
+static void jsonapp_reactor_mod(struct jsonapp_reactor *r, int fd, uint32_t events, int tag)
+{
+        struct epoll_event ev = { .events = events, .data.u32 = tag };
+
+        if (epoll_ctl(r->epfd, EPOLL_CTL_MOD, fd, &ev) != 0)
+                jsonapp_die("unable to watch fd %d: %s", fd, strerror(errno));
+        return;
+}
+
+/* an armed timerfd fires after ms and then every interval ms (0 for once) */
+static int jsonapp_timer_new(void)
+{
+        int fd;
+
+        if ((fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1)
+                jsonapp_die("unable to create timer: %s", strerror(errno));
+        return fd;
+}
+
+static void jsonapp_timer_arm(int fd, int ms, int interval_ms)
+{
+        struct itimerspec its = {
+                .it_value = { ms / 1000, (ms % 1000) * 1000000L },
+                .it_interval = { interval_ms / 1000, (interval_ms % 1000) * 1000000L },
+        };
+
+        timerfd_settime(fd, 0, &its, NULL);
+        return;
+}
+
+/* a read clears a timerfd or eventfd */
+static void jsonapp_fd_clear(int fd)
+{
+        uint64_t count;
+
+        while (read(fd, &count, sizeof count) == -1 && errno == EINTR)
+                ;
+        return;
+}
+
+/* have the apply worker reload the packages that changed. refreshes share a
+ * topic no push can have, so a backlog of them coalesces into one. */
+static void jsonapp_reactor_refresh(struct jsonapp_parse_ctx *jctx)
+{
+        struct jsonapp_msg *msg;
+
+        if (!(msg = jsonapp_msg_new("", "", 0))) {
+                fprintf(stderr, "insufficient memory to refresh config\n");
+                return;
+        }
+        msg->refresh = true;
+        jsonapp_queue_push(jctx->queue, msg);
+        return;
+}
+
+static void jsonapp_reactor_connected(struct jsonapp_reactor *r)
+{
+        r->sock = mosquitto_socket(r->jctx->mqtt.mosq);
+        if (r->sock == -1)
+                return;
+        r->backoff = 0;
+        r->want_write = false;
+        jsonapp_reactor_add(r, r->sock, EPOLLIN, JSONAPP_EV_MQTT);
+        return;
+}
+
+/* the connection is gone: stop watching the socket and try again later,
+ * waiting twice as long after every failed attempt */
+static void jsonapp_reactor_lost(struct jsonapp_reactor *r, int err)
+{
+        if (r->sock != -1) {
+                fprintf(stderr, "lost connection to mqtt server: %s\n", mosquitto_strerror(err));
+                epoll_ctl(r->epfd, EPOLL_CTL_DEL, r->sock, NULL);
+                r->sock = -1;
+        }
+        r->backoff = r->backoff ? r->backoff * 2 : JSONAPP_RECONNECT_MIN;
+        if (r->backoff > JSONAPP_RECONNECT_MAX)
+                r->backoff = JSONAPP_RECONNECT_MAX;
+        jsonapp_timer_arm(r->reconnect_fd, r->backoff * 1000, 0);
+        return;
+}
+
+static void jsonapp_reactor_reconnect(struct jsonapp_reactor *r)
+{
+        int err;
+
+        if ((err = mosquitto_reconnect(r->jctx->mqtt.mosq)) != MOSQ_ERR_SUCCESS) {
+                jsonapp_reactor_lost(r, err);
+                return;
+        }
+        jsonapp_reactor_connected(r);
+        return;
+}
+
+/* watch for the socket to become writable only while there is something
+ * to write */
+static void jsonapp_reactor_update_write(struct jsonapp_reactor *r)
+{
+        bool want;
+
+        if (r->sock == -1)
+                return;
+        want = mosquitto_want_write(r->jctx->mqtt.mosq);
+        if (want == r->want_write)
+                return;
+        jsonapp_reactor_mod(r, r->sock, EPOLLIN | (want ? EPOLLOUT : 0), JSONAPP_EV_MQTT);
+        r->want_write = want;
+        return;
+}
+
+static void jsonapp_reactor_mqtt(struct jsonapp_reactor *r, uint32_t events)
+{
+        struct mosquitto *mosq = r->jctx->mqtt.mosq;
+        int err = MOSQ_ERR_SUCCESS;
+
+        if (events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                err = mosquitto_loop_read(mosq, 1);
+        if (err == MOSQ_ERR_SUCCESS && (events & EPOLLOUT))
+                err = mosquitto_loop_write(mosq, 1);
+        if (err != MOSQ_ERR_SUCCESS)
+                jsonapp_reactor_lost(r, err);
+        return;
+}
+
+static void jsonapp_reactor_dispatch(struct jsonapp_reactor *r, struct epoll_event *ev)
+{
+        struct jsonapp_parse_ctx *jctx = r->jctx;
+        struct signalfd_siginfo si;
+        int err;
+
+        switch (ev->data.u32) {
+        case JSONAPP_EV_MQTT:
+                if (r->sock != -1)
+                        jsonapp_reactor_mqtt(r, ev->events);
+                break;
+        case JSONAPP_EV_SIGNAL:
+                if (read(r->sigfd, &si, sizeof si) == sizeof si)
+                        r->stop = true;
+                break;
+        case JSONAPP_EV_MISC:
+                jsonapp_fd_clear(r->misc_fd);
+                if (r->sock != -1 && (err = mosquitto_loop_misc(jctx->mqtt.mosq)) != MOSQ_ERR_SUCCESS)
+                        jsonapp_reactor_lost(r, err);
+                break;
+        case JSONAPP_EV_RECONNECT:
+                jsonapp_fd_clear(r->reconnect_fd);
+                jsonapp_reactor_reconnect(r);
+                break;
+        case JSONAPP_EV_STATS:
+                jsonapp_fd_clear(r->stats_fd);
+                jsonapp_stats_publish(jctx);
+                break;
+        case JSONAPP_EV_WAKE:
+                jsonapp_fd_clear(jctx->mqtt.wake_fd);
+                break;
+        case JSONAPP_EV_CONFIG:
+                /* the worker reads the events; only note that there are some
+                 * and look again once they were handed over */
+                jsonapp_timer_arm(r->debounce_fd, JSONAPP_CONFIG_DEBOUNCE_MS, 0);
+                break;
+        case JSONAPP_EV_DEBOUNCE:
+                jsonapp_fd_clear(r->debounce_fd);
+                jsonapp_reactor_refresh(jctx);
+                jsonapp_reactor_mod(r, jctx->inotify_fd, EPOLLIN | EPOLLONESHOT,
+                                    JSONAPP_EV_CONFIG);
+                break;
+        }
+        return;
+}
+
+/* run until SIGINT or SIGTERM. the signals must already be blocked in every
+ * thread. */
+void jsonapp_reactor_run(struct jsonapp_parse_ctx *jctx)
+{
+        struct jsonapp_reactor r = { .jctx = jctx, .sock = -1 };
+        struct epoll_event events[8];
+        sigset_t sigs;
+        int n;
+        int i;
+
+        sigemptyset(&sigs);
+        sigaddset(&sigs, SIGINT);
+        sigaddset(&sigs, SIGTERM);
+        if ((r.epfd = epoll_create1(EPOLL_CLOEXEC)) == -1 ||
+            (r.sigfd = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC)) == -1)
+                jsonapp_die("unable to set up main loop: %s", strerror(errno));
+        jsonapp_reactor_add(&r, r.sigfd, EPOLLIN, JSONAPP_EV_SIGNAL);
+
+        r.misc_fd = jsonapp_timer_new();
+        jsonapp_timer_arm(r.misc_fd, JSONAPP_MISC_INTERVAL * 1000, JSONAPP_MISC_INTERVAL * 1000);
+        jsonapp_reactor_add(&r, r.misc_fd, EPOLLIN, JSONAPP_EV_MISC);
+        r.reconnect_fd = jsonapp_timer_new();
+        jsonapp_reactor_add(&r, r.reconnect_fd, EPOLLIN, JSONAPP_EV_RECONNECT);
+        r.stats_fd = jsonapp_timer_new();
+        if (jctx->stats_interval > 0)
+                jsonapp_timer_arm(r.stats_fd, jctx->stats_interval * 1000,
+                                  jctx->stats_interval * 1000);
+        jsonapp_reactor_add(&r, r.stats_fd, EPOLLIN, JSONAPP_EV_STATS);
+        jsonapp_reactor_add(&r, jctx->mqtt.wake_fd, EPOLLIN, JSONAPP_EV_WAKE);
+        r.debounce_fd = jsonapp_timer_new();
+        jsonapp_reactor_add(&r, r.debounce_fd, EPOLLIN, JSONAPP_EV_DEBOUNCE);
+        if (jctx->inotify_fd != -1)
+                jsonapp_reactor_add(&r, jctx->inotify_fd, EPOLLIN | EPOLLONESHOT,
+                                    JSONAPP_EV_CONFIG);
+
+        /* jsonapp_init_mqtt() made the first attempt */
+        if (jctx->mqtt.connected)
+                jsonapp_reactor_connected(&r);
+        if (r.sock == -1)
+                jsonapp_reactor_lost(&r, MOSQ_ERR_NO_CONN);
+
+        while (!r.stop) {
+                jsonapp_reactor_update_write(&r);
+                if ((n = epoll_wait(r.epfd, events, sizeof events / sizeof *events, -1)) == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        jsonapp_die("main loop failed: %s", strerror(errno));
+                }
+                for (i = 0; i < n; i++)
+                        jsonapp_reactor_dispatch(&r, &events[i]);
+        }
+
+        close(r.debounce_fd);
+        close(r.stats_fd);
+        close(r.reconnect_fd);
+        close(r.misc_fd);
+        close(r.sigfd);
+        close(r.epfd);
+        return;
+}
+
+/* let the main loop know there is something queued to send. called by the
+ * apply worker. */
+void jsonapp_reactor_wake(struct jsonapp_parse_ctx *jctx)
+{
+        uint64_t one = 1;
+
+        if (jctx->mqtt.wake_fd != -1 && write(jctx->mqtt.wake_fd, &one, sizeof one) == -1 &&
+            errno != EAGAIN)
+                perror("wake");
+        return;
+}
+
+void jsonapp_reactor_init(struct jsonapp_parse_ctx *jctx)
+{
+        if ((jctx->mqtt.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+                jsonapp_die("unable to create eventfd: %s", strerror(errno));
+        return;
+}
+
+void jsonapp_reactor_exit(struct jsonapp_parse_ctx *jctx)
+{
+        if (jctx->mqtt.wake_fd != -1)
+                close(jctx->mqtt.wake_fd);
+        jctx->mqtt.wake_fd = -1;
+        return;
+}
@@ -0,0 +1,254 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "json-app.h"
+
+/* service reloads after a commit.
+ *
+ * jsonapp_diff_apply() records every change it makes to a package: the
+ * sections it adds, retypes or deletes and the options it sets or deletes,
+ * with the value before and after. the records of a package that ends up
+ * written to disk are handed here once the commit is done; those of a
+ * message that is rolled back, or of a package whose text did not change,
+ * are dropped.
+ *
+ * a thread of its own runs the reload() hook of every backend with the
+ * changes to the packages that backend lists, and only if there are any,
+ * so that a push only restarts what it touched. the apply worker never
+ * waits for it. changes committed while the hooks are still busy are
+ * merged and handed over together on the next round. */
+struct jsonapp_reload {
+        struct jsonapp_parse_ctx *jctx;
+        pthread_t thread;
+        pthread_mutex_t lock;
+        pthread_cond_t cond;                    /* changes came in or the thread stops */
+        struct jsonapp_change *pending;
+        struct jsonapp_change **tail;
+        bool stop;
+};
+
+static char *jsonapp_change_copy(char **p, const char *s)
+{
+        char *copy = *p;
+
+        if (!s)
+                return NULL;
+        strcpy(copy, s);
+        *p += strlen(s) + 1;
+        return copy;
+}
+
+/* a single allocation with the strings behind the record */
+struct jsonapp_change *jsonapp_change_new(const char *package, const char *section,
+                                          const char *type, const char *option,
+                                          const char *old, const char *value)
+{
+        struct jsonapp_change *change;
+        size_t len = sizeof *change;
+        char *p;
+
+        len += strlen(package) + 1 + strlen(section) + 1 + strlen(type) + 1;
+        if (option)
+                len += strlen(option) + 1;
+        if (old)
+                len += strlen(old) + 1;
+        if (value)
+                len += strlen(value) + 1;
+        if (!(change = malloc(len)))
+                jsonapp_die("insufficient memory for change record");
+        p = (char *)(change + 1);
+        change->next = NULL;
+        change->package = jsonapp_change_copy(&p, package);
+        change->section = jsonapp_change_copy(&p, section);
+        change->type = jsonapp_change_copy(&p, type);
+        change->option = jsonapp_change_copy(&p, option);
+        change->old = jsonapp_change_copy(&p, old);
+        change->value = jsonapp_change_copy(&p, value);
+        return change;
+}
+
+void jsonapp_change_free(struct jsonapp_change *changes)
+{
+        struct jsonapp_change *next;
+
+        for (; changes; changes = next) {
+                next = changes->next;
+                free(changes);
+        }
+        return;
+}
+
+static bool jsonapp_reload_lists(const struct jsonapp_parse_backend *backend,
+                                 const char *package)
+{
+        const char *const *p;
+
+        for (p = backend->packages; *p; p++) {
+                if (strcmp(*p, package) == 0)
+                        return true;
+        }
+        return false;
+}
+
+/* run every hook that has changes to see, timed */
+static void jsonapp_reload_hooks(struct jsonapp_reload *r, struct jsonapp_change *changes)
+{
+        struct jsonapp_parse_ctx *jctx = r->jctx;
+        struct jsonapp_parse_backend *backend;
+        struct jsonapp_change **set;
+        struct jsonapp_change *change;
+        uint64_t start;
+        int nr = 0;
+        int n;
+
+        for (change = changes; change; change = change->next)
+                nr++;
+        if (!(set = calloc(nr, sizeof *set)))
+                jsonapp_die("insufficient memory for reload");
+
+        foreach_parse_backend(backend, jctx->backends) {
+                if (!backend->reload || !backend->packages)
+                        continue;
+                n = 0;
+                for (change = changes; change; change = change->next) {
+                        if (jsonapp_reload_lists(backend, change->package))
+                                set[n++] = change;
+                }
+                if (!n)
+                        continue;
+
+                start = jsonapp_now_ns();
+                if (backend->reload(jctx, set, n) != 0) {
+                        fprintf(stderr, "reload of %s failed\n", backend->name);
+                        atomic_fetch_add_explicit(&jctx->stats.reload_failed, 1,
+                                                  memory_order_relaxed);
+                }
+                jsonapp_stats_reloaded(jctx, start);
+                fprintf(stderr, "reloaded %s for %d changes in %llu us\n", backend->name, n,
+                        (unsigned long long)(jsonapp_now_ns() - start) / 1000);
+        }
+        free(set);
+        return;
+}
+
+/* hand the changes over until the context goes away; what is pending then
+ * is still reloaded, as it is on disk already */
+static void *jsonapp_reload_thread(void *arg)
+{
+        struct jsonapp_reload *r = arg;
+        struct jsonapp_change *changes;
+
+        pthread_mutex_lock(&r->lock);
+        for (;;) {
+                if (!(changes = r->pending)) {
+                        if (r->stop)
+                                break;
+                        pthread_cond_wait(&r->cond, &r->lock);
+                        continue;
+                }
+                r->pending = NULL;
+                r->tail = &r->pending;
+                pthread_mutex_unlock(&r->lock);
+
+                jsonapp_reload_hooks(r, changes);
+                jsonapp_change_free(changes);
+                pthread_mutex_lock(&r->lock);
+        }
+        pthread_mutex_unlock(&r->lock);
+        return NULL;
+}
+
+/* start the reload thread if a backend has a reload() hook. without one
+ * nothing is recorded at all. */
+void jsonapp_reload_init(struct jsonapp_parse_ctx *jctx)
+{
+        struct jsonapp_parse_backend *backend;
+        struct jsonapp_reload *r;
+
+        foreach_parse_backend(backend, jctx->backends) {
+                if (backend->reload && backend->packages)
+                        break;
+        }
+        if (!backend)
+                return;
+
+        if (!(r = calloc(1, sizeof *r)))
+                jsonapp_die("insufficient memory for reload");
+        r->jctx = jctx;
+        r->tail = &r->pending;
+        pthread_mutex_init(&r->lock, NULL);
+        pthread_cond_init(&r->cond, NULL);
+        if (pthread_create(&r->thread, NULL, jsonapp_reload_thread, r) != 0)
+                jsonapp_die("unable to start reload thread");
+        jctx->reload = r;
+        return;
+}
+
+void jsonapp_reload_exit(struct jsonapp_parse_ctx *jctx)
+{
+        struct jsonapp_reload *r = jctx->reload;
+
+        if (!r)
+                return;
+        pthread_mutex_lock(&r->lock);
+        r->stop = true;
+        pthread_cond_signal(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+        pthread_join(r->thread, NULL);
+        pthread_cond_destroy(&r->cond);
+        pthread_mutex_destroy(&r->lock);
+        free(r);
+        jctx->reload = NULL;
+        return;
+}
+
+/* the changes of a commit, for the hooks. takes them over. */
+void jsonapp_reload_push(struct jsonapp_parse_ctx *jctx, struct jsonapp_change *changes)
+{
+        struct jsonapp_reload *r = jctx->reload;
+        struct jsonapp_change *last;
+
+        if (!changes)
+                return;
+        if (!r) {
+                jsonapp_change_free(changes);
+                return;
+        }
+        for (last = changes; last->next; last = last->next)
+                ;
+        pthread_mutex_lock(&r->lock);
+        *r->tail = changes;
+        r->tail = &last->next;
+        pthread_cond_signal(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+        return;
+}
+
+/* run argv[0] with argv, without a shell, and wait for it. returns 0 if
+ * it exited with 0, -1 otherwise. for reload() hooks. */
+int jsonapp_reload_run(char *const argv[])
+{
+        pid_t pid;
+        int status;
+
+        if ((pid = fork()) == -1) {
+                perror("fork");
+                return -1;
+        }
+        if (!pid) {
+                execvp(argv[0], argv);
+                fprintf(stderr, "unable to run %s: %s\n", argv[0], strerror(errno));
+                _exit(127);
+        }
+        while (waitpid(pid, &status, 0) == -1) {
+                if (errno != EINTR) {
+                        perror("waitpid");
+                        return -1;
+                }
+        }
+        return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
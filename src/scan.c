@@ -0,0 +1,633 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "json-app.h"
+#include "map.h"
+
+/* lazy json scanner.
+ *
+ * json_tokener_parse() builds the whole document, one heap object per
+ * member, although the backends only read the few dozen members named in
+ * their mapping tables. this scanner walks the payload text along the
+ * compiled mapping plan instead and only materializes what lies on a plan
+ * path: the objects and arrays leading to a mapped member and the mapped
+ * members themselves. everything else is skipped over without being
+ * decoded.
+ *
+ * the result is a sparse json-c tree with the same shape on the plan paths,
+ * so jsonapp_map_walk(), the validators and the jsonapp_get_* accessors work
+ * on it unchanged. elements of an array that are not on a plan path are
+ * null, and an array is cut after the last element the plan needs unless
+ * it has a [*] step.
+ *
+ * skipped values are only checked for terminated strings and balanced
+ * brackets; a payload that is malformed only in a part nobody reads is
+ * accepted. */
+
+#define JSONAPP_SCAN_MAX_DEPTH JSONAPP_MAX_DEPTH
+#define JSONAPP_SCAN_MAX_NODES 8
+
+/* the plan nodes that meet at one position of the document, e.g. both
+ * wlans[0] and wlans[*] for the first wlan */
+struct jsonapp_scan_set {
+        struct jsonapp_plan_node *node[JSONAPP_SCAN_MAX_NODES];
+        int nr;
+};
+
+struct jsonapp_scanner {
+        const char *start;
+        const char *p;
+        const char *end;
+        int depth;
+        const char *error;
+        const char *error_at;
+};
+
+/* strings and skipped containers are searched a machine word at a time for
+ * the few bytes that matter. this is plain c so it works the same on the
+ * mips and arm boards and on either byte order. */
+typedef unsigned long jsonapp_word;
+
+#define JSONAPP_WORD_ONES ((jsonapp_word)-1 / 0xff)
+#define JSONAPP_WORD_HIGHS (JSONAPP_WORD_ONES * 0x80)
+
+/* non-zero if any byte of w is c */
+static inline jsonapp_word jsonapp_word_has(jsonapp_word w, unsigned char c)
+{
+        w ^= JSONAPP_WORD_ONES * c;
+        return (w - JSONAPP_WORD_ONES) & ~w & JSONAPP_WORD_HIGHS;
+}
+
+/* first '"' or '\\' at or after p */
+static const char *jsonapp_scan_find_quote(const char *p, const char *end)
+{
+        jsonapp_word w;
+
+        while (end - p >= (long)sizeof w) {
+                memcpy(&w, p, sizeof w);
+                if (jsonapp_word_has(w, '"') | jsonapp_word_has(w, '\\'))
+                        break;
+                p += sizeof w;
+        }
+        while (p < end && *p != '"' && *p != '\\')
+                p++;
+        return p;
+}
+
+/* first string or bracket at or after p */
+static const char *jsonapp_scan_find_structural(const char *p, const char *end)
+{
+        jsonapp_word w;
+
+        while (end - p >= (long)sizeof w) {
+                memcpy(&w, p, sizeof w);
+                if (jsonapp_word_has(w, '"') | jsonapp_word_has(w, '{') |
+                    jsonapp_word_has(w, '}') | jsonapp_word_has(w, '[') |
+                    jsonapp_word_has(w, ']'))
+                        break;
+                p += sizeof w;
+        }
+        while (p < end && *p != '"' && *p != '{' && *p != '}' && *p != '[' && *p != ']')
+                p++;
+        return p;
+}
+
+static int jsonapp_scan_fail(struct jsonapp_scanner *s, const char *why)
+{
+        if (!s->error) {
+                s->error = why;
+                s->error_at = s->p;
+        }
+        return -1;
+}
+
+static void jsonapp_scan_ws(struct jsonapp_scanner *s)
+{
+        while (s->p < s->end &&
+               (*s->p == ' ' || *s->p == '\t' || *s->p == '\n' || *s->p == '\r'))
+                s->p++;
+        return;
+}
+
+/* s->p is on the opening quote. on return str/len hold the raw contents and
+ * s->p is past the closing quote. */
+static int jsonapp_scan_string(struct jsonapp_scanner *s, const char **str, size_t *len,
+                               bool *escaped)
+{
+        const char *start = s->p + 1;
+        const char *p = start;
+
+        *escaped = false;
+        for (;;) {
+                p = jsonapp_scan_find_quote(p, s->end);
+                if (p == s->end)
+                        return jsonapp_scan_fail(s, "unterminated string");
+                if (*p == '"')
+                        break;
+                *escaped = true;
+                p += 2;
+                if (p > s->end)
+                        return jsonapp_scan_fail(s, "unterminated string");
+        }
+        *str = start;
+        *len = p - start;
+        s->p = p + 1;
+        return 0;
+}
+
+static int jsonapp_scan_hex4(const char *p, const char *end, unsigned int *cp)
+{
+        int i;
+
+        if (end - p < 4)
+                return -1;
+        *cp = 0;
+        for (i = 0; i < 4; i++) {
+                *cp <<= 4;
+                if (p[i] >= '0' && p[i] <= '9')
+                        *cp |= p[i] - '0';
+                else if (p[i] >= 'a' && p[i] <= 'f')
+                        *cp |= p[i] - 'a' + 10;
+                else if (p[i] >= 'A' && p[i] <= 'F')
+                        *cp |= p[i] - 'A' + 10;
+                else
+                        return -1;
+        }
+        return 0;
+}
+
+static char *jsonapp_scan_put_utf8(char *o, unsigned int cp)
+{
+        if (cp < 0x80) {
+                *o++ = cp;
+        } else if (cp < 0x800) {
+                *o++ = 0xc0 | (cp >> 6);
+                *o++ = 0x80 | (cp & 0x3f);
+        } else if (cp < 0x10000) {
+                *o++ = 0xe0 | (cp >> 12);
+                *o++ = 0x80 | ((cp >> 6) & 0x3f);
+                *o++ = 0x80 | (cp & 0x3f);
+        } else {
+                *o++ = 0xf0 | (cp >> 18);
+                *o++ = 0x80 | ((cp >> 12) & 0x3f);
+                *o++ = 0x80 | ((cp >> 6) & 0x3f);
+                *o++ = 0x80 | (cp & 0x3f);
+        }
+        return o;
+}
+
+/* decode the escapes of a raw string. the result is never longer than the
+ * input and is returned in a new buffer. */
+static char *jsonapp_scan_unescape(struct jsonapp_scanner *s, const char *str, size_t len,
+                                   size_t *out_len)
+{
+        const char *end = str + len;
+        const char *p = str;
+        unsigned int lo;
+        unsigned int cp;
+        char *buf;
+        char *o;
+
+        if (!(buf = malloc(len + 1)))
+                jsonapp_die("insufficient memory for json scanner");
+        o = buf;
+        while (p < end) {
+                if (*p != '\\') {
+                        *o++ = *p++;
+                        continue;
+                }
+                p++;
+                switch (*p++) {
+                case '"': *o++ = '"'; break;
+                case '\\': *o++ = '\\'; break;
+                case '/': *o++ = '/'; break;
+                case 'b': *o++ = '\b'; break;
+                case 'f': *o++ = '\f'; break;
+                case 'n': *o++ = '\n'; break;
+                case 'r': *o++ = '\r'; break;
+                case 't': *o++ = '\t'; break;
+                case 'u':
+                        if (jsonapp_scan_hex4(p, end, &cp) != 0)
+                                goto bad;
+                        p += 4;
+                        if (cp >= 0xd800 && cp < 0xdc00 && end - p >= 6 &&
+                            p[0] == '\\' && p[1] == 'u' &&
+                            jsonapp_scan_hex4(p + 2, end, &lo) == 0 &&
+                            lo >= 0xdc00 && lo < 0xe000) {
+                                cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                                p += 6;
+                        } else if (cp >= 0xd800 && cp < 0xe000) {
+                                /* lone surrogate */
+                                cp = 0xfffd;
+                        }
+                        o = jsonapp_scan_put_utf8(o, cp);
+                        break;
+                default:
+                        goto bad;
+                }
+        }
+        *o = '\0';
+        *out_len = o - buf;
+        return buf;
+bad:
+        free(buf);
+        jsonapp_scan_fail(s, "invalid escape");
+        return NULL;
+}
+
+/* skip to just past the bracket that closes the container s->p is in */
+static int jsonapp_scan_skip_container(struct jsonapp_scanner *s, char close)
+{
+        char stack[JSONAPP_SCAN_MAX_DEPTH];
+        const char *str;
+        size_t len;
+        bool escaped;
+        int depth = 0;
+
+        stack[depth++] = close;
+        for (;;) {
+                s->p = jsonapp_scan_find_structural(s->p, s->end);
+                if (s->p == s->end)
+                        return jsonapp_scan_fail(s, "unexpected end of message");
+                switch (*s->p) {
+                case '"':
+                        if (jsonapp_scan_string(s, &str, &len, &escaped) != 0)
+                                return -1;
+                        continue;
+                case '{':
+                case '[':
+                        if (s->depth + depth >= JSONAPP_SCAN_MAX_DEPTH)
+                                return jsonapp_scan_fail(s, "nesting too deep");
+                        stack[depth++] = *s->p == '{' ? '}' : ']';
+                        break;
+                default:
+                        if (*s->p != stack[--depth])
+                                return jsonapp_scan_fail(s, "mismatched bracket");
+                        if (!depth) {
+                                s->p++;
+                                return 0;
+                        }
+                        break;
+                }
+                s->p++;
+        }
+}
+
+static int jsonapp_scan_skip(struct jsonapp_scanner *s)
+{
+        const char *start = s->p;
+        const char *str;
+        size_t len;
+        bool escaped;
+
+        switch (s->p < s->end ? *s->p : '\0') {
+        case '"':
+                return jsonapp_scan_string(s, &str, &len, &escaped);
+        case '{':
+                s->p++;
+                return jsonapp_scan_skip_container(s, '}');
+        case '[':
+                s->p++;
+                return jsonapp_scan_skip_container(s, ']');
+        }
+
+        /* numbers and literals run up to the next delimiter */
+        while (s->p < s->end && *s->p != ',' && *s->p != '}' && *s->p != ']' &&
+               *s->p != ' ' && *s->p != '\t' && *s->p != '\n' && *s->p != '\r')
+                s->p++;
+        if (s->p == start)
+                return jsonapp_scan_fail(s, "expected a value");
+        return 0;
+}
+
+static int jsonapp_scan_scalar(struct jsonapp_scanner *s, struct json_object **obj)
+{
+        const char *start = s->p;
+        const char *str;
+        char *decoded;
+        char *end;
+        size_t len;
+        bool escaped;
+        bool real = false;
+
+        *obj = NULL;
+        if (*s->p == '"') {
+                if (jsonapp_scan_string(s, &str, &len, &escaped) != 0)
+                        return -1;
+                if (!escaped) {
+                        *obj = json_object_new_string_len(str, len);
+                        return 0;
+                }
+                if (!(decoded = jsonapp_scan_unescape(s, str, len, &len)))
+                        return -1;
+                *obj = json_object_new_string_len(decoded, len);
+                free(decoded);
+                return 0;
+        }
+
+        if (jsonapp_scan_skip(s) != 0)
+                return -1;
+        len = s->p - start;
+        if (len == 4 && memcmp(start, "true", 4) == 0) {
+                *obj = json_object_new_boolean(1);
+        } else if (len == 5 && memcmp(start, "false", 5) == 0) {
+                *obj = json_object_new_boolean(0);
+        } else if (len == 4 && memcmp(start, "null", 4) == 0) {
+                /* json-c has no null object either */
+        } else if (*start == '-' || (*start >= '0' && *start <= '9')) {
+                /* the message is nul terminated, so strto*() stop in time */
+                for (str = start; str < s->p; str++) {
+                        if (*str == '.' || *str == 'e' || *str == 'E')
+                                real = true;
+                }
+                if (real)
+                        *obj = json_object_new_double(strtod(start, &end));
+                else
+                        *obj = json_object_new_int64(strtoll(start, &end, 10));
+                if (end != s->p) {
+                        json_object_put(*obj);
+                        *obj = NULL;
+                        s->p = start;
+                        return jsonapp_scan_fail(s, "invalid number");
+                }
+        } else {
+                s->p = start;
+                return jsonapp_scan_fail(s, "unexpected character");
+        }
+        return 0;
+}
+
+/* the value at s->p as a whole, for table entries that map a complete
+ * object or array */
+static int jsonapp_scan_full(struct jsonapp_scanner *s, struct json_object **obj)
+{
+        struct json_tokener *tok;
+        const char *start = s->p;
+
+        if (jsonapp_scan_skip(s) != 0)
+                return -1;
+        if (!(tok = json_tokener_new()))
+                jsonapp_die("insufficient memory for json scanner");
+        *obj = json_tokener_parse_ex(tok, start, s->p - start);
+        if (json_tokener_get_error(tok) != json_tokener_success) {
+                json_object_put(*obj);
+                *obj = NULL;
+                s->p = start;
+                json_tokener_free(tok);
+                return jsonapp_scan_fail(s, "invalid value");
+        }
+        json_tokener_free(tok);
+        return 0;
+}
+
+static bool jsonapp_scan_wants_whole(struct jsonapp_scan_set *set)
+{
+        struct jsonapp_plan_leaf *leaf;
+        enum json_type type;
+        int i;
+
+        for (i = 0; i < set->nr; i++) {
+                for (leaf = set->node[i]->leaves; leaf; leaf = leaf->next) {
+                        type = jsonapp_plan_slots[leaf->slot].map->type;
+                        if (type == json_type_object || type == json_type_array)
+                                return true;
+                }
+        }
+        return false;
+}
+
+/* the children of set that continue with key, or with element idx if key is
+ * NULL. returns the number found, -1 if there are more than fit. */
+static int jsonapp_scan_children(struct jsonapp_scan_set *set, const char *key, size_t key_len,
+                                 int idx, struct jsonapp_scan_set *next)
+{
+        struct jsonapp_plan_node *child;
+        int i;
+
+        next->nr = 0;
+        for (i = 0; i < set->nr; i++) {
+                for (child = set->node[i]->child; child; child = child->next) {
+                        if (key ? !child->key || child->key_len != key_len ||
+                                  memcmp(child->key, key, key_len) != 0 :
+                                  child->key || (child->index != idx && child->index != -1))
+                                continue;
+                        if (next->nr == JSONAPP_SCAN_MAX_NODES)
+                                return -1;
+                        next->node[next->nr++] = child;
+                }
+        }
+        return next->nr;
+}
+
+static bool jsonapp_scan_has_keys(struct jsonapp_scan_set *set)
+{
+        struct jsonapp_plan_node *child;
+        int i;
+
+        for (i = 0; i < set->nr; i++) {
+                for (child = set->node[i]->child; child; child = child->next) {
+                        if (child->key)
+                                return true;
+                }
+        }
+        return false;
+}
+
+/* how far an array has to be read: -1 for all of it, else one past the
+ * last element a child of set asks for (0 if there are no array steps) */
+static int jsonapp_scan_array_need(struct jsonapp_scan_set *set)
+{
+        struct jsonapp_plan_node *child;
+        int need = 0;
+        int i;
+
+        for (i = 0; i < set->nr; i++) {
+                for (child = set->node[i]->child; child; child = child->next) {
+                        if (child->key)
+                                continue;
+                        if (child->index == -1)
+                                return -1;
+                        if (child->index >= need)
+                                need = child->index + 1;
+                }
+        }
+        return need;
+}
+
+static int jsonapp_scan_value(struct jsonapp_scanner *s, struct jsonapp_scan_set *set,
+                              struct json_object **obj);
+
+static int jsonapp_scan_object(struct jsonapp_scanner *s, struct jsonapp_scan_set *set,
+                               struct json_object *obj)
+{
+        struct jsonapp_scan_set next;
+        struct json_object *member;
+        const char *key;
+        char *decoded = NULL;
+        size_t len;
+        bool escaped;
+        int n;
+
+        s->p++;
+        if (!jsonapp_scan_has_keys(set))
+                return jsonapp_scan_skip_container(s, '}');
+        jsonapp_scan_ws(s);
+        if (s->p < s->end && *s->p == '}') {
+                s->p++;
+                return 0;
+        }
+        for (;;) {
+                if (s->p == s->end || *s->p != '"')
+                        return jsonapp_scan_fail(s, "expected a member name");
+                if (jsonapp_scan_string(s, &key, &len, &escaped) != 0)
+                        return -1;
+                if (escaped) {
+                        if (!(decoded = jsonapp_scan_unescape(s, key, len, &len)))
+                                return -1;
+                        key = decoded;
+                }
+                n = jsonapp_scan_children(set, key, len, 0, &next);
+                free(decoded);
+                decoded = NULL;
+
+                jsonapp_scan_ws(s);
+                if (s->p == s->end || *s->p != ':')
+                        return jsonapp_scan_fail(s, "expected ':'");
+                s->p++;
+                jsonapp_scan_ws(s);
+                if (n == 0) {
+                        if (jsonapp_scan_skip(s) != 0)
+                                return -1;
+                } else {
+                        if (n < 0) {
+                                /* too many plan paths meet here to follow them
+                                 * all, so take the member as it is */
+                                if (jsonapp_scan_full(s, &member) != 0)
+                                        return -1;
+                        } else if (jsonapp_scan_value(s, &next, &member) != 0) {
+                                return -1;
+                        }
+                        /* a duplicate member replaces the earlier one, as
+                         * with json_tokener */
+                        json_object_object_add(obj, next.node[0]->key, member);
+                }
+
+                jsonapp_scan_ws(s);
+                if (s->p < s->end && *s->p == ',') {
+                        s->p++;
+                        jsonapp_scan_ws(s);
+                        continue;
+                }
+                if (s->p < s->end && *s->p == '}') {
+                        s->p++;
+                        return 0;
+                }
+                return jsonapp_scan_fail(s, "expected ',' or '}'");
+        }
+}
+
+static int jsonapp_scan_array(struct jsonapp_scanner *s, struct jsonapp_scan_set *set,
+                              struct json_object *arr)
+{
+        struct jsonapp_scan_set next;
+        struct json_object *member;
+        int need = jsonapp_scan_array_need(set);
+        int idx = 0;
+        int n;
+
+        s->p++;
+        jsonapp_scan_ws(s);
+        if (s->p < s->end && *s->p == ']') {
+                s->p++;
+                return 0;
+        }
+        for (;; idx++) {
+                if (need != -1 && idx >= need)
+                        return jsonapp_scan_skip_container(s, ']');
+
+                member = NULL;
+                n = jsonapp_scan_children(set, NULL, 0, idx, &next);
+                if (n == 0) {
+                        if (jsonapp_scan_skip(s) != 0)
+                                return -1;
+                } else if (n < 0) {
+                        if (jsonapp_scan_full(s, &member) != 0)
+                                return -1;
+                } else if (jsonapp_scan_value(s, &next, &member) != 0) {
+                        return -1;
+                }
+                json_object_array_add(arr, member);
+
+                jsonapp_scan_ws(s);
+                if (s->p < s->end && *s->p == ',') {
+                        s->p++;
+                        jsonapp_scan_ws(s);
+                        continue;
+                }
+                if (s->p < s->end && *s->p == ']') {
+                        s->p++;
+                        return 0;
+                }
+                return jsonapp_scan_fail(s, "expected ',' or ']'");
+        }
+}
+
+/* the value at s->p, materialized as far as the plan nodes in set need it */
+static int jsonapp_scan_value(struct jsonapp_scanner *s, struct jsonapp_scan_set *set,
+                              struct json_object **obj)
+{
+        int err;
+
+        *obj = NULL;
+        if (s->p == s->end)
+                return jsonapp_scan_fail(s, "unexpected end of message");
+        if (*s->p != '{' && *s->p != '[')
+                return jsonapp_scan_scalar(s, obj);
+        if (jsonapp_scan_wants_whole(set))
+                return jsonapp_scan_full(s, obj);
+        if (s->depth == JSONAPP_SCAN_MAX_DEPTH)
+                return jsonapp_scan_fail(s, "nesting too deep");
+
+        *obj = *s->p == '{' ? json_object_new_object() : json_object_new_array();
+        if (!*obj)
+                jsonapp_die("insufficient memory for json scanner");
+        s->depth++;
+        if (*s->p == '{')
+                err = jsonapp_scan_object(s, set, *obj);
+        else
+                err = jsonapp_scan_array(s, set, *obj);
+        s->depth--;
+        if (err) {
+                json_object_put(*obj);
+                *obj = NULL;
+        }
+        return err;
+}
+
+/* scan the nul terminated message json of len bytes along the mapping plan.
+ * returns the sparse tree, or NULL with the reason recorded by
+ * jsonapp_invalid(). */
+struct json_object *jsonapp_scan(struct jsonapp_parse_ctx *jctx, const char *json, size_t len)
+{
+        struct jsonapp_scanner s = { .start = json, .p = json, .end = json + len };
+        struct jsonapp_scan_set set = { .node = { &jsonapp_plan_root }, .nr = 1 };
+        struct json_object *root;
+
+        jsonapp_scan_ws(&s);
+        if (jsonapp_scan_value(&s, &set, &root) != 0) {
+                jsonapp_invalid(jctx, "unable to parse json message: %s at offset %ld",
+                                s.error, (long)(s.error_at - s.start));
+                return NULL;
+        }
+        /* nothing but whitespace may follow the document */
+        jsonapp_scan_ws(&s);
+        if (s.p != s.end) {
+                jsonapp_invalid(jctx, "unable to parse json message: trailing data at offset %ld",
+                                (long)(s.p - s.start));
+                json_object_put(root);
+                return NULL;
+        }
+        if (!root)
+                jsonapp_invalid(jctx, "unable to parse json message: null document");
+        return root;
+}
@@ -0,0 +1,245 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "json-app.h"
+
+/* runs the backends for a message.
+ *
+ * backends list the uci packages they touch. two backends without a package
+ * in common cannot see each other's changes, so they are run at the same
+ * time on a small pool of threads, the apply worker being one of them. the
+ * packages of a backend are loaded into a uci context of its own; libuci
+ * keeps all of its state in the context, so backends running side by side
+ * share nothing in libuci.
+ *
+ * backends that share a package run one after the other in registration
+ * order, and a backend that does not list its packages runs alone. once a
+ * backend has failed no further backend is started; the message is rolled
+ * back as a whole anyway. */
+
+#define JSONAPP_MAX_APPLY_THREADS 4
+
+enum {
+        JSONAPP_BACKEND_PENDING,
+        JSONAPP_BACKEND_RUNNING,
+        JSONAPP_BACKEND_DONE,
+};
+
+struct jsonapp_sched {
+        struct jsonapp_parse_ctx *jctx;
+        struct jsonapp_parse_backend *backends;
+        pthread_mutex_t lock;
+        pthread_cond_t cond;                    /* a backend finished or a message came in */
+        pthread_t *threads;
+        int nr_threads;
+        struct json_object *root;               /* of the message being applied */
+        int left;                               /* backends not done with the message */
+        int err;
+        bool stop;
+};
+
+static bool jsonapp_sched_conflict(const struct jsonapp_parse_backend *a,
+                                   const struct jsonapp_parse_backend *b)
+{
+        const char *const *p;
+        const char *const *q;
+
+        if (!a->packages || !b->packages)
+                return true;
+        for (p = a->packages; *p; p++) {
+                for (q = b->packages; *q; q++) {
+                        if (strcmp(*p, *q) == 0)
+                                return true;
+                }
+        }
+        return false;
+}
+
+/* the first pending backend that no unfinished backend before it conflicts
+ * with. a later backend never starts ahead of an earlier one it conflicts
+ * with, so the ones already running need no separate check. called with the
+ * lock held. */
+static struct jsonapp_parse_backend *jsonapp_sched_next(struct jsonapp_sched *s)
+{
+        struct jsonapp_parse_backend *backend;
+        struct jsonapp_parse_backend *prev;
+
+        foreach_parse_backend(backend, s->backends) {
+                if (backend->state != JSONAPP_BACKEND_PENDING)
+                        continue;
+                if (s->err) {
+                        backend->state = JSONAPP_BACKEND_DONE;
+                        if (!--s->left)
+                                pthread_cond_broadcast(&s->cond);
+                        continue;
+                }
+                foreach_parse_backend(prev, s->backends) {
+                        if (prev == backend)
+                                break;
+                        if (prev->state != JSONAPP_BACKEND_DONE &&
+                            jsonapp_sched_conflict(prev, backend))
+                                break;
+                }
+                if (prev == backend) {
+                        backend->state = JSONAPP_BACKEND_RUNNING;
+                        return backend;
+                }
+        }
+        return NULL;
+}
+
+/* called with the lock held, which is dropped while the backend runs */
+static void jsonapp_sched_apply(struct jsonapp_sched *s, struct jsonapp_parse_backend *backend)
+{
+        int result;
+
+        pthread_mutex_unlock(&s->lock);
+        result = backend->process_json(s->jctx, s->root);
+        pthread_mutex_lock(&s->lock);
+
+        backend->result = result;
+        backend->applied = true;
+        backend->state = JSONAPP_BACKEND_DONE;
+        if (result < 0)
+                s->err = -1;
+        s->left--;
+        pthread_cond_broadcast(&s->cond);
+        return;
+}
+
+static void *jsonapp_sched_thread(void *arg)
+{
+        struct jsonapp_sched *s = arg;
+        struct jsonapp_parse_backend *backend;
+
+        pthread_mutex_lock(&s->lock);
+        while (!s->stop) {
+                if ((backend = jsonapp_sched_next(s)))
+                        jsonapp_sched_apply(s, backend);
+                else
+                        pthread_cond_wait(&s->cond, &s->lock);
+        }
+        pthread_mutex_unlock(&s->lock);
+        return NULL;
+}
+
+/* give every backend that lists its packages a uci context of its own and
+ * start the pool. -j sets the number of threads backends run on, the apply
+ * worker included; by default there is one per cpu, up to
+ * JSONAPP_MAX_APPLY_THREADS. */
+void jsonapp_sched_init(struct jsonapp_parse_ctx *jctx, struct jsonapp_parse_backend *backends)
+{
+        struct jsonapp_parse_backend *backend;
+        struct jsonapp_sched *s;
+        const char *const *p;
+        int nr_backends = 0;
+        int threads;
+        int i;
+
+        if (jctx->sched)
+                return;
+        if (!(s = calloc(1, sizeof *s)))
+                jsonapp_die("insufficient memory for backend scheduler");
+        s->jctx = jctx;
+        s->backends = backends;
+        pthread_mutex_init(&s->lock, NULL);
+        pthread_cond_init(&s->cond, NULL);
+
+        foreach_parse_backend(backend, backends) {
+                nr_backends++;
+                backend->state = JSONAPP_BACKEND_DONE;
+                if (!backend->packages)
+                        continue;
+                if (!(backend->uci_ctx = uci_alloc_context()))
+                        jsonapp_die("insufficient memory for uci context");
+                uci_set_confdir(backend->uci_ctx, jctx->uci_ctx->confdir);
+                if (jctx->uci_ctx->savedir)
+                        uci_set_savedir(backend->uci_ctx, jctx->uci_ctx->savedir);
+                for (p = backend->packages; *p; p++)
+                        jsonapp_uci_cache_claim(jctx, *p, backend->uci_ctx);
+        }
+
+        if ((threads = jctx->apply_threads) <= 0) {
+                threads = sysconf(_SC_NPROCESSORS_ONLN);
+                if (threads > JSONAPP_MAX_APPLY_THREADS)
+                        threads = JSONAPP_MAX_APPLY_THREADS;
+        }
+        if (threads > nr_backends)
+                threads = nr_backends;
+        s->nr_threads = threads > 1 ? threads - 1 : 0;
+        if (s->nr_threads && !(s->threads = calloc(s->nr_threads, sizeof *s->threads)))
+                jsonapp_die("insufficient memory for backend threads");
+        for (i = 0; i < s->nr_threads; i++) {
+                if (pthread_create(&s->threads[i], NULL, jsonapp_sched_thread, s) != 0)
+                        jsonapp_die("unable to start backend thread");
+        }
+        jctx->sched = s;
+        return;
+}
+
+/* stop the pool and free the backends' uci contexts. the package cache
+ * still refers to them, so this comes after jsonapp_uci_cache_exit(). */
+void jsonapp_sched_exit(struct jsonapp_parse_ctx *jctx)
+{
+        struct jsonapp_sched *s = jctx->sched;
+        struct jsonapp_parse_backend *backend;
+        int i;
+
+        if (!s)
+                return;
+        pthread_mutex_lock(&s->lock);
+        s->stop = true;
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+        for (i = 0; i < s->nr_threads; i++)
+                pthread_join(s->threads[i], NULL);
+        free(s->threads);
+
+        foreach_parse_backend(backend, s->backends) {
+                if (backend->uci_ctx)
+                        uci_free_context(backend->uci_ctx);
+                backend->uci_ctx = NULL;
+        }
+        pthread_cond_destroy(&s->cond);
+        pthread_mutex_destroy(&s->lock);
+        free(s);
+        jctx->sched = NULL;
+        return;
+}
+
+/* run process_json() of every backend not skipped on root and wait for all
+ * of them.
+ * returns -1 if one of them failed; the backends that were not started
+ * because of it are left with applied unset. */
+int jsonapp_sched_run(struct jsonapp_parse_ctx *jctx, struct json_object *root)
+{
+        struct jsonapp_sched *s = jctx->sched;
+        struct jsonapp_parse_backend *backend;
+        int err;
+
+        pthread_mutex_lock(&s->lock);
+        s->root = root;
+        s->err = 0;
+        s->left = 0;
+        foreach_parse_backend(backend, s->backends) {
+                if (backend->skipped) {
+                        backend->state = JSONAPP_BACKEND_DONE;
+                        continue;
+                }
+                backend->state = JSONAPP_BACKEND_PENDING;
+                s->left++;
+        }
+        pthread_cond_broadcast(&s->cond);
+
+        while (s->left) {
+                if ((backend = jsonapp_sched_next(s)))
+                        jsonapp_sched_apply(s, backend);
+                else if (s->left)
+                        pthread_cond_wait(&s->cond, &s->lock);
+        }
+        s->root = NULL;
+        err = s->err;
+        pthread_mutex_unlock(&s->lock);
+        return err;
+}
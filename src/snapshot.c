@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "json-app.h"
+
+/* what was applied last, kept across restarts.
+ *
+ * after a restart the broker redelivers the retained config, or whatever
+ * was queued for our session while we were away. if that is the payload
+ * applied last and the config files are still as the apply left them,
+ * there is nothing to do. the snapshot holds the payload hash, the
+ * fingerprint of every backend's inputs (see jsonapp_map_fingerprint())
+ * and the stat of every package file the backends wrote:
+ *
+ *   jsonapp 1
+ *   hash <payload hash>
+ *   backend <name> <input hash>
+ *   package <name> <ino> <size> <mtime sec> <mtime nsec>
+ *
+ * the backend fingerprints also let the first push after a restart skip
+ * the backends whose inputs did not change, as they would be skipped with
+ * the process still running. a missing or unreadable snapshot only means
+ * the first push is applied in full. */
+
+#define JSONAPP_SNAPSHOT_VERSION 1
+
+void jsonapp_snapshot_load(struct jsonapp_parse_ctx *jctx,
+                           struct jsonapp_parse_backend *backends)
+{
+        struct jsonapp_parse_backend *backend;
+        unsigned long long ino;
+        long long size;
+        long long sec;
+        long nsec;
+        unsigned long long hash;
+        char name[64];
+        char line[256];
+        struct stat st;
+        int version = 0;
+        FILE *f;
+
+        if (!jctx->snapshot_path)
+                return;
+        if (!(f = fopen(jctx->snapshot_path, "r"))) {
+                if (errno != ENOENT)
+                        perror(jctx->snapshot_path);
+                return;
+        }
+
+        if (!fgets(line, sizeof line, f) || sscanf(line, "jsonapp %d", &version) != 1 ||
+            version != JSONAPP_SNAPSHOT_VERSION) {
+                fprintf(stderr, "ignoring snapshot %s of unknown version\n", jctx->snapshot_path);
+                fclose(f);
+                return;
+        }
+        while (fgets(line, sizeof line, f)) {
+                if (sscanf(line, "hash %llx", &hash) == 1) {
+                        jctx->applied_hash = hash;
+                        jctx->applied_known = true;
+                } else if (sscanf(line, "backend %63s %llx", name, &hash) == 2) {
+                        foreach_parse_backend(backend, backends) {
+                                if (strcmp(backend->name, name) != 0)
+                                        continue;
+                                backend->input_hash = hash;
+                                backend->input_known = true;
+                        }
+                } else if (sscanf(line, "package %63s %llu %lld %lld %ld", name, &ino, &size,
+                                  &sec, &nsec) == 5) {
+                        memset(&st, 0, sizeof st);
+                        st.st_ino = ino;
+                        st.st_size = size;
+                        st.st_mtim.tv_sec = sec;
+                        st.st_mtim.tv_nsec = nsec;
+                        jsonapp_uci_cache_seed(jctx, name, &st);
+                }
+        }
+        fclose(f);
+        return;
+}
+
+/* whether the file at path holds exactly len bytes of data */
+static bool jsonapp_snapshot_same(const char *path, const char *data, size_t len)
+{
+        char buf[512];
+        size_t off = 0;
+        size_t n;
+        FILE *f;
+
+        if (!(f = fopen(path, "r")))
+                return false;
+        while ((n = fread(buf, 1, sizeof buf, f)) > 0) {
+                if (off + n > len || memcmp(buf, data + off, n) != 0)
+                        break;
+                off += n;
+        }
+        fclose(f);
+        return !n && off == len;
+}
+
+/* replace the snapshot with the state after the message just applied,
+ * unless it already says the same; the snapshot usually lives on flash.
+ * the new one is written next to it and renamed over it.
+ *
+ * it is not synced on its own. it is written after the commit's syncfs(),
+ * so it never describes packages that are not on flash yet, and the next
+ * commit's syncfs() flushes it with the packages. a snapshot lost or torn
+ * by a crash before that no longer matches the package stamps or the
+ * payload hash, which only costs the next push a full apply. */
+void jsonapp_snapshot_save(struct jsonapp_parse_ctx *jctx,
+                           struct jsonapp_parse_backend *backends)
+{
+        struct jsonapp_parse_backend *backend;
+        char tmp[PATH_MAX];
+        char *data = NULL;
+        size_t len = 0;
+        FILE *f;
+        int err;
+
+        if (!jctx->snapshot_path)
+                return;
+        if (!(f = open_memstream(&data, &len))) {
+                perror("snapshot");
+                return;
+        }
+        fprintf(f, "jsonapp %d\n", JSONAPP_SNAPSHOT_VERSION);
+        if (jctx->applied_known)
+                fprintf(f, "hash %016llx\n", (unsigned long long)jctx->applied_hash);
+        foreach_parse_backend(backend, backends) {
+                if (backend->input_known)
+                        fprintf(f, "backend %s %016llx\n", backend->name,
+                                (unsigned long long)backend->input_hash);
+        }
+        jsonapp_uci_cache_save_stamps(jctx, f);
+        if (fclose(f) != 0 || jsonapp_snapshot_same(jctx->snapshot_path, data, len)) {
+                free(data);
+                return;
+        }
+
+        snprintf(tmp, sizeof tmp, "%s.tmp", jctx->snapshot_path);
+        if (!(f = fopen(tmp, "w"))) {
+                perror(tmp);
+                free(data);
+                return;
+        }
+        err = fwrite(data, 1, len, f) != len;
+        if (fclose(f) != 0 || err || rename(tmp, jctx->snapshot_path) != 0) {
+                perror(jctx->snapshot_path);
+                unlink(tmp);
+        }
+        free(data);
+        return;
+}
+
+/* whether the message being applied (jctx->msg_hash) is the one applied
+ * last and every backend's packages are still as it left them */
+bool jsonapp_snapshot_current(struct jsonapp_parse_ctx *jctx,
+                              struct jsonapp_parse_backend *backends)
+{
+        struct jsonapp_parse_backend *backend;
+
+        if (!jctx->snapshot_path || !jctx->applied_known ||
+            jctx->applied_hash != jctx->msg_hash)
+                return false;
+        foreach_parse_backend(backend, backends) {
+                if (!backend->packages || !jsonapp_uci_cache_current(jctx, backend->packages))
+                        return false;
+        }
+        return true;
+}
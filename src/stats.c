@@ -0,0 +1,262 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "json-app.h"
+
+/* per-message stage timing. the main module and the uci helpers add the time
+ * they spend in each stage to the parse context; whoever drives the apply
+ * (the worker, the bench) reads it back once the message is done.
+ *
+ * the worker folds every message into cumulative counters and latency
+ * histograms in jctx->stats, which are published as json on
+ * <topic>/stats every stats_interval seconds. */
+static const char *const jsonapp_stage_names[JSONAPP_STAGE_MAX] = {
+        [JSONAPP_STAGE_PARSE] = "parse",
+        [JSONAPP_STAGE_VALIDATE] = "validate",
+        [JSONAPP_STAGE_INIT] = "init",
+        [JSONAPP_STAGE_PROCESS] = "process",
+        [JSONAPP_STAGE_SAVE] = "save",
+        [JSONAPP_STAGE_COMMIT] = "commit",
+};
+
+uint64_t jsonapp_now_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+const char *jsonapp_stage_name(enum jsonapp_stage stage)
+{
+        return jsonapp_stage_names[stage];
+}
+
+void jsonapp_stage_reset(struct jsonapp_parse_ctx *jctx)
+{
+        memset(jctx->stage_ns, 0, sizeof jctx->stage_ns);
+        return;
+}
+
+void jsonapp_stage_add(struct jsonapp_parse_ctx *jctx, enum jsonapp_stage stage,
+                       uint64_t start_ns)
+{
+        /* backends running side by side add to the same stages */
+        atomic_fetch_add_explicit(&jctx->stage_ns[stage], jsonapp_now_ns() - start_ns,
+                                  memory_order_relaxed);
+        return;
+}
+
+void jsonapp_stats_init(struct jsonapp_parse_ctx *jctx)
+{
+        memset(&jctx->stats, 0, sizeof jctx->stats);
+        jctx->stats.start_ns = jsonapp_now_ns();
+        jctx->stats.last_ns = jctx->stats.start_ns;
+        return;
+}
+
+static int jsonapp_hist_bucket(uint64_t us)
+{
+        int bucket = 0;
+
+        while (us && bucket < JSONAPP_HIST_BUCKETS - 1) {
+                us >>= 1;
+                bucket++;
+        }
+        return bucket;
+}
+
+static void jsonapp_hist_add(struct jsonapp_hist *hist, uint64_t ns)
+{
+        unsigned long long us = ns / 1000;
+        unsigned long long max = atomic_load_explicit(&hist->max_us, memory_order_relaxed);
+
+        atomic_fetch_add_explicit(&hist->count, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&hist->sum_us, us, memory_order_relaxed);
+        atomic_fetch_add_explicit(&hist->bucket[jsonapp_hist_bucket(us)], 1, memory_order_relaxed);
+        while (us > max && !atomic_compare_exchange_weak_explicit(&hist->max_us, &max, us,
+                                                                  memory_order_relaxed,
+                                                                  memory_order_relaxed))
+                ;
+        return;
+}
+
+/* main loop: a message came in */
+void jsonapp_stats_received(struct jsonapp_parse_ctx *jctx, int payloadlen)
+{
+        atomic_fetch_add_explicit(&jctx->stats.received, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&jctx->stats.received_bytes, payloadlen, memory_order_relaxed);
+        return;
+}
+
+/* main loop: a push was dropped for being larger than -m allows */
+void jsonapp_stats_oversized(struct jsonapp_parse_ctx *jctx)
+{
+        atomic_fetch_add_explicit(&jctx->stats.oversized, 1, memory_order_relaxed);
+        return;
+}
+
+/* apply worker: msg was taken off the queue at start_ns and has just been
+ * through jsonapp_process_json(), which left its stage timings in jctx. a
+ * gateway counts the pushes of all of its devices. */
+void jsonapp_stats_applied(struct jsonapp_parse_ctx *jctx, const struct jsonapp_msg *msg,
+                           uint64_t start_ns, int err)
+{
+        struct jsonapp_stats *stats = jctx->parent ? &jctx->parent->stats : &jctx->stats;
+        int stage;
+
+        jsonapp_hist_add(&stats->queue, start_ns - msg->recv_ns);
+        for (stage = 0; stage < JSONAPP_STAGE_MAX; stage++)
+                jsonapp_hist_add(&stats->stage[stage], jctx->stage_ns[stage]);
+        jsonapp_hist_add(&stats->total, jsonapp_now_ns() - msg->recv_ns);
+
+        atomic_fetch_add_explicit(&stats->applied, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&stats->applied_bytes, msg->payloadlen, memory_order_relaxed);
+        atomic_fetch_add_explicit(&stats->written_bytes, jctx->written_bytes, memory_order_relaxed);
+        if (err)
+                atomic_fetch_add_explicit(&stats->failed, 1, memory_order_relaxed);
+        return;
+}
+
+/* reload thread: a backend's reload() hook started at start_ns returned */
+void jsonapp_stats_reloaded(struct jsonapp_parse_ctx *jctx, uint64_t start_ns)
+{
+        jsonapp_hist_add(&jctx->stats.reload, jsonapp_now_ns() - start_ns);
+        return;
+}
+
+static unsigned long long jsonapp_stats_load(atomic_ullong *counter)
+{
+        return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+static void jsonapp_stats_add_int(struct json_object *obj, const char *name,
+                                  unsigned long long value)
+{
+        json_object_object_add(obj, name, json_object_new_int64(value));
+        return;
+}
+
+/* upper bound of the bucket holding the pct'th percentile */
+static unsigned long long jsonapp_hist_percentile(unsigned long long *buckets,
+                                                  unsigned long long count,
+                                                  unsigned long long max, int pct)
+{
+        unsigned long long rank = (count * pct + 99) / 100;
+        unsigned long long seen = 0;
+        int i;
+
+        for (i = 0; i < JSONAPP_HIST_BUCKETS - 1; i++) {
+                seen += buckets[i];
+                if (seen >= rank)
+                        return (1ull << i) < max ? (1ull << i) : max;
+        }
+        return max;
+}
+
+static struct json_object *jsonapp_hist_to_json(struct jsonapp_hist *hist)
+{
+        unsigned long long buckets[JSONAPP_HIST_BUCKETS];
+        unsigned long long count = 0;
+        unsigned long long max;
+        struct json_object *obj = json_object_new_object();
+        struct json_object *arr = json_object_new_array();
+        int last = 0;
+        int i;
+
+        /* count is summed from the buckets so the percentiles stay
+         * consistent while the worker keeps adding samples */
+        for (i = 0; i < JSONAPP_HIST_BUCKETS; i++) {
+                buckets[i] = jsonapp_stats_load(&hist->bucket[i]);
+                count += buckets[i];
+                if (buckets[i])
+                        last = i + 1;
+        }
+        max = jsonapp_stats_load(&hist->max_us);
+
+        jsonapp_stats_add_int(obj, "count", count);
+        jsonapp_stats_add_int(obj, "sum", jsonapp_stats_load(&hist->sum_us));
+        jsonapp_stats_add_int(obj, "max", max);
+        jsonapp_stats_add_int(obj, "p50", jsonapp_hist_percentile(buckets, count, max, 50));
+        jsonapp_stats_add_int(obj, "p90", jsonapp_hist_percentile(buckets, count, max, 90));
+        jsonapp_stats_add_int(obj, "p99", jsonapp_hist_percentile(buckets, count, max, 99));
+        /* log2 buckets, trailing empty ones left out */
+        for (i = 0; i < last; i++)
+                json_object_array_add(arr, json_object_new_int64(buckets[i]));
+        json_object_object_add(obj, "log2_buckets", arr);
+        return obj;
+}
+
+/* publish a snapshot of the counters on <topic>/stats. latencies are in
+ * microseconds, rates are averaged over the time since the last publish. */
+void jsonapp_stats_publish(struct jsonapp_parse_ctx *jctx)
+{
+        struct jsonapp_stats *stats = &jctx->stats;
+        struct jsonapp_queue_stats qstats;
+        struct json_object *root;
+        struct json_object *obj;
+        unsigned long long applied;
+        unsigned long long bytes;
+        const char *payload;
+        char topic[256];
+        uint64_t now = jsonapp_now_ns();
+        double elapsed = (now - stats->last_ns) / 1e9;
+        int devices = -1;
+        int stage;
+        int err;
+
+        applied = jsonapp_stats_load(&stats->applied);
+        bytes = jsonapp_stats_load(&stats->applied_bytes);
+
+        root = json_object_new_object();
+        jsonapp_stats_add_int(root, "uptime", (now - stats->start_ns) / 1000000000ull);
+        jsonapp_stats_add_int(root, "received", jsonapp_stats_load(&stats->received));
+        jsonapp_stats_add_int(root, "received_bytes", jsonapp_stats_load(&stats->received_bytes));
+        jsonapp_stats_add_int(root, "applied", applied);
+        jsonapp_stats_add_int(root, "applied_bytes", bytes);
+        jsonapp_stats_add_int(root, "failed", jsonapp_stats_load(&stats->failed));
+        jsonapp_stats_add_int(root, "oversized", jsonapp_stats_load(&stats->oversized));
+        jsonapp_stats_add_int(root, "written_bytes", jsonapp_stats_load(&stats->written_bytes));
+        jsonapp_stats_add_int(root, "arena_peak_bytes", jsonapp_stats_load(&stats->arena_peak));
+        jsonapp_stats_add_int(root, "reload_failed", jsonapp_stats_load(&stats->reload_failed));
+        json_object_object_add(root, "msgs_per_sec", json_object_new_double(
+                                elapsed > 0 ? (applied - stats->last_applied) / elapsed : 0));
+        json_object_object_add(root, "bytes_per_sec", json_object_new_double(
+                                elapsed > 0 ? (bytes - stats->last_bytes) / elapsed : 0));
+
+        if (jctx->gateway)
+                devices = jsonapp_gateway_get_stats(jctx, &qstats);
+        else if (jctx->queue)
+                jsonapp_queue_get_stats(jctx->queue, &qstats);
+        if (devices >= 0)
+                jsonapp_stats_add_int(root, "devices", devices);
+        if (jctx->gateway || jctx->queue) {
+                obj = json_object_new_object();
+                jsonapp_stats_add_int(obj, "depth", qstats.depth);
+                jsonapp_stats_add_int(obj, "coalesced", qstats.coalesced);
+                jsonapp_stats_add_int(obj, "dropped", qstats.dropped);
+                json_object_object_add(root, "queue", obj);
+        }
+
+        obj = json_object_new_object();
+        json_object_object_add(obj, "queue", jsonapp_hist_to_json(&stats->queue));
+        for (stage = 0; stage < JSONAPP_STAGE_MAX; stage++)
+                json_object_object_add(obj, jsonapp_stage_name(stage),
+                                       jsonapp_hist_to_json(&stats->stage[stage]));
+        json_object_object_add(obj, "total", jsonapp_hist_to_json(&stats->total));
+        json_object_object_add(obj, "reload", jsonapp_hist_to_json(&stats->reload));
+        json_object_object_add(root, "latency_us", obj);
+
+        jsonapp_get_topic(&jctx->mqtt, topic, sizeof topic);
+        strncat(topic, "/stats", sizeof topic - strlen(topic) - 1);
+        payload = json_object_to_json_string(root);
+        err = mosquitto_publish(jctx->mqtt.mosq, NULL, topic, strlen(payload), payload, 0, false);
+        if (err != MOSQ_ERR_SUCCESS)
+                fprintf(stderr, "error publishing stats: %s\n", mosquitto_strerror(err));
+        json_object_put(root);
+
+        stats->last_ns = now;
+        stats->last_applied = applied;
+        stats->last_bytes = bytes;
+        return;
+}
@@ -0,0 +1,636 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <stdatomic.h>
+#include <zlib.h>
+#include "json-app.h"
+#include "bench.h"
+
+/* checks for `make check`.
+ *
+ * the commit checks apply generated configs (see bench_gen.c) to a scratch
+ * config directory through jsonapp_process_json(), exactly as the worker
+ * does, and look at the files the commit left behind. the checks run in
+ * order on a single context, each starting from what the one before it
+ * committed. the decoder checks encode the same configs as cbor and
+ * messagepack and only decode them. */
+
+struct test_ctx {
+        struct jsonapp_parse_ctx *jctx;
+        char confdir[PATH_MAX];
+        char savedir[PATH_MAX];
+};
+
+/* staged by some other uci user before we started */
+static const char test_delta[] = "wireless.radio0.channel='11'\n";
+
+static int test_failed;
+
+#define test_check(cond, ...)                                                   \
+        do {                                                                    \
+                if (!(cond)) {                                                  \
+                        fprintf(stderr, "%s:%d: ", __func__, __LINE__);        \
+                        fprintf(stderr, __VA_ARGS__);                           \
+                        fprintf(stderr, "\n");                                  \
+                        test_failed++;                                          \
+                }                                                               \
+        } while (0)
+
+static void test_write_file(const char *dir, const char *name, const char *data, mode_t mode)
+{
+        char path[PATH_MAX];
+        FILE *f;
+
+        snprintf(path, sizeof path, "%s/%s", dir, name);
+        if (!(f = fopen(path, "w")) || fputs(data, f) == EOF || fclose(f) != 0 ||
+            chmod(path, mode) != 0)
+                jsonapp_die("unable to write %s", path);
+        return;
+}
+
+/* the contents of dir/name, or NULL if there is no such file */
+static char *test_read_file(const char *dir, const char *name)
+{
+        char path[PATH_MAX];
+        char *data = NULL;
+        size_t len = 0;
+        FILE *f;
+
+        snprintf(path, sizeof path, "%s/%s", dir, name);
+        if (!(f = fopen(path, "r")))
+                return NULL;
+        if (getdelim(&data, &len, '\0', f) == -1) {
+                free(data);
+                data = strdup("");
+        }
+        fclose(f);
+        return data;
+}
+
+static mode_t test_mode(const char *dir, const char *name)
+{
+        char path[PATH_MAX];
+        struct stat st;
+
+        snprintf(path, sizeof path, "%s/%s", dir, name);
+        if (stat(path, &st) != 0)
+                return 0;
+        return st.st_mode & 07777;
+}
+
+/* a generated config with wlans wlans, numbered from first */
+static char *test_config(int first, int wlans, size_t *len)
+{
+        struct bench_gen_params params;
+        char spec[16];
+
+        snprintf(spec, sizeof spec, "%d", wlans);
+        bench_gen_parse(spec, &params);
+        params.first = first;
+        return bench_gen_config(&params, len);
+}
+
+/* apply len bytes at data as a push sent in one piece */
+static int test_push(struct test_ctx *test, const void *data, size_t len)
+{
+        struct jsonapp_msg *msg;
+        int err;
+
+        if (!(msg = jsonapp_msg_new("test", data, len)))
+                jsonapp_die("insufficient memory for message");
+        err = jsonapp_process_json(test->jctx, msg);
+        jsonapp_msg_free(msg);
+        return err;
+}
+
+/* apply a generated config with wlans wlans, numbered from first */
+static int test_apply(struct test_ctx *test, int first, int wlans)
+{
+        size_t len;
+        char *data;
+        int err;
+
+        data = test_config(first, wlans, &len);
+        err = test_push(test, data, len);
+        free(data);
+        return err;
+}
+
+/* the committed files keep their mode, and the delta staged by someone
+ * else, which went into the commit, is not left to be applied again */
+static void test_commit_files(struct test_ctx *test)
+{
+        char *wireless;
+        char *delta;
+
+        test_check(test_apply(test, 1, 3) == 0, "apply failed: %s", test->jctx->error);
+        test_check(test_mode(test->confdir, "wireless") == 0600,
+                   "wireless is %o", test_mode(test->confdir, "wireless"));
+        test_check(test_mode(test->confdir, "chilli") == 0640,
+                   "chilli is %o", test_mode(test->confdir, "chilli"));
+
+        wireless = test_read_file(test->confdir, "wireless");
+        test_check(wireless && strstr(wireless, "option channel '11'"),
+                   "staged change missing from wireless");
+        delta = test_read_file(test->savedir, "wireless");
+        test_check(!delta || !*delta, "delta left behind: %s", delta);
+        free(wireless);
+        free(delta);
+        return;
+}
+
+struct test_apply_arg {
+        struct test_ctx *test;
+        int first;
+        int wlans;
+        int err;
+        atomic_bool done;
+};
+
+static void *test_apply_thread(void *arg)
+{
+        struct test_apply_arg *apply = arg;
+
+        apply->err = test_apply(apply->test, apply->first, apply->wlans);
+        apply->done = true;
+        return NULL;
+}
+
+/* a commit waits for the lock uci commit takes on a package. the apply is
+ * given plenty of time to finish; it must still be waiting when the lock
+ * is let go. */
+static void test_commit_lock(struct test_ctx *test)
+{
+        struct test_apply_arg apply = { test, 1, 4, -1, false };
+        char path[PATH_MAX + 16];
+        pthread_t thread;
+        bool blocked;
+        char *before;
+        char *during;
+        char *after;
+        int fd;
+
+        snprintf(path, sizeof path, "%s/wireless", test->confdir);
+        if ((fd = open(path, O_RDONLY)) == -1 || flock(fd, LOCK_EX) != 0)
+                jsonapp_die("unable to lock %s", path);
+        before = test_read_file(test->confdir, "wireless");
+        if (pthread_create(&thread, NULL, test_apply_thread, &apply) != 0)
+                jsonapp_die("unable to start apply thread");
+        usleep(200 * 1000);
+        blocked = !apply.done;
+        during = test_read_file(test->confdir, "wireless");
+        close(fd);
+        pthread_join(thread, NULL);
+        after = test_read_file(test->confdir, "wireless");
+
+        test_check(blocked, "apply returned while wireless was locked");
+        test_check(apply.err == 0, "apply failed: %s", test->jctx->error);
+        test_check(before && during && strcmp(before, during) == 0,
+                   "wireless written while locked");
+        test_check(before && after && strcmp(before, after) != 0, "wireless not written");
+        free(before);
+        free(during);
+        free(after);
+        return;
+}
+
+/* a delta staged after the package was loaded was not part of the commit
+ * and stays for its owner */
+static void test_commit_new_delta(struct test_ctx *test)
+{
+        char *delta;
+
+        test_write_file(test->savedir, "wireless", test_delta, 0600);
+        test_check(test_apply(test, 1, 3) == 0, "apply failed: %s", test->jctx->error);
+        delta = test_read_file(test->savedir, "wireless");
+        test_check(delta && strcmp(delta, test_delta) == 0, "delta dropped");
+        free(delta);
+        return;
+}
+
+/* the ifname of the wifi-iface called name, copied */
+static char *test_ifname(struct test_ctx *test, const char *name)
+{
+        struct uci_package *pkg;
+        struct uci_section *s;
+        const char *ifname;
+
+        if (!(pkg = jsonapp_uci_package(test->jctx, "wireless")) ||
+            !(s = uci_lookup_section(pkg->ctx, pkg, name)) ||
+            !(ifname = uci_lookup_option_string(pkg->ctx, s, "ifname")))
+                return NULL;
+        return strdup(ifname);
+}
+
+/* removing the first of three wlans leaves the ifnames of the other two
+ * alone */
+static void test_ifnames_kept(struct test_ctx *test)
+{
+        static const char *const names[] = {
+                "wlan25GHz", "wlan22_5GHz", "wlan35GHz", "wlan32_5GHz",
+        };
+        char *before[4];
+        char *after;
+        int i;
+
+        test_check(test_apply(test, 1, 3) == 0, "apply failed: %s", test->jctx->error);
+        for (i = 0; i < 4; i++)
+                before[i] = test_ifname(test, names[i]);
+        test_check(test_apply(test, 2, 2) == 0, "apply failed: %s", test->jctx->error);
+        for (i = 0; i < 4; i++) {
+                after = test_ifname(test, names[i]);
+                test_check(before[i] && after && strcmp(before[i], after) == 0,
+                           "%s moved from %s to %s", names[i], before[i], after);
+                free(before[i]);
+                free(after);
+        }
+        return;
+}
+
+/* big endian v of n bytes */
+static void test_put(FILE *f, uint64_t v, int n)
+{
+        while (n--)
+                fputc(v >> (8 * n) & 0xff, f);
+        return;
+}
+
+/* the head of a cbor item, in its shortest form */
+static void test_cbor_head(FILE *f, int major, uint64_t arg)
+{
+        int n;
+
+        if (arg < 24) {
+                fputc(major << 5 | arg, f);
+                return;
+        }
+        n = arg <= 0xff ? 0 : arg <= 0xffff ? 1 : arg <= 0xffffffff ? 2 : 3;
+        fputc(major << 5 | (24 + n), f);
+        test_put(f, arg, 1 << n);
+        return;
+}
+
+/* a messagepack length: fix | n below limit, else op with 16 or op + 1
+ * with 32 bits */
+static void test_msgpack_head(FILE *f, int fix, uint32_t limit, int op, uint32_t n)
+{
+        if (n < limit) {
+                fputc(fix | n, f);
+        } else if (n <= 0xffff) {
+                fputc(op, f);
+                test_put(f, n, 2);
+        } else {
+                fputc(op + 1, f);
+                test_put(f, n, 4);
+        }
+        return;
+}
+
+static void test_encode_string(FILE *f, const char *str, int len, bool cbor)
+{
+        if (cbor)
+                test_cbor_head(f, 3, len);
+        else if (len >= 32 && len <= 0xff)
+                fprintf(f, "%c%c", 0xd9, len);
+        else
+                test_msgpack_head(f, 0xa0, 32, 0xda, len);
+        fwrite(str, 1, len, f);
+        return;
+}
+
+/* obj as cbor or messagepack */
+static void test_encode(FILE *f, struct json_object *obj, bool cbor)
+{
+        union { double d; uint64_t u; } num;
+        int64_t v;
+        size_t i;
+        size_t n;
+
+        switch (json_object_get_type(obj)) {
+        case json_type_null:
+                fputc(cbor ? 0xf6 : 0xc0, f);
+                break;
+        case json_type_boolean:
+                if (cbor)
+                        fputc(json_object_get_boolean(obj) ? 0xf5 : 0xf4, f);
+                else
+                        fputc(json_object_get_boolean(obj) ? 0xc3 : 0xc2, f);
+                break;
+        case json_type_int:
+                v = json_object_get_int64(obj);
+                if (cbor)
+                        test_cbor_head(f, v < 0, v < 0 ? -1 - v : v);
+                else if (v >= -32 && v < 128)
+                        fputc(v & 0xff, f);
+                else {
+                        fputc(0xd3, f);
+                        test_put(f, v, 8);
+                }
+                break;
+        case json_type_double:
+                num.d = json_object_get_double(obj);
+                fputc(cbor ? 0xfb : 0xcb, f);
+                test_put(f, num.u, 8);
+                break;
+        case json_type_string:
+                test_encode_string(f, json_object_get_string(obj),
+                                   json_object_get_string_len(obj), cbor);
+                break;
+        case json_type_array:
+                n = json_object_array_length(obj);
+                if (cbor)
+                        test_cbor_head(f, 4, n);
+                else
+                        test_msgpack_head(f, 0x90, 16, 0xdc, n);
+                for (i = 0; i < n; i++)
+                        test_encode(f, json_object_array_get_idx(obj, i), cbor);
+                break;
+        case json_type_object:
+                n = json_object_object_length(obj);
+                if (cbor)
+                        test_cbor_head(f, 5, n);
+                else
+                        test_msgpack_head(f, 0x80, 16, 0xde, n);
+                json_object_object_foreach(obj, key, val) {
+                        test_encode_string(f, key, strlen(key), cbor);
+                        test_encode(f, val, cbor);
+                }
+                break;
+        }
+        return;
+}
+
+/* decode len bytes at data sent in parts pieces. the reason it failed, if
+ * it did, is left in the context. */
+static struct json_object *test_decode(struct test_ctx *test, const void *data, size_t len,
+                                       enum jsonapp_encoding encoding, int parts)
+{
+        struct jsonapp_msg *msg;
+        struct json_object *root;
+        size_t piece = len / parts;
+        int i;
+
+        if (!(msg = jsonapp_msg_new("test", data, piece)))
+                jsonapp_die("insufficient memory for message");
+        for (i = 1; i < parts; i++) {
+                if (jsonapp_msg_append(msg, (const char *)data + i * piece,
+                                       i + 1 < parts ? piece : len - i * piece) != 0)
+                        jsonapp_die("insufficient memory for message");
+        }
+        test->jctx->error[0] = '\0';
+        root = jsonapp_decode(test->jctx, msg, encoding);
+        jsonapp_msg_free(msg);
+        return root;
+}
+
+/* data is rejected as a push in the given encoding, for the reason why */
+static void test_decode_rejects(struct test_ctx *test, const char *what, const void *data,
+                                size_t len, enum jsonapp_encoding encoding, int parts,
+                                const char *why)
+{
+        struct json_object *root;
+
+        root = test_decode(test, data, len, encoding, parts);
+        test_check(!root, "%s decoded", what);
+        test_check(strstr(test->jctx->error, why), "%s: %s", what, test->jctx->error);
+        json_object_put(root);
+        return;
+}
+
+/* a generated config decodes to the tree its json parses to, in both
+ * encodings, and is rejected once it is cut short or sent in parts */
+static void test_decode_config(struct test_ctx *test)
+{
+        static const struct {
+                const char *name;
+                enum jsonapp_encoding encoding;
+        } encodings[] = {
+                { "cbor", JSONAPP_ENCODING_CBOR },
+                { "messagepack", JSONAPP_ENCODING_MSGPACK },
+        };
+        struct jsonapp_msg *msg;
+        struct json_object *json;
+        struct json_object *root;
+        char *expected;
+        char *data;
+        char *bin;
+        size_t len;
+        size_t bin_len;
+        FILE *f;
+        int i;
+
+        data = test_config(1, 8, &len);
+        if (!(json = json_tokener_parse(data)))
+                jsonapp_die("generated config does not parse");
+        expected = strdup(json_object_to_json_string_ext(json, JSON_C_TO_STRING_PLAIN));
+        for (i = 0; i < 2; i++) {
+                bin = NULL;
+                if (!(f = open_memstream(&bin, &bin_len)))
+                        jsonapp_die("insufficient memory for encoded config");
+                test_encode(f, json, encodings[i].encoding == JSONAPP_ENCODING_CBOR);
+                if (fclose(f) != 0)
+                        jsonapp_die("insufficient memory for encoded config");
+
+                if (!(msg = jsonapp_msg_new("test", bin, bin_len)))
+                        jsonapp_die("insufficient memory for message");
+                test_check(jsonapp_msg_encoding(msg) == encodings[i].encoding,
+                           "%s not recognised", encodings[i].name);
+                jsonapp_msg_free(msg);
+
+                root = test_decode(test, bin, bin_len, encodings[i].encoding, 1);
+                test_check(root, "%s: %s", encodings[i].name, test->jctx->error);
+                test_check(!root || strcmp(expected, json_object_to_json_string_ext(root,
+                                           JSON_C_TO_STRING_PLAIN)) == 0,
+                           "%s decoded to another tree", encodings[i].name);
+                json_object_put(root);
+
+                test_decode_rejects(test, encodings[i].name, bin, bin_len - 1,
+                                    encodings[i].encoding, 1, "truncated");
+                test_decode_rejects(test, encodings[i].name, bin, bin_len,
+                                    encodings[i].encoding, 2, "sent in parts");
+                free(bin);
+        }
+        free(expected);
+        json_object_put(json);
+        free(data);
+        return;
+}
+
+/* counts far beyond what the push holds, nesting deeper than json allows
+ * and keys that are not strings are rejected before anything is built
+ * for them */
+static void test_decode_malformed(struct test_ctx *test)
+{
+        static const struct {
+                const char *what;
+                enum jsonapp_encoding encoding;
+                const char *data;
+                size_t len;
+                const char *why;
+        } cases[] = {
+                { "cbor map count", JSONAPP_ENCODING_CBOR,
+                  "\xbb\xff\xff\xff\xff\xff\xff\xff\xff", 9, "truncated map" },
+                { "cbor array count", JSONAPP_ENCODING_CBOR,
+                  "\xa1\x61\x61\x9b\xff\xff\xff\xff\xff\xff\xff\xff", 12,
+                  "truncated array" },
+                { "messagepack map count", JSONAPP_ENCODING_MSGPACK,
+                  "\xdf\xff\xff\xff\xff", 5, "truncated map" },
+                { "messagepack array count", JSONAPP_ENCODING_MSGPACK,
+                  "\x81\xa1\x61\xdd\xff\xff\xff\xff", 8, "truncated array" },
+                { "cbor integer key", JSONAPP_ENCODING_CBOR,
+                  "\xa1\x01\x02", 3, "map key is not a string" },
+                { "messagepack integer key", JSONAPP_ENCODING_MSGPACK,
+                  "\x81\x01\x02", 3, "map key is not a string" },
+        };
+        char deep[3 + JSONAPP_MAX_DEPTH + 1];
+        size_t i;
+        int cbor;
+
+        for (i = 0; i < sizeof cases / sizeof cases[0]; i++)
+                test_decode_rejects(test, cases[i].what, cases[i].data, cases[i].len,
+                                    cases[i].encoding, 1, cases[i].why);
+
+        /* {"a": [[...[null]...]]}, JSONAPP_MAX_DEPTH + 1 levels */
+        for (cbor = 0; cbor < 2; cbor++) {
+                memcpy(deep, cbor ? "\xa1\x61\x61" : "\x81\xa1\x61", 3);
+                memset(deep + 3, cbor ? 0x81 : 0x91, JSONAPP_MAX_DEPTH);
+                deep[sizeof deep - 1] = cbor ? 0xf6 : 0xc0;
+                test_decode_rejects(test, cbor ? "deep cbor" : "deep messagepack", deep,
+                                    sizeof deep, cbor ? JSONAPP_ENCODING_CBOR :
+                                    JSONAPP_ENCODING_MSGPACK, 1, "nesting too deep");
+        }
+        return;
+}
+
+/* data deflated with zlib or, with gzip set, gzip framing */
+static char *test_deflate(const char *data, size_t len, bool gzip, size_t *out_len)
+{
+        z_stream zs;
+        char *out;
+        size_t size;
+
+        memset(&zs, 0, sizeof zs);
+        if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, gzip ? 15 + 16 : 15, 8,
+                         Z_DEFAULT_STRATEGY) != Z_OK)
+                jsonapp_die("unable to set up zlib");
+        size = deflateBound(&zs, len);
+        if (!(out = malloc(size)))
+                jsonapp_die("insufficient memory for deflated config");
+        zs.next_in = (Bytef *)data;
+        zs.avail_in = len;
+        zs.next_out = (Bytef *)out;
+        zs.avail_out = size;
+        if (deflate(&zs, Z_FINISH) != Z_STREAM_END)
+                jsonapp_die("unable to deflate config");
+        *out_len = zs.total_out;
+        deflateEnd(&zs);
+        return out;
+}
+
+/* the packages the backends own, as committed */
+static char *test_committed(struct test_ctx *test)
+{
+        char *wireless = test_read_file(test->confdir, "wireless");
+        char *chilli = test_read_file(test->confdir, "chilli");
+        char *both;
+
+        if (asprintf(&both, "%s\n--\n%s", wireless, chilli) < 0)
+                jsonapp_die("insufficient memory for committed packages");
+        free(wireless);
+        free(chilli);
+        return both;
+}
+
+/* a deflated config applies as the same config sent as json text, in
+ * either framing, also when it is sent in parts and the last one is
+ * empty. a push inflating past -z is rejected without applying it. */
+static void test_compressed(struct test_ctx *test)
+{
+        struct jsonapp_msg *msg;
+        char *expected;
+        char *committed;
+        char *before;
+        char *data;
+        char *zdata;
+        size_t len;
+        size_t zlen;
+        int gzip;
+
+        data = test_config(1, 5, &len);
+        test_check(test_apply(test, 1, 3) == 0, "apply failed: %s", test->jctx->error);
+        test_check(test_push(test, data, len) == 0, "apply failed: %s", test->jctx->error);
+        expected = test_committed(test);
+
+        for (gzip = 0; gzip < 2; gzip++) {
+                zdata = test_deflate(data, len, gzip, &zlen);
+
+                test_check(test_apply(test, 1, 3) == 0, "apply failed: %s", test->jctx->error);
+                test_check(test_push(test, zdata, zlen) == 0, "%s: %s",
+                           gzip ? "gzip" : "zlib", test->jctx->error);
+                committed = test_committed(test);
+                test_check(strcmp(expected, committed) == 0,
+                           "%s applied another config", gzip ? "gzip" : "zlib");
+                free(committed);
+
+                test_check(test_apply(test, 1, 3) == 0, "apply failed: %s", test->jctx->error);
+                if (!(msg = jsonapp_msg_new("test", zdata, zlen / 2)) ||
+                    jsonapp_msg_append(msg, zdata + zlen / 2, zlen - zlen / 2) != 0 ||
+                    jsonapp_msg_append(msg, "", 0) != 0)
+                        jsonapp_die("insufficient memory for message");
+                test_check(jsonapp_process_json(test->jctx, msg) == 0, "%s in parts: %s",
+                           gzip ? "gzip" : "zlib", test->jctx->error);
+                jsonapp_msg_free(msg);
+                committed = test_committed(test);
+                test_check(strcmp(expected, committed) == 0,
+                           "%s in parts applied another config", gzip ? "gzip" : "zlib");
+                free(committed);
+
+                test_check(test_apply(test, 1, 3) == 0, "apply failed: %s", test->jctx->error);
+                before = test_committed(test);
+                test->jctx->max_inflated = len - 1;
+                test_check(test_push(test, zdata, zlen) != 0, "%s inflated past -z",
+                           gzip ? "gzip" : "zlib");
+                test_check(strstr(test->jctx->error, "once inflated"), "%s: %s",
+                           gzip ? "gzip" : "zlib", test->jctx->error);
+                test->jctx->max_inflated = JSONAPP_MAX_INFLATED;
+                committed = test_committed(test);
+                test_check(strcmp(before, committed) == 0,
+                           "%s applied past -z", gzip ? "gzip" : "zlib");
+                free(committed);
+                free(before);
+                free(zdata);
+        }
+        free(expected);
+        free(data);
+        return;
+}
+
+int main(int argc, char **argv)
+{
+        struct test_ctx test;
+
+        memset(&test, 0, sizeof test);
+        bench_gen_scratch_init("jsonapp-test", test.confdir, test.savedir);
+        test_write_file(test.savedir, "wireless", test_delta, 0600);
+        test.jctx = bench_gen_alloc_context(test.confdir, test.savedir, false, 0);
+
+        test_commit_files(&test);
+        test_commit_lock(&test);
+        test_commit_new_delta(&test);
+        test_ifnames_kept(&test);
+        test_decode_config(&test);
+        test_decode_malformed(&test);
+        test_compressed(&test);
+
+        bench_gen_free_context(test.jctx);
+        bench_gen_scratch_exit(test.confdir, test.savedir);
+
+        if (test_failed)
+                fprintf(stderr, "%d checks failed\n", test_failed);
+        return test_failed ? 1 : 0;
+}
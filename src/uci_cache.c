@@ -0,0 +1,903 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include "json-app.h"
+
+/* uci packages stay loaded for the lifetime of the process. a package is
+ * only reloaded when inotify reports activity on its file in the config
+ * directory _and_ the file no longer matches what was loaded (or committed
+ * by us). without inotify every lookup falls back to the stat() check.
+ *
+ * backends never commit themselves. they stage the packages they changed
+ * with jsonapp_uci_stage() and the main module commits everything staged for
+ * a message in one go once every backend succeeded, or throws the changes
+ * away if one of them failed. what the backends changed in a package is
+ * recorded with it and handed to the reload hooks once the package is
+ * written (see reload.c).
+ *
+ * a package is loaded into the uci context of the backend that lists it, or
+ * the main one. backends running side by side look up their packages at the
+ * same time; the entries for listed packages are created at startup, so the
+ * list itself is only changed while a single backend runs. */
+struct jsonapp_uci_index;
+
+struct jsonapp_uci_pkg {
+        struct jsonapp_uci_pkg *next;
+        char *name;
+        struct uci_context *ctx;
+        struct uci_package *pkg;
+        struct stat st;
+        struct stat delta_st;                   /* of the saved delta folded in on load */
+        bool seeded;                            /* st is from the snapshot, not loaded yet */
+        bool stale;
+        bool staged;
+        /* the file as it was before the current commit, for rollback, and
+         * held open with libuci's lock on it until the commit is done */
+        char *pre_image;
+        size_t pre_image_len;
+        bool pre_image_exists;
+        struct stat pre_st;
+        int lock_fd;
+        /* what the current commit writes */
+        char *image;
+        size_t image_len;
+        bool unchanged;                         /* same as the pre-image */
+        bool written;
+        /* what the backends changed for the current message */
+        struct jsonapp_change *changes;
+        struct jsonapp_change **changes_tail;
+        struct jsonapp_uci_index *index;        /* of pkg, see below */
+};
+
+/* the sections of a loaded package by name and by @type[n], so that
+ * applying a diff resolves every section it lists with a hash lookup
+ * instead of a walk over the package. the index is built on first use
+ * after a load and thrown away with the package. sections added while
+ * applying a diff go straight in; removing a section or changing its type
+ * drops the index, to be built again when it is next needed.
+ *
+ * every section has two slots: one by name (pos -1), anonymous sections
+ * under their generated cfgXXXXXX name, and one by type and position among
+ * the sections of that type. */
+struct jsonapp_uci_slot {
+        struct uci_section *s;
+        uint64_t hash;
+        int pos;
+};
+
+struct jsonapp_uci_type {
+        const char *type;                       /* of the first section of the type */
+        int count;
+};
+
+struct jsonapp_uci_index {
+        struct jsonapp_uci_slot *slots;
+        unsigned int size;                      /* power of two */
+        unsigned int used;
+        struct jsonapp_uci_type *types;
+        int nr_types;
+};
+
+static void jsonapp_uci_stat(struct jsonapp_parse_ctx *jctx, const char *name,
+                             struct stat *st)
+{
+        char path[PATH_MAX];
+
+        snprintf(path, sizeof path, "%s/%s", jctx->uci_ctx->confdir, name);
+        if (stat(path, st) != 0)
+                memset(st, 0, sizeof *st);
+        return;
+}
+
+/* the delta other uci users saved for name, folded in by uci_load() */
+static void jsonapp_uci_stat_delta(struct jsonapp_uci_pkg *entry, struct stat *st)
+{
+        char path[PATH_MAX];
+
+        memset(st, 0, sizeof *st);
+        if (!entry->ctx->savedir)
+                return;
+        snprintf(path, sizeof path, "%s/%s", entry->ctx->savedir, entry->name);
+        if (stat(path, st) != 0)
+                memset(st, 0, sizeof *st);
+        return;
+}
+
+static bool jsonapp_uci_stat_changed(const struct stat *a, const struct stat *b)
+{
+        return a->st_ino != b->st_ino ||
+               a->st_size != b->st_size ||
+               a->st_mtim.tv_sec != b->st_mtim.tv_sec ||
+               a->st_mtim.tv_nsec != b->st_mtim.tv_nsec;
+}
+
+static struct jsonapp_uci_pkg *jsonapp_uci_find(struct jsonapp_parse_ctx *jctx,
+                                                const char *name)
+{
+        struct jsonapp_uci_pkg *entry;
+
+        for (entry = jctx->packages; entry; entry = entry->next) {
+                if (strcmp(entry->name, name) == 0)
+                        return entry;
+        }
+        return NULL;
+}
+
+static uint64_t jsonapp_uci_hash_name(const char *name)
+{
+        return jsonapp_fnv1a(JSONAPP_FNV1A_INIT, name, strlen(name));
+}
+
+static uint64_t jsonapp_uci_hash_anon(const char *type, int pos)
+{
+        uint64_t hash = jsonapp_fnv1a(JSONAPP_FNV1A_INIT, "@", 1);
+
+        hash = jsonapp_fnv1a(hash, type, strlen(type));
+        return jsonapp_fnv1a(hash, &pos, sizeof pos);
+}
+
+static void jsonapp_uci_index_free(struct jsonapp_uci_pkg *entry)
+{
+        if (!entry->index)
+                return;
+        free(entry->index->slots);
+        free(entry->index->types);
+        free(entry->index);
+        entry->index = NULL;
+        return;
+}
+
+static void jsonapp_uci_index_put(struct jsonapp_uci_index *index, struct uci_section *s,
+                                  uint64_t hash, int pos)
+{
+        unsigned int i = hash & (index->size - 1);
+
+        while (index->slots[i].s)
+                i = (i + 1) & (index->size - 1);
+        index->slots[i].s = s;
+        index->slots[i].hash = hash;
+        index->slots[i].pos = pos;
+        index->used++;
+        return;
+}
+
+static void jsonapp_uci_index_insert(struct jsonapp_uci_index *index, struct uci_section *s)
+{
+        struct jsonapp_uci_type *types;
+        int i;
+
+        for (i = 0; i < index->nr_types; i++) {
+                if (strcmp(index->types[i].type, s->type) == 0)
+                        break;
+        }
+        if (i == index->nr_types) {
+                if (!(types = realloc(index->types, (i + 1) * sizeof *types)))
+                        jsonapp_die("insufficient memory for uci section index");
+                index->types = types;
+                index->types[i].type = s->type;
+                index->types[i].count = 0;
+                index->nr_types++;
+        }
+        jsonapp_uci_index_put(index, s, jsonapp_uci_hash_name(s->e.name), -1);
+        jsonapp_uci_index_put(index, s, jsonapp_uci_hash_anon(s->type, index->types[i].count),
+                              index->types[i].count);
+        index->types[i].count++;
+        return;
+}
+
+/* kept at most a quarter full, with two slots per section */
+static struct jsonapp_uci_index *jsonapp_uci_index_build(struct jsonapp_uci_pkg *entry)
+{
+        struct jsonapp_uci_index *index;
+        struct uci_element *e;
+        unsigned int n = 0;
+
+        uci_foreach_element(&entry->pkg->sections, e)
+                n++;
+        if (!(index = calloc(1, sizeof *index)))
+                jsonapp_die("insufficient memory for uci section index");
+        index->size = 16;
+        while (index->size < 8 * (n + 1))
+                index->size *= 2;
+        if (!(index->slots = calloc(index->size, sizeof *index->slots)))
+                jsonapp_die("insufficient memory for uci section index");
+        uci_foreach_element(&entry->pkg->sections, e)
+                jsonapp_uci_index_insert(index, uci_to_section(e));
+        entry->index = index;
+        return index;
+}
+
+/* the index of a package from the cache, or NULL for any other package */
+static struct jsonapp_uci_index *jsonapp_uci_index(struct jsonapp_parse_ctx *jctx,
+                                                   struct uci_package *pkg)
+{
+        struct jsonapp_uci_pkg *entry;
+
+        if (!(entry = jsonapp_uci_find(jctx, pkg->e.name)) || entry->pkg != pkg)
+                return NULL;
+        return entry->index ? entry->index : jsonapp_uci_index_build(entry);
+}
+
+/* the section called name, as uci_lookup_section() */
+struct uci_section *jsonapp_uci_lookup_section(struct jsonapp_parse_ctx *jctx,
+                                               struct uci_package *pkg, const char *name)
+{
+        struct jsonapp_uci_index *index;
+        struct jsonapp_uci_slot *slot;
+        uint64_t hash;
+        unsigned int i;
+
+        if (!(index = jsonapp_uci_index(jctx, pkg)))
+                return uci_lookup_section(pkg->ctx, pkg, name);
+        hash = jsonapp_uci_hash_name(name);
+        for (i = hash & (index->size - 1); (slot = &index->slots[i])->s;
+             i = (i + 1) & (index->size - 1)) {
+                if (slot->hash == hash && slot->pos == -1 && strcmp(slot->s->e.name, name) == 0)
+                        return slot->s;
+        }
+        return NULL;
+}
+
+/* the section uci calls @type[pos], named or not */
+struct uci_section *jsonapp_uci_lookup_anon(struct jsonapp_parse_ctx *jctx,
+                                            struct uci_package *pkg, const char *type, int pos)
+{
+        struct jsonapp_uci_index *index;
+        struct jsonapp_uci_slot *slot;
+        struct uci_element *e;
+        uint64_t hash;
+        unsigned int i;
+
+        if (!(index = jsonapp_uci_index(jctx, pkg))) {
+                uci_foreach_element(&pkg->sections, e) {
+                        if (strcmp(uci_to_section(e)->type, type) == 0 && pos-- == 0)
+                                return uci_to_section(e);
+                }
+                return NULL;
+        }
+        hash = jsonapp_uci_hash_anon(type, pos);
+        for (i = hash & (index->size - 1); (slot = &index->slots[i])->s;
+             i = (i + 1) & (index->size - 1)) {
+                if (slot->hash == hash && slot->pos == pos && strcmp(slot->s->type, type) == 0)
+                        return slot->s;
+        }
+        return NULL;
+}
+
+/* s was just added to the end of pkg */
+void jsonapp_uci_section_added(struct jsonapp_parse_ctx *jctx, struct uci_package *pkg,
+                               struct uci_section *s)
+{
+        struct jsonapp_uci_pkg *entry;
+
+        if (!(entry = jsonapp_uci_find(jctx, pkg->e.name)) || entry->pkg != pkg || !entry->index)
+                return;
+        if (4 * (entry->index->used + 2) > entry->index->size)
+                jsonapp_uci_index_free(entry);
+        else
+                jsonapp_uci_index_insert(entry->index, s);
+        return;
+}
+
+/* a section of pkg was removed or changed its type */
+void jsonapp_uci_sections_changed(struct jsonapp_parse_ctx *jctx, struct uci_package *pkg)
+{
+        struct jsonapp_uci_pkg *entry;
+
+        if ((entry = jsonapp_uci_find(jctx, pkg->e.name)) && entry->pkg == pkg)
+                jsonapp_uci_index_free(entry);
+        return;
+}
+
+static int jsonapp_uci_load(struct jsonapp_parse_ctx *jctx,
+                            struct jsonapp_uci_pkg *entry)
+{
+        jsonapp_uci_index_free(entry);
+        if (entry->pkg) {
+                uci_unload(entry->ctx, entry->pkg);
+                entry->pkg = NULL;
+        }
+
+        jsonapp_uci_stat(jctx, entry->name, &entry->st);
+        jsonapp_uci_stat_delta(entry, &entry->delta_st);
+        if (uci_load(entry->ctx, entry->name, &entry->pkg) != UCI_OK) {
+                entry->pkg = NULL;
+                return -1;
+        }
+        /* packages are written by jsonapp_uci_txn_commit(), never with
+         * uci_save(), so libuci need not keep a delta of every change */
+        entry->pkg->has_delta = false;
+        entry->stale = false;
+        return 0;
+}
+
+void jsonapp_uci_cache_init(struct jsonapp_parse_ctx *jctx)
+{
+        const uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM |
+                              IN_CREATE | IN_DELETE;
+
+        jctx->packages = NULL;
+        /* a gateway serves more devices than there are inotify instances */
+        if (jctx->parent) {
+                jctx->inotify_fd = -1;
+                return;
+        }
+        jctx->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (jctx->inotify_fd == -1) {
+                perror("inotify");
+                return;
+        }
+
+        if (inotify_add_watch(jctx->inotify_fd, jctx->uci_ctx->confdir, mask) == -1) {
+                perror("inotify");
+                close(jctx->inotify_fd);
+                jctx->inotify_fd = -1;
+        }
+        return;
+}
+
+void jsonapp_uci_cache_exit(struct jsonapp_parse_ctx *jctx)
+{
+        struct jsonapp_uci_pkg *entry;
+
+        while ((entry = jctx->packages)) {
+                jctx->packages = entry->next;
+                jsonapp_uci_index_free(entry);
+                if (entry->pkg)
+                        uci_unload(entry->ctx, entry->pkg);
+                free(entry->name);
+                free(entry->pre_image);
+                free(entry->image);
+                jsonapp_change_free(entry->changes);
+                free(entry);
+        }
+
+        if (jctx->inotify_fd != -1) {
+                close(jctx->inotify_fd);
+                jctx->inotify_fd = -1;
+        }
+        return;
+}
+
+/* drain pending inotify events and mark the packages they refer to */
+void jsonapp_uci_cache_poll(struct jsonapp_parse_ctx *jctx)
+{
+        char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        const struct inotify_event *ev;
+        struct jsonapp_uci_pkg *entry;
+        ssize_t len;
+        char *p;
+
+        if (jctx->inotify_fd == -1)
+                return;
+
+        while ((len = read(jctx->inotify_fd, buf, sizeof buf)) > 0) {
+                for (p = buf; p < buf + len; p += sizeof *ev + ev->len) {
+                        ev = (const struct inotify_event *)p;
+                        if (ev->mask & IN_Q_OVERFLOW) {
+                                for (entry = jctx->packages; entry; entry = entry->next)
+                                        entry->stale = true;
+                                continue;
+                        }
+                        if (!ev->len)
+                                continue;
+                        if ((entry = jsonapp_uci_find(jctx, ev->name)))
+                                entry->stale = true;
+                }
+        }
+        return;
+}
+
+/* throw away in-memory changes that never made it to disk, e.g. after a
+ * backend failed halfway through a message. every package is reloaded on
+ * its next use. */
+void jsonapp_uci_cache_invalidate(struct jsonapp_parse_ctx *jctx)
+{
+        struct jsonapp_uci_pkg *entry;
+
+        for (entry = jctx->packages; entry; entry = entry->next) {
+                memset(&entry->st, 0, sizeof entry->st);
+                entry->seeded = false;
+                entry->stale = true;
+        }
+        return;
+}
+
+static struct jsonapp_uci_pkg *jsonapp_uci_add(struct jsonapp_parse_ctx *jctx,
+                                               const char *name, struct uci_context *ctx)
+{
+        struct jsonapp_uci_pkg *entry;
+
+        if (!(entry = calloc(1, sizeof *entry)) || !(entry->name = strdup(name))) {
+                jsonapp_die("insufficient memory for uci package cache");
+        }
+        entry->ctx = ctx;
+        entry->lock_fd = -1;
+        entry->changes_tail = &entry->changes;
+        entry->next = jctx->packages;
+        jctx->packages = entry;
+        return entry;
+}
+
+/* whether the packages in names, ended by NULL, still match their files,
+ * i.e. are as the last message left them. a package not loaded since
+ * startup is compared with what the snapshot recorded for it. */
+bool jsonapp_uci_cache_current(struct jsonapp_parse_ctx *jctx, const char *const *names)
+{
+        struct jsonapp_uci_pkg *entry;
+        struct stat st;
+
+        for (; *names; names++) {
+                if (!(entry = jsonapp_uci_find(jctx, *names)))
+                        return false;
+                if (!entry->pkg && !entry->seeded)
+                        return false;
+                if (entry->pkg && !entry->stale && jctx->inotify_fd != -1)
+                        continue;
+                jsonapp_uci_stat(jctx, entry->name, &st);
+                if (jsonapp_uci_stat_changed(&st, &entry->st))
+                        return false;
+        }
+        return true;
+}
+
+/* what the snapshot says the file of name looked like after the last apply.
+ * a package a backend already loaded at startup is compared with the file
+ * again on its next use, so an edit made while we were down is noticed. */
+void jsonapp_uci_cache_seed(struct jsonapp_parse_ctx *jctx, const char *name,
+                            const struct stat *st)
+{
+        struct jsonapp_uci_pkg *entry;
+
+        if (!(entry = jsonapp_uci_find(jctx, name)))
+                entry = jsonapp_uci_add(jctx, name, jctx->uci_ctx);
+        entry->st = *st;
+        if (entry->pkg)
+                entry->stale = true;
+        else
+                entry->seeded = true;
+        return;
+}
+
+/* write a snapshot line for every package whose file is known */
+void jsonapp_uci_cache_save_stamps(struct jsonapp_parse_ctx *jctx, FILE *f)
+{
+        struct jsonapp_uci_pkg *entry;
+
+        for (entry = jctx->packages; entry; entry = entry->next) {
+                if (!entry->pkg && !entry->seeded)
+                        continue;
+                fprintf(f, "package %s %llu %lld %lld %ld\n", entry->name,
+                        (unsigned long long)entry->st.st_ino, (long long)entry->st.st_size,
+                        (long long)entry->st.st_mtim.tv_sec, entry->st.st_mtim.tv_nsec);
+        }
+        return;
+}
+
+/* load name into ctx instead of the main uci context. called at startup for
+ * the packages a backend lists; if two backends list the same package the
+ * first one's context is used, which is fine as they never run at once. */
+void jsonapp_uci_cache_claim(struct jsonapp_parse_ctx *jctx, const char *name,
+                             struct uci_context *ctx)
+{
+        if (!jsonapp_uci_find(jctx, name))
+                jsonapp_uci_add(jctx, name, ctx);
+        return;
+}
+
+struct uci_package *jsonapp_uci_package(struct jsonapp_parse_ctx *jctx, const char *name)
+{
+        struct jsonapp_uci_pkg *entry;
+        struct stat st;
+        uint64_t start = jsonapp_now_ns();
+
+        if (!(entry = jsonapp_uci_find(jctx, name))) {
+                entry = jsonapp_uci_add(jctx, name, jctx->uci_ctx);
+        } else if (entry->pkg && (entry->stale || jctx->inotify_fd == -1)) {
+                jsonapp_uci_stat(jctx, name, &st);
+                entry->stale = jsonapp_uci_stat_changed(&st, &entry->st);
+        }
+
+        if (!entry->pkg || entry->stale) {
+                if (entry->pkg)
+                        fprintf(stderr, "%s changed on disk. reloading it...\n", name);
+                if (jsonapp_uci_load(jctx, entry) != 0) {
+                        fprintf(stderr, "error loading %s/%s\n", jctx->uci_ctx->confdir, name);
+                        jsonapp_stage_add(jctx, JSONAPP_STAGE_INIT, start);
+                        return NULL;
+                }
+        }
+        jsonapp_stage_add(jctx, JSONAPP_STAGE_INIT, start);
+        return entry->pkg;
+}
+
+/* reload the packages that changed on disk since they were loaded, so the
+ * next message finds them current. called by the apply worker between
+ * messages once the config directory has settled. */
+void jsonapp_uci_cache_refresh(struct jsonapp_parse_ctx *jctx)
+{
+        struct jsonapp_uci_pkg *entry;
+
+        jsonapp_uci_cache_poll(jctx);
+        for (entry = jctx->packages; entry; entry = entry->next) {
+                if (entry->pkg && entry->stale)
+                        jsonapp_uci_package(jctx, entry->name);
+        }
+        return;
+}
+
+/* note a change made to a cached package for the reload hooks. nothing is
+ * recorded unless a backend has a reload() hook. */
+void jsonapp_uci_record_change(struct jsonapp_parse_ctx *jctx, struct uci_package *pkg,
+                               const char *section, const char *type, const char *option,
+                               const char *old, const char *value)
+{
+        struct jsonapp_uci_pkg *entry;
+        struct jsonapp_change *change;
+
+        if (!jctx->reload || !(entry = jsonapp_uci_find(jctx, pkg->e.name)) || entry->pkg != pkg)
+                return;
+        change = jsonapp_change_new(entry->name, section, type, option, old, value);
+        *entry->changes_tail = change;
+        entry->changes_tail = &change->next;
+        return;
+}
+
+static void jsonapp_uci_drop_changes(struct jsonapp_uci_pkg *entry)
+{
+        jsonapp_change_free(entry->changes);
+        entry->changes = NULL;
+        entry->changes_tail = &entry->changes;
+        return;
+}
+
+/* add a cached package with uncommitted changes to the current message's
+ * transaction */
+void jsonapp_uci_stage(struct jsonapp_parse_ctx *jctx, struct uci_package *pkg)
+{
+        struct jsonapp_uci_pkg *entry;
+
+        if (!(entry = jsonapp_uci_find(jctx, pkg->e.name)) || entry->pkg != pkg)
+                jsonapp_die("%s is not a cached uci package", pkg->e.name);
+        entry->staged = true;
+        return;
+}
+
+static void jsonapp_uci_unlock(struct jsonapp_uci_pkg *entry)
+{
+        if (entry->lock_fd != -1) {
+                close(entry->lock_fd);
+                entry->lock_fd = -1;
+        }
+        return;
+}
+
+/* take the lock uci commit takes on the file, so that a commit made by
+ * another uci user at the same time goes before or after ours, and read
+ * the file as it is under the lock */
+static int jsonapp_uci_read_pre_image(struct jsonapp_parse_ctx *jctx,
+                                      struct jsonapp_uci_pkg *entry)
+{
+        char path[PATH_MAX];
+        size_t len = 0;
+        ssize_t n;
+        int fd;
+
+        free(entry->pre_image);
+        entry->pre_image = NULL;
+        entry->pre_image_len = 0;
+        entry->pre_image_exists = false;
+
+        snprintf(path, sizeof path, "%s/%s", jctx->uci_ctx->confdir, entry->name);
+        if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+                return errno == ENOENT ? 0 : -1;
+        entry->lock_fd = fd;
+        while (flock(fd, LOCK_EX) != 0) {
+                if (errno != EINTR)
+                        return -1;
+        }
+        if (fstat(fd, &entry->pre_st) != 0 ||
+            !(entry->pre_image = malloc(entry->pre_st.st_size ? entry->pre_st.st_size : 1)))
+                return -1;
+        while (len < (size_t)entry->pre_st.st_size) {
+                if ((n = read(fd, entry->pre_image + len, entry->pre_st.st_size - len)) <= 0) {
+                        if (n == -1 && errno == EINTR)
+                                continue;
+                        return -1;
+                }
+                len += n;
+        }
+        entry->pre_image_len = len;
+        entry->pre_image_exists = true;
+        return 0;
+}
+
+/* a new file at path for the text of entry, with the mode and owner of the
+ * file it replaces; a package that had no file gets one only root can read,
+ * as jsonapp_has_config() creates them */
+static FILE *jsonapp_uci_create(const char *path, const struct jsonapp_uci_pkg *entry)
+{
+        FILE *f;
+        int fd;
+
+        unlink(path);
+        if ((fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR)) == -1)
+                return NULL;
+        if ((entry->pre_image_exists &&
+             (fchmod(fd, entry->pre_st.st_mode & 07777) != 0 ||
+              fchown(fd, entry->pre_st.st_uid, entry->pre_st.st_gid) != 0)) ||
+            !(f = fdopen(fd, "w"))) {
+                close(fd);
+                unlink(path);
+                return NULL;
+        }
+        return f;
+}
+
+/* put the file back the way it was before the transaction, replacing it in
+ * one rename so it is never seen half written */
+static int jsonapp_uci_restore_pre_image(struct jsonapp_parse_ctx *jctx,
+                                         struct jsonapp_uci_pkg *entry)
+{
+        char path[PATH_MAX];
+        char tmp[PATH_MAX + 16];
+        FILE *f;
+        int err = 0;
+
+        snprintf(path, sizeof path, "%s/%s", jctx->uci_ctx->confdir, entry->name);
+        if (!entry->pre_image_exists)
+                return unlink(path) == 0 || errno == ENOENT ? 0 : -1;
+
+        snprintf(tmp, sizeof tmp, "%s/.%s.rollback", jctx->uci_ctx->confdir, entry->name);
+        if (!(f = jsonapp_uci_create(tmp, entry)))
+                return -1;
+        if (fwrite(entry->pre_image, 1, entry->pre_image_len, f) != entry->pre_image_len)
+                err = -1;
+        if (fflush(f) != 0 || fsync(fileno(f)) != 0)
+                err = -1;
+        if (fclose(f) != 0)
+                err = -1;
+        if (!err && rename(tmp, path) != 0)
+                err = -1;
+        if (err)
+                unlink(tmp);
+        return err;
+}
+
+/* throw away everything the backends changed for the current message */
+void jsonapp_uci_txn_abort(struct jsonapp_parse_ctx *jctx)
+{
+        struct jsonapp_uci_pkg *entry;
+
+        for (entry = jctx->packages; entry; entry = entry->next) {
+                entry->staged = false;
+                jsonapp_uci_unlock(entry);
+                jsonapp_uci_drop_changes(entry);
+        }
+        jsonapp_uci_cache_invalidate(jctx);
+        return;
+}
+
+/* the text of a staged package as uci would write it, built in memory so
+ * it can be compared with the file before anything is written */
+static int jsonapp_uci_export(struct jsonapp_uci_pkg *entry)
+{
+        FILE *f;
+        int err = 0;
+
+        free(entry->image);
+        entry->image = NULL;
+        entry->image_len = 0;
+        if (!(f = open_memstream(&entry->image, &entry->image_len)))
+                return -1;
+        if (uci_export(entry->ctx, f, entry->pkg, false) != UCI_OK)
+                err = -1;
+        if (fclose(f) != 0)
+                err = -1;
+        return err;
+}
+
+static void jsonapp_uci_new_path(struct jsonapp_parse_ctx *jctx, struct jsonapp_uci_pkg *entry,
+                                 char *path, size_t len)
+{
+        snprintf(path, len, "%s/.%s.new", jctx->uci_ctx->confdir, entry->name);
+        return;
+}
+
+/* write the new text next to the file, not synced yet */
+static int jsonapp_uci_write_new(struct jsonapp_parse_ctx *jctx, struct jsonapp_uci_pkg *entry)
+{
+        char tmp[PATH_MAX + 16];
+        FILE *f;
+        int err = 0;
+
+        jsonapp_uci_new_path(jctx, entry, tmp, sizeof tmp);
+        if (!(f = jsonapp_uci_create(tmp, entry)))
+                return -1;
+        if (fwrite(entry->image, 1, entry->image_len, f) != entry->image_len)
+                err = -1;
+        if (fclose(f) != 0)
+                err = -1;
+        return err;
+}
+
+/* the delta other uci users saved for a package we just wrote was part of
+ * what we wrote, as uci_load() folded it in; empty it as uci commit does,
+ * so it is not applied again on top of the new file. a delta that changed
+ * since the package was loaded holds changes we did not write: it is left
+ * for its owner and -1 returned, so the package is loaded again with it. */
+static int jsonapp_uci_flush_delta(struct jsonapp_uci_pkg *entry)
+{
+        char path[PATH_MAX];
+        struct stat st;
+        int err = 0;
+        int fd;
+
+        if (!entry->ctx->savedir)
+                return 0;
+        snprintf(path, sizeof path, "%s/%s", entry->ctx->savedir, entry->name);
+        if ((fd = open(path, O_RDWR | O_CLOEXEC)) == -1)
+                return 0;
+        while (flock(fd, LOCK_EX) != 0) {
+                if (errno != EINTR) {
+                        close(fd);
+                        return -1;
+                }
+        }
+        if (fstat(fd, &st) == 0 && st.st_size) {
+                if (jsonapp_uci_stat_changed(&st, &entry->delta_st)) {
+                        fprintf(stderr, "%s changed while %s was applied. keeping it...\n",
+                                path, entry->name);
+                        err = -1;
+                } else if (ftruncate(fd, 0) != 0) {
+                        perror(path);
+                }
+        }
+        close(fd);
+        return err;
+}
+
+static void jsonapp_uci_txn_end(struct jsonapp_uci_pkg *entry)
+{
+        entry->staged = false;
+        jsonapp_uci_unlock(entry);
+        entry->written = false;
+        free(entry->pre_image);
+        entry->pre_image = NULL;
+        free(entry->image);
+        entry->image = NULL;
+        jsonapp_uci_drop_changes(entry);
+        return;
+}
+
+/* commit every staged package.
+ *
+ * libuci's save and commit would write a delta file per package and then
+ * the whole package for every message. instead every staged package is
+ * exported to memory first, and a package whose text is byte for byte what
+ * is on disk already is not written at all. the others go to a temporary
+ * file each; once all of them are written a single syncfs() puts them on
+ * flash and they are renamed over the old files, so a crash leaves every
+ * package either old or new.
+ *
+ * if a write or rename fails, the packages renamed before it are restored
+ * from their pre-images and the rest are discarded, so the config
+ * directory ends up exactly as it was.
+ *
+ * every staged file is locked the way uci commit locks it from before it
+ * is read until it is replaced, and the delta other uci users saved for a
+ * written package is emptied, as uci commit would. the packages stay
+ * loaded: what was written is what is in memory, so only the stamp of
+ * every written file is taken again, so that the inotify events caused by
+ * our own writes do not trigger a reload. the changes to the packages
+ * that were written go to the reload hooks.
+ *
+ * returns the number of packages written or -1 after a rollback. */
+int jsonapp_uci_txn_commit(struct jsonapp_parse_ctx *jctx)
+{
+        struct jsonapp_uci_pkg *failed = NULL;
+        struct jsonapp_uci_pkg *entry;
+        struct jsonapp_change *changes = NULL;
+        struct jsonapp_change **tail = &changes;
+        char path[PATH_MAX];
+        char tmp[PATH_MAX + 16];
+        uint64_t start;
+        int committed = 0;
+        int fd;
+
+        for (entry = jctx->packages; entry; entry = entry->next) {
+                if (entry->staged && jsonapp_uci_read_pre_image(jctx, entry) != 0) {
+                        snprintf(jctx->error, sizeof jctx->error,
+                                 "unable to read %s before commit", entry->name);
+                        jsonapp_uci_txn_abort(jctx);
+                        return -1;
+                }
+        }
+
+        start = jsonapp_now_ns();
+        for (entry = jctx->packages; entry && !failed; entry = entry->next) {
+                if (!entry->staged)
+                        continue;
+                if (jsonapp_uci_export(entry) != 0) {
+                        failed = entry;
+                        break;
+                }
+                entry->unchanged = entry->pre_image_exists &&
+                                   entry->image_len == entry->pre_image_len &&
+                                   memcmp(entry->image, entry->pre_image, entry->image_len) == 0;
+                if (!entry->unchanged && jsonapp_uci_write_new(jctx, entry) != 0)
+                        failed = entry;
+                else if (!entry->unchanged)
+                        committed++;
+        }
+        jsonapp_stage_add(jctx, JSONAPP_STAGE_SAVE, start);
+
+        start = jsonapp_now_ns();
+        if (!failed && committed) {
+                if ((fd = open(jctx->uci_ctx->confdir, O_RDONLY | O_DIRECTORY)) == -1 ||
+                    syncfs(fd) != 0)
+                        failed = jctx->packages;
+                if (fd != -1)
+                        close(fd);
+        }
+        for (entry = jctx->packages; entry && !failed; entry = entry->next) {
+                if (!entry->staged || entry->unchanged)
+                        continue;
+                snprintf(path, sizeof path, "%s/%s", jctx->uci_ctx->confdir, entry->name);
+                jsonapp_uci_new_path(jctx, entry, tmp, sizeof tmp);
+                if (rename(tmp, path) != 0) {
+                        failed = entry;
+                        break;
+                }
+                entry->written = true;
+                jctx->written_bytes += entry->image_len;
+        }
+        jsonapp_stage_add(jctx, JSONAPP_STAGE_COMMIT, start);
+
+        if (!failed) {
+                start = jsonapp_now_ns();
+                for (entry = jctx->packages; entry; entry = entry->next) {
+                        if (entry->written) {
+                                if (jsonapp_uci_flush_delta(entry) == 0) {
+                                        jsonapp_uci_stat(jctx, entry->name, &entry->st);
+                                } else {
+                                        memset(&entry->st, 0, sizeof entry->st);
+                                        entry->stale = true;
+                                }
+                        }
+                        if (entry->written && entry->changes) {
+                                *tail = entry->changes;
+                                tail = entry->changes_tail;
+                                entry->changes = NULL;
+                                entry->changes_tail = &entry->changes;
+                        }
+                        jsonapp_uci_txn_end(entry);
+                }
+                jsonapp_stage_add(jctx, JSONAPP_STAGE_COMMIT, start);
+                jsonapp_reload_push(jctx, changes);
+                return committed;
+        }
+
+        fprintf(stderr, "error committing %s. rolling back...\n", failed->name);
+        snprintf(jctx->error, sizeof jctx->error, "commit of %s failed", failed->name);
+        for (entry = jctx->packages; entry; entry = entry->next) {
+                if (!entry->staged)
+                        continue;
+                jsonapp_uci_new_path(jctx, entry, tmp, sizeof tmp);
+                unlink(tmp);
+                if (entry->written && jsonapp_uci_restore_pre_image(jctx, entry) != 0) {
+                        fprintf(stderr, "error restoring %s/%s\n",
+                                jctx->uci_ctx->confdir, entry->name);
+                }
+                jsonapp_uci_txn_end(entry);
+        }
+        jsonapp_uci_txn_abort(jctx);
+        return -1;
+}
@@ -0,0 +1,340 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "json-app.h"
+
+/* desired state of a uci package.
+ *
+ * backends describe the sections and options a message should produce
+ * instead of writing them directly. jsonapp_diff_apply() then compares that
+ * description with the loaded package and only touches what differs, so an
+ * identical push results in no uci changes at all and no commit. every
+ * change made is recorded with the package for the reload hooks.
+ *
+ * a diff lives in the arena of the backend that builds it and goes away
+ * with the message; it is never freed on its own. */
+struct jsonapp_diff_opt {
+        struct jsonapp_diff_opt *next;
+        const char *name;
+        const char *value;
+};
+
+struct jsonapp_diff_sect {
+        struct jsonapp_diff_sect *next;
+        struct jsonapp_arena *arena;
+        const char *name;       /* NULL for anonymous sections */
+        const char *type;
+        int index;              /* @type[index] for anonymous sections */
+        bool exclusive;         /* delete options that are not listed */
+        struct uci_section *s;  /* resolved while applying */
+        struct jsonapp_diff_opt *options;
+        struct jsonapp_diff_opt **tail;
+};
+
+struct jsonapp_diff {
+        struct jsonapp_arena *arena;
+        const char *managed_type;       /* delete unlisted sections of this type */
+        struct jsonapp_diff_sect *sections;
+        struct jsonapp_diff_sect **tail;
+        int nr_sections;
+};
+
+/* the uci sections the diff resolved to, for telling which sections of
+ * the managed type it does not list. open addressing on the pointer. */
+struct jsonapp_diff_claims {
+        struct uci_section **slots;
+        unsigned int size;      /* power of two */
+};
+
+struct jsonapp_diff *jsonapp_diff_new(struct jsonapp_arena *arena, const char *managed_type)
+{
+        struct jsonapp_diff *diff = jsonapp_arena_alloc(arena, sizeof *diff);
+
+        diff->arena = arena;
+        if (managed_type)
+                diff->managed_type = jsonapp_arena_strdup(arena, managed_type);
+        diff->tail = &diff->sections;
+        return diff;
+}
+
+/* an anonymous section is only added once; asking for it again returns the
+ * same one. named sections are unique already (validation sees to that). */
+static struct jsonapp_diff_sect *jsonapp_diff_add_section(struct jsonapp_diff *diff,
+                                                          const char *name,
+                                                          const char *type,
+                                                          int index)
+{
+        struct jsonapp_diff_sect *sect;
+
+        for (sect = diff->sections; !name && sect; sect = sect->next) {
+                if (!sect->name && sect->index == index && strcmp(sect->type, type) == 0)
+                        return sect;
+        }
+
+        sect = jsonapp_arena_alloc(diff->arena, sizeof *sect);
+        sect->arena = diff->arena;
+        sect->index = index;
+        if (name)
+                sect->name = jsonapp_arena_strdup(diff->arena, name);
+        sect->type = jsonapp_arena_strdup(diff->arena, type);
+        sect->tail = &sect->options;
+        *diff->tail = sect;
+        diff->tail = &sect->next;
+        diff->nr_sections++;
+        return sect;
+}
+
+/* a named section fully owned by the caller: options that are not listed
+ * are removed from it */
+struct jsonapp_diff_sect *jsonapp_diff_section(struct jsonapp_diff *diff,
+                                               const char *name, const char *type)
+{
+        struct jsonapp_diff_sect *sect = jsonapp_diff_add_section(diff, name, type, 0);
+
+        sect->exclusive = true;
+        return sect;
+}
+
+/* the index'th anonymous section of the given type (@type[index]). only the
+ * listed options are managed, everything else in it is left alone. */
+struct jsonapp_diff_sect *jsonapp_diff_anon_section(struct jsonapp_diff *diff,
+                                                    const char *type, int index)
+{
+        return jsonapp_diff_add_section(diff, NULL, type, index);
+}
+
+void jsonapp_diff_option(struct jsonapp_diff_sect *sect, const char *option,
+                         const char *value)
+{
+        struct jsonapp_diff_opt *opt;
+
+        for (opt = sect->options; opt; opt = opt->next) {
+                if (strcmp(opt->name, option) == 0) {
+                        opt->value = jsonapp_arena_strdup(sect->arena, value);
+                        return;
+                }
+        }
+
+        opt = jsonapp_arena_alloc(sect->arena, sizeof *opt);
+        opt->name = jsonapp_arena_strdup(sect->arena, option);
+        opt->value = jsonapp_arena_strdup(sect->arena, value);
+        *sect->tail = opt;
+        sect->tail = &opt->next;
+        return;
+}
+
+static void jsonapp_diff_ptr(struct uci_ptr *ptr, struct uci_package *pkg,
+                             struct uci_section *s, struct uci_option *o,
+                             const char *option, const char *value)
+{
+        memset(ptr, 0, sizeof *ptr);
+        ptr->p = pkg;
+        ptr->s = s;
+        ptr->o = o;
+        ptr->package = pkg->e.name;
+        ptr->section = s->e.name;
+        ptr->option = option;
+        ptr->value = value;
+        ptr->last = o ? &o->e : &s->e;
+        ptr->flags = UCI_LOOKUP_DONE;
+        if (!option || o)
+                ptr->flags |= UCI_LOOKUP_COMPLETE;
+        return;
+}
+
+static unsigned int jsonapp_diff_claim_slot(struct jsonapp_diff_claims *claims,
+                                            struct uci_section *s)
+{
+        uint64_t hash = jsonapp_fnv1a(JSONAPP_FNV1A_INIT, &s, sizeof s);
+        unsigned int i = hash & (claims->size - 1);
+
+        while (claims->slots[i] && claims->slots[i] != s)
+                i = (i + 1) & (claims->size - 1);
+        return i;
+}
+
+static void jsonapp_diff_claims_init(struct jsonapp_diff_claims *claims,
+                                     struct jsonapp_diff *diff)
+{
+        struct jsonapp_diff_sect *sect;
+
+        claims->size = 16;
+        while (claims->size < 2 * diff->nr_sections)
+                claims->size *= 2;
+        claims->slots = jsonapp_arena_alloc(diff->arena, claims->size * sizeof *claims->slots);
+        for (sect = diff->sections; sect; sect = sect->next)
+                claims->slots[jsonapp_diff_claim_slot(claims, sect->s)] = sect->s;
+        return;
+}
+
+static bool jsonapp_diff_is_claimed(struct jsonapp_diff_claims *claims, struct uci_section *s)
+{
+        return claims->slots[jsonapp_diff_claim_slot(claims, s)] == s;
+}
+
+static void jsonapp_diff_record_delete(struct jsonapp_parse_ctx *jctx, struct uci_package *pkg,
+                                       struct uci_section *s, struct uci_option *o)
+{
+        jsonapp_uci_record_change(jctx, pkg, s->e.name, s->type, o->e.name,
+                                  o->type == UCI_TYPE_STRING ? o->v.string : NULL, NULL);
+        return;
+}
+
+static bool jsonapp_diff_is_listed(struct jsonapp_diff_sect *sect, const char *option)
+{
+        struct jsonapp_diff_opt *opt;
+
+        for (opt = sect->options; opt; opt = opt->next) {
+                if (strcmp(opt->name, option) == 0)
+                        return true;
+        }
+        return false;
+}
+
+/* find or create the uci section for sect. returns the number of changes.
+ * sections are looked up in the package cache's index of pkg, which is
+ * kept until pkg is reloaded. */
+static int jsonapp_diff_resolve(struct jsonapp_parse_ctx *jctx,
+                                struct uci_package *pkg,
+                                struct jsonapp_diff_sect *sect)
+{
+        struct uci_context *ctx = pkg->ctx;
+        struct uci_ptr ptr;
+        bool retyped;
+
+        if (!sect->name) {
+                if ((sect->s = jsonapp_uci_lookup_anon(jctx, pkg, sect->type, sect->index)))
+                        return 0;
+                if (uci_add_section(ctx, pkg, sect->type, &sect->s) != UCI_OK)
+                        return -1;
+                jsonapp_uci_section_added(jctx, pkg, sect->s);
+                jsonapp_uci_record_change(jctx, pkg, sect->s->e.name, sect->type, NULL, NULL,
+                                          sect->type);
+                return 1;
+        }
+
+        sect->s = jsonapp_uci_lookup_section(jctx, pkg, sect->name);
+        if (sect->s && strcmp(sect->s->type, sect->type) == 0)
+                return 0;
+
+        jsonapp_uci_record_change(jctx, pkg, sect->name, sect->type, NULL,
+                                  sect->s ? sect->s->type : NULL, sect->type);
+        /* a section of another type is changed to this one */
+        if ((retyped = sect->s != NULL)) {
+                jsonapp_diff_ptr(&ptr, pkg, sect->s, NULL, NULL, sect->type);
+        } else {
+                memset(&ptr, 0, sizeof ptr);
+                ptr.p = pkg;
+                ptr.package = pkg->e.name;
+                ptr.section = sect->name;
+                ptr.value = sect->type;
+                ptr.last = &pkg->e;
+                ptr.flags = UCI_LOOKUP_DONE;
+        }
+        if (uci_set(ctx, &ptr) != UCI_OK || !ptr.s)
+                return -1;
+        sect->s = ptr.s;
+        if (retyped)
+                jsonapp_uci_sections_changed(jctx, pkg);
+        else
+                jsonapp_uci_section_added(jctx, pkg, sect->s);
+        return 1;
+}
+
+static int jsonapp_diff_apply_section(struct jsonapp_parse_ctx *jctx,
+                                      struct uci_package *pkg,
+                                      struct jsonapp_diff_sect *sect)
+{
+        struct uci_context *ctx = pkg->ctx;
+        struct jsonapp_diff_opt *opt;
+        struct uci_element *e;
+        struct uci_element *tmp;
+        struct uci_option *o;
+        struct uci_ptr ptr;
+        int changes;
+
+        if ((changes = jsonapp_diff_resolve(jctx, pkg, sect)) < 0)
+                return -1;
+
+        for (opt = sect->options; opt; opt = opt->next) {
+                o = uci_lookup_option(ctx, sect->s, opt->name);
+                if (o && o->type == UCI_TYPE_STRING && strcmp(o->v.string, opt->value) == 0)
+                        continue;
+                jsonapp_uci_record_change(jctx, pkg, sect->s->e.name, sect->type, opt->name,
+                                          o && o->type == UCI_TYPE_STRING ? o->v.string : NULL,
+                                          opt->value);
+                if (o && o->type != UCI_TYPE_STRING) {
+                        jsonapp_diff_ptr(&ptr, pkg, sect->s, o, opt->name, NULL);
+                        if (uci_delete(ctx, &ptr) != UCI_OK)
+                                return -1;
+                        o = NULL;
+                }
+                jsonapp_diff_ptr(&ptr, pkg, sect->s, o, opt->name, opt->value);
+                if (uci_set(ctx, &ptr) != UCI_OK)
+                        return -1;
+                changes++;
+        }
+
+        if (!sect->exclusive)
+                return changes;
+
+        uci_foreach_element_safe(&sect->s->options, tmp, e) {
+                if (jsonapp_diff_is_listed(sect, e->name))
+                        continue;
+                jsonapp_diff_record_delete(jctx, pkg, sect->s, uci_to_option(e));
+                jsonapp_diff_ptr(&ptr, pkg, sect->s, uci_to_option(e), e->name, NULL);
+                if (uci_delete(ctx, &ptr) != UCI_OK)
+                        return -1;
+                changes++;
+        }
+        return changes;
+}
+
+/* bring pkg in line with diff. returns the number of uci changes made (0 when
+ * the package already matches) or -1 on error. nothing is saved or committed
+ * here; that is left to the caller and only needed when changes > 0. */
+int jsonapp_diff_apply(struct jsonapp_parse_ctx *jctx, struct uci_package *pkg,
+                       struct jsonapp_diff *diff)
+{
+        struct jsonapp_diff_claims claims;
+        struct jsonapp_diff_sect *sect;
+        struct uci_element *e;
+        struct uci_element *tmp;
+        struct uci_element *o;
+        struct uci_ptr ptr;
+        int changes = 0;
+        int deleted = 0;
+        int n;
+
+        for (sect = diff->sections; sect; sect = sect->next) {
+                if ((n = jsonapp_diff_apply_section(jctx, pkg, sect)) < 0) {
+                        fprintf(stderr, "error applying %s.%s\n", pkg->e.name,
+                                sect->name ? sect->name : sect->type);
+                        return -1;
+                }
+                changes += n;
+        }
+
+        if (!diff->managed_type)
+                return changes;
+
+        jsonapp_diff_claims_init(&claims, diff);
+        uci_foreach_element_safe(&pkg->sections, tmp, e) {
+                struct uci_section *s = uci_to_section(e);
+                if (strcmp(s->type, diff->managed_type) != 0 || jsonapp_diff_is_claimed(&claims, s))
+                        continue;
+                uci_foreach_element(&s->options, o)
+                        jsonapp_diff_record_delete(jctx, pkg, s, uci_to_option(o));
+                jsonapp_uci_record_change(jctx, pkg, s->e.name, s->type, NULL, s->type, NULL);
+                jsonapp_diff_ptr(&ptr, pkg, s, NULL, NULL, NULL);
+                if (uci_delete(pkg->ctx, &ptr) != UCI_OK) {
+                        fprintf(stderr, "error deleting section: %s\n", e->name);
+                        changes = -1;
+                        break;
+                }
+                deleted++;
+        }
+        if (deleted)
+                jsonapp_uci_sections_changed(jctx, pkg);
+        return changes < 0 ? -1 : changes + deleted;
+}
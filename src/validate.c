@@ -0,0 +1,52 @@
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include "json-app.h"
+
+/* message validation.
+ *
+ * the mapping walk rejects a message whose mapped members are missing or of
+ * the wrong type before any backend sees it. what a type cannot express,
+ * lengths, names uci would refuse, duplicates, is left to a backend's
+ * validate() hook, which checks the values the walk found with
+ * jsonapp_check_string(). the first problem found is kept in
+ * jctx->error and the whole message is rejected without touching uci. */
+
+static pthread_mutex_t jsonapp_error_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* record why the current message is invalid. only the first error is kept,
+ * also when backends running side by side fail at once. always returns -1
+ * so validators can return its result directly. */
+int jsonapp_invalid(struct jsonapp_parse_ctx *jctx, const char *fmt, ...)
+{
+        va_list args;
+
+        pthread_mutex_lock(&jsonapp_error_lock);
+        if (!jctx->error[0]) {
+                va_start(args, fmt);
+                vsnprintf(jctx->error, sizeof jctx->error, fmt, args);
+                va_end(args);
+        }
+        pthread_mutex_unlock(&jsonapp_error_lock);
+        return -1;
+}
+
+/* str, found at where, as a string of at most max_len characters. with
+ * ident set it may only contain what uci accepts in a section name. */
+const char *jsonapp_check_string(struct jsonapp_parse_ctx *jctx, const char *str,
+                                 const char *where, int max_len, bool ident)
+{
+        int i;
+
+        if ((int)strlen(str) > max_len) {
+                jsonapp_invalid(jctx, "%s: longer than %d characters", where, max_len);
+                return NULL;
+        }
+        for (i = 0; ident && str[i]; i++) {
+                if (!isalnum((unsigned char)str[i]) && str[i] != '_') {
+                        jsonapp_invalid(jctx, "%s: \"%s\" is not a valid name", where, str);
+                        return NULL;
+                }
+        }
+        return str;
+}
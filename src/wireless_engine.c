@@ -1,186 +1,347 @@
 #include <json-c/json_object.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "json-app.h"
 
-struct uci_package *wireless_package;
+/* section names and ssids get a band suffix of up to 6 characters and have
+ * to fit in 64 bytes */
+#define WIRELESS_NAME_MAX (64 - 7)
 
-/* just remove all wifi-iface sections */
-static void reset_wireless_uci(struct jsonapp_parse_ctx *jctx)
-{
-        struct uci_element *e;
-        struct uci_element *tmp;
-        struct uci_ptr ptr;
-        char tuple[128];
-
-        if (uci_load(jctx->uci_ctx, "wireless", &wireless_package) != UCI_OK) {
-                jsonapp_die("error loading /etc/config/wireless");
-        }
-
-        uci_foreach_element_safe(&wireless_package->sections, tmp, e) {
-                struct uci_section *s = uci_to_section(e);
-                sprintf(tuple, "%s.%s", wireless_package->e.name, s->e.name);
-                if (uci_lookup_ptr(jctx->uci_ctx, &ptr, tuple, true) != UCI_OK) {
-                        jsonapp_die("error looking section: %s", s->e.name);
-                }
-
-                if (strcmp(ptr.s->type, "wifi-iface") != 0) {
-                        continue;
-                }
-               
-                //fprintf(stderr, "deleting section: %s.%s\n", wireless_package->e.name, s->e.name);
-                if (uci_delete(jctx->uci_ctx, &ptr) != UCI_OK) {
-                        jsonapp_die("error deleting section: %s", s->e.name);
-                }
-        }
+/* a wifi-iface for one radio of a wlan */
+struct wireless_iface {
+        int wlan;
+        bool five_ghz;
+        const char *name;               /* of the uci section */
+        int if_idx;                     /* ifname is wlan<if_idx> */
+};
 
-        return;
-}
+/* desired wireless state built from one message */
+struct wireless_desired {
+        struct jsonapp_arena *arena;
+        struct jsonapp_diff *diff;
+        struct wireless_iface *ifaces;
+        int nr_ifaces;
+};
 
 static struct jsonapp_parse_ctx *wireless_init_context(struct jsonapp_parse_ctx *jctx)
 {
         int has_config;
 
-        /* find /etc/config/wireless.
-         *
-         * if it exists, reset it by removing the current wifi-iface sections.
-         * we will replace all the wifi-iface sections using the input json file.
+        /* find /etc/config/wireless and keep it loaded. the wifi-iface
+         * sections are owned by jsonapp: on every message they are brought in
+         * line with the input json file and any other wifi-iface is removed.
          *
          * if it does not exist, stop further processing and just warn user that
          * wireless config does not exist.
          */
-        has_config = jsonapp_has_config(jctx, "wireless", reset_wireless_uci, false);
+        has_config = jsonapp_has_config(jctx, "wireless", NULL, false);
         if (!has_config) {
                 jsonapp_die("gross error: /etc/config/wireless does not exist!");
         }
+        if (!jsonapp_uci_package(jctx, "wireless"))
+                jsonapp_die("error loading /etc/config/wireless");
         return jctx;
 }
 
-static void wireless_exit_context(struct jsonapp_parse_ctx *jctx)
+/* the wlan members read for every wlan */
+enum {
+        WIRELESS_MAP_NAME,
+        WIRELESS_MAP_SSID,
+        WIRELESS_MAP_STATUS,
+        WIRELESS_MAP_PASSPHRASE,
+        WIRELESS_MAP_RADIOS,
+};
+
+static const struct jsonapp_map wireless_map[] = {
+        [WIRELESS_MAP_NAME]       = { "WlanGroup.wlans[*].wlanName", json_type_string },
+        [WIRELESS_MAP_SSID]       = { "WlanGroup.wlans[*].ssidName", json_type_string },
+        [WIRELESS_MAP_STATUS]     = { "WlanGroup.wlans[*].status", json_type_string },
+        [WIRELESS_MAP_PASSPHRASE] = { "WlanGroup.wlans[*].passphrase", json_type_string },
+        [WIRELESS_MAP_RADIOS]     = { "WlanGroup.wlans[*].radios", json_type_string },
+        { NULL }
+};
+
+static const char *const wireless_packages[] = { "wireless", NULL };
+
+static struct jsonapp_parse_backend wlan_parse_backend;
+
+static const char *wireless_value(struct jsonapp_parse_ctx *jctx, int entry, int wlan)
+{
+        return jsonapp_map_string(jctx, &wlan_parse_backend, entry, wlan);
+}
+
+/* the mapping plan has checked that every wlan has all members as strings */
+static int wireless_validate(struct jsonapp_parse_ctx *jctx, struct json_object *root)
 {
-        uci_unload(jctx->uci_ctx, wireless_package);
-        return;
+        struct jsonapp_arena *arena = jsonapp_arena(jctx, &wlan_parse_backend);
+        const char *name;
+        const char *where;
+        int n;
+        int i;
+        int j;
+
+        n = jsonapp_map_count(jctx, &wlan_parse_backend, WIRELESS_MAP_NAME);
+        for (i = 0; i < n; i++) {
+                name = wireless_value(jctx, WIRELESS_MAP_NAME, i);
+                where = jsonapp_arena_printf(arena, "WlanGroup.wlans[%d].wlanName", i);
+                if (!jsonapp_check_string(jctx, name, where, WIRELESS_NAME_MAX, true))
+                        return -1;
+                where = jsonapp_arena_printf(arena, "WlanGroup.wlans[%d].ssidName", i);
+                if (!jsonapp_check_string(jctx, wireless_value(jctx, WIRELESS_MAP_SSID, i),
+                                          where, WIRELESS_NAME_MAX, false))
+                        return -1;
+                /* the name becomes the uci section name */
+                for (j = 0; j < i; j++) {
+                        if (strcmp(wireless_value(jctx, WIRELESS_MAP_NAME, j), name) == 0)
+                                return jsonapp_invalid(jctx, "WlanGroup.wlans[%d].wlanName: "
+                                                       "\"%s\" used twice", i, name);
+                }
+        }
+        return 0;
 }
 
-static void wireless_new_iface(struct jsonapp_parse_ctx *jctx, 
-                               struct json_object *wlan_obj,
-                               bool five_ghz,
-                               struct uci_section **section)
+static void wireless_add_iface(struct jsonapp_parse_ctx *jctx, struct wireless_desired *desired,
+                               int wlan, bool five_ghz)
 {
-        struct json_object *obj;
-        struct uci_ptr sptr;
-        struct uci_ptr ptr;
-        char tuple[128];
-        char radio_name[64];
-        
-        memset(&sptr, 0, sizeof(sptr));
-        obj = jsonapp_object_get_object_by_name(wlan_obj, "wlanName", json_type_string);
-        sptr.package = wireless_package->e.name;
-        sptr.value = "wifi-iface";
-
-        sprintf(radio_name, "%s%s", json_object_get_string(obj), five_ghz ? "5GHz": "2_5GHz");
-        sptr.section = radio_name;
-        uci_set(jctx->uci_ctx, &sptr);
-        uci_save(jctx->uci_ctx, wireless_package);
-        sprintf(tuple, "%s.%s", sptr.package, sptr.section);
-        uci_lookup_ptr(jctx->uci_ctx, &ptr, tuple, true);
-        *section = ptr.s;
+        struct wireless_iface *iface = &desired->ifaces[desired->nr_ifaces++];
+
+        iface->wlan = wlan;
+        iface->five_ghz = five_ghz;
+        iface->name = jsonapp_arena_printf(desired->arena, "%s%s",
+                                           wireless_value(jctx, WIRELESS_MAP_NAME, wlan),
+                                           five_ghz ? "5GHz" : "2_5GHz");
+        iface->if_idx = -1;
         return;
 }
 
-static void wireless_set_ssid(struct jsonapp_parse_ctx *jctx,
-                              struct json_object *wlan_obj,
-                              struct uci_section *section,
-                              bool five_ghz)
+/* the index in an ifname of ours (wlan<n>), -1 for any other name */
+static int wireless_ifname_index(const char *ifname)
+{
+        int len = 0;
+        int idx;
+
+        if (!ifname || sscanf(ifname, "wlan%d%n", &idx, &len) != 1 || ifname[len] || idx < 0)
+                return -1;
+        return idx;
+}
+
+/* kept indices by index, then by message order */
+static int wireless_cmp_kept(const void *a, const void *b)
 {
-        struct uci_ptr optr;
-        struct json_object *member_obj;
-        char ssid[64];
-
-        memset(&optr, 0, sizeof(optr));
-        optr.package = wireless_package->e.name;
-        optr.section = section->e.name;
-        optr.option = "ssid";
-        member_obj = jsonapp_object_get_object_by_name(wlan_obj, "ssidName", json_type_string);
-        sprintf(ssid, "%s%s", json_object_get_string(member_obj),
-                five_ghz ? "5GHz" : "2_5GHz");
-        optr.value = ssid;
-        uci_set(jctx->uci_ctx, &optr);
+        const struct wireless_iface *x = *(struct wireless_iface *const *)a;
+        const struct wireless_iface *y = *(struct wireless_iface *const *)b;
+
+        if (x->if_idx != y->if_idx)
+                return x->if_idx < y->if_idx ? -1 : 1;
+        return x < y ? -1 : x > y;
 }
 
-static void wireless_create_new_iface_section(struct jsonapp_parse_ctx *jctx, 
-                                              struct json_object *wlan_obj,
-                                              bool five_ghz)
+/* give every interface an ifname that stays the same from one message to
+ * the next, so that adding, removing or reordering wlans does not rename,
+ * and so tear down, the interfaces of the others.
+ *
+ * the wireless config itself holds the names: an interface whose section
+ * is already there keeps its ifname, whatever its index. if two sections
+ * claim the same one, as they can after a hand edit, the first in message
+ * order keeps it. what is left gets the lowest index not in use, in
+ * message order, so the names of removed wlans are reused. */
+static void wireless_alloc_ifnames(struct jsonapp_parse_ctx *jctx, struct uci_package *pkg,
+                                   struct wireless_desired *desired)
 {
-        struct json_object *obj;
+        struct wireless_iface **kept;
+        struct wireless_iface *iface;
         struct uci_section *s;
-        char if_name[16];
-        static int if_idx = 0;
+        int nr_kept = 0;
+        int next = 0;
+        int i;
+        int k;
+
+        kept = jsonapp_arena_alloc(desired->arena, desired->nr_ifaces * sizeof *kept);
+        for (i = 0; i < desired->nr_ifaces; i++) {
+                iface = &desired->ifaces[i];
+                s = jsonapp_uci_lookup_section(jctx, pkg, iface->name);
+                if (!s || strcmp(s->type, "wifi-iface") != 0)
+                        continue;
+                iface->if_idx = wireless_ifname_index(uci_lookup_option_string(pkg->ctx, s,
+                                                                               "ifname"));
+                if (iface->if_idx >= 0)
+                        kept[nr_kept++] = iface;
+        }
+
+        qsort(kept, nr_kept, sizeof *kept, wireless_cmp_kept);
+        for (i = 1, k = 1; i < nr_kept; i++) {
+                if (kept[i]->if_idx == kept[k - 1]->if_idx)
+                        kept[i]->if_idx = -1;
+                else
+                        kept[k++] = kept[i];
+        }
+        nr_kept = nr_kept ? k : 0;
+
+        /* kept is now the indices in use, in order, each once */
+        for (i = 0, k = 0; i < desired->nr_ifaces; i++) {
+                iface = &desired->ifaces[i];
+                if (iface->if_idx >= 0)
+                        continue;
+                while (k < nr_kept && kept[k]->if_idx <= next) {
+                        if (kept[k]->if_idx == next)
+                                next++;
+                        k++;
+                }
+                iface->if_idx = next++;
+        }
+        return;
+}
+
+static void wireless_create_new_iface_section(struct jsonapp_parse_ctx *jctx,
+                                              struct wireless_desired *desired,
+                                              struct wireless_iface *iface)
+{
+        struct jsonapp_diff_sect *s;
+        const char *band = iface->five_ghz ? "5GHz" : "2_5GHz";
+        const char *ssid;
+        const char *if_name;
 
-        wireless_new_iface(jctx, wlan_obj, five_ghz, &s);
+        s = jsonapp_diff_section(desired->diff, iface->name, "wifi-iface");
 
-        jsonapp_set_new_option(jctx, wlan_obj, "device", 0,
-                               wireless_package, s, "device", 
-                               five_ghz ? "radio0" : "radio1");
+        jsonapp_diff_option(s, "device", iface->five_ghz ? "radio0" : "radio1");
 
-        sprintf(if_name, "wlan%d", if_idx++);
-        jsonapp_set_new_option(jctx, wlan_obj, NULL, 0,
-                        wireless_package, s, "ifname", if_name);
-        jsonapp_set_new_option(jctx, wlan_obj, NULL, 0,
-                               wireless_package, s, "network", "lan");
-        jsonapp_set_new_option(jctx, wlan_obj, NULL, 0,
-                               wireless_package, s, "mode", "ap");
+        if_name = jsonapp_arena_printf(desired->arena, "wlan%d", iface->if_idx);
+        jsonapp_diff_option(s, "ifname", if_name);
+        jsonapp_diff_option(s, "network", "lan");
+        jsonapp_diff_option(s, "mode", "ap");
 
-        wireless_set_ssid(jctx, wlan_obj, s, five_ghz);
+        ssid = jsonapp_arena_printf(desired->arena, "%s%s",
+                                    wireless_value(jctx, WIRELESS_MAP_SSID, iface->wlan), band);
+        jsonapp_diff_option(s, "ssid", ssid);
 
         /* status is handled a bit differently */
-        obj = jsonapp_object_get_object_by_name(wlan_obj, "status", json_type_string);
-        char *disabled = json_object_get_string(obj) ? "0" : "1";
-        jsonapp_set_new_option(jctx, wlan_obj, "status", 0, 
-                               wireless_package, s, "disabled", disabled);
-        //jsonapp_set_new_option(jctx, wlan_obj, "security", json_type_string,
-        //                       wireless_package, s, "encryption", NULL);
-        jsonapp_set_new_option(jctx, wlan_obj, "security", json_type_string,
-                               wireless_package, s, "encryption", "none");
-        jsonapp_set_new_option(jctx, wlan_obj, "passphrase", json_type_string, 
-                               wireless_package, s, "key", NULL);
-        uci_save(jctx->uci_ctx, wireless_package);
+        jsonapp_diff_option(s, "disabled",
+                            wireless_value(jctx, WIRELESS_MAP_STATUS, iface->wlan) ? "0" : "1");
+        jsonapp_diff_option(s, "encryption", "none");
+        jsonapp_diff_option(s, "key", wireless_value(jctx, WIRELESS_MAP_PASSPHRASE, iface->wlan));
         return;
 }
 
-static void wireless_process_wlan_obj (struct jsonapp_parse_ctx *jctx,
-                                       struct json_object *wlan_obj,
-                                       void *user_data)
+static int wireless_process_json(struct jsonapp_parse_ctx *jctx, struct json_object *root)
 {
+        struct uci_package *wireless_package;
+        struct wireless_desired desired;
         const char *radio_str;
-        struct json_object *obj;
-        int create_radio0;
-        int create_radio1;
-        
-        obj = jsonapp_object_get_object_by_name(wlan_obj, "radios", json_type_string);
-        radio_str = json_object_get_string(obj);
-        create_radio0 = strstr(radio_str, "5 GHz") ? 1 : 0;
-        create_radio1 = strstr(radio_str, "2.5 GHz") ? 1 : 0;
-        if (create_radio0)
-                wireless_create_new_iface_section(jctx, wlan_obj, true);
-        if (create_radio1)
-                wireless_create_new_iface_section(jctx, wlan_obj, false);
+        int changes;
+        int n;
+        int i;
+
+        if (!(wireless_package = jsonapp_uci_package(jctx, "wireless")))
+                return -1;
+
+        n = jsonapp_map_count(jctx, &wlan_parse_backend, WIRELESS_MAP_NAME);
+        desired.arena = jsonapp_arena(jctx, &wlan_parse_backend);
+        desired.diff = jsonapp_diff_new(desired.arena, "wifi-iface");
+        /* at most one interface per radio */
+        desired.ifaces = jsonapp_arena_alloc(desired.arena, 2 * n * sizeof *desired.ifaces);
+        desired.nr_ifaces = 0;
+        for (i = 0; i < n; i++) {
+                radio_str = wireless_value(jctx, WIRELESS_MAP_RADIOS, i);
+                if (strstr(radio_str, "5 GHz"))
+                        wireless_add_iface(jctx, &desired, i, true);
+                if (strstr(radio_str, "2.5 GHz"))
+                        wireless_add_iface(jctx, &desired, i, false);
+        }
+
+        wireless_alloc_ifnames(jctx, wireless_package, &desired);
+        for (i = 0; i < desired.nr_ifaces; i++)
+                wireless_create_new_iface_section(jctx, &desired, &desired.ifaces[i]);
+
+        changes = jsonapp_diff_apply(jctx, wireless_package, desired.diff);
+        if (changes > 0)
+                jsonapp_uci_stage(jctx, wireless_package);
+        return changes;
+}
+
+/* radio is one of the nr_radios in radios, or added to them */
+static void wireless_add_radio(const char **radios, int *nr_radios, const char *radio)
+{
+        int i;
+
+        if (!radio)
+                return;
+        for (i = 0; i < *nr_radios; i++) {
+                if (strcmp(radios[i], radio) == 0)
+                        return;
+        }
+        radios[(*nr_radios)++] = radio;
         return;
 }
 
-static int wireless_process_json(struct jsonapp_parse_ctx *jctx, struct json_object *root)
+/* bring up again only the radios with a wifi-iface that changed; the
+ * clients of the other radios stay connected. the radio of an interface is
+ * what its device option was before and after the change, and what the
+ * committed config says for the interfaces whose device did not change.
+ * the config is read with a uci context of our own, as the cached packages
+ * belong to the apply worker. */
+static int wireless_reload(struct jsonapp_parse_ctx *jctx, struct jsonapp_change **changes,
+                           int nr)
 {
-        struct json_object *obj;
-        obj = jsonapp_get_wlans(jsonapp_get_wlangrp(root));
-        jsonapp_process_array(jctx, obj, NULL, wireless_process_wlan_obj);
-        uci_commit(jctx->uci_ctx, &wireless_package, true);       
-        return 0;
+        struct uci_package *pkg = NULL;
+        struct uci_context *ctx;
+        struct uci_section *s;
+        const char *prev = NULL;
+        const char **radios;
+        char *argv[4];
+        int nr_radios = 0;
+        int err = 0;
+        int i;
+
+        /* every change can name two radios, and the config one more */
+        if (!(radios = calloc(3 * nr, sizeof *radios)))
+                jsonapp_die("insufficient memory for wireless reload");
+        if (!(ctx = uci_alloc_context()))
+                jsonapp_die("insufficient memory for uci context");
+        uci_set_confdir(ctx, jctx->uci_ctx->confdir);
+        if (uci_load(ctx, "wireless", &pkg) != UCI_OK)
+                pkg = NULL;
+
+        for (i = 0; i < nr; i++) {
+                if (strcmp(changes[i]->type, "wifi-iface") != 0)
+                        continue;
+                if (changes[i]->option && strcmp(changes[i]->option, "device") == 0) {
+                        wireless_add_radio(radios, &nr_radios, changes[i]->old);
+                        wireless_add_radio(radios, &nr_radios, changes[i]->value);
+                }
+                /* the changes to a section come one after the other */
+                if (prev && strcmp(prev, changes[i]->section) == 0)
+                        continue;
+                prev = changes[i]->section;
+                if (pkg && (s = uci_lookup_section(ctx, pkg, prev)))
+                        wireless_add_radio(radios, &nr_radios,
+                                           uci_lookup_option_string(ctx, s, "device"));
+        }
+
+        argv[0] = "wifi";
+        argv[1] = "up";
+        argv[3] = NULL;
+        for (i = 0; i < nr_radios; i++) {
+                argv[2] = (char *)radios[i];
+                if (jsonapp_reload_run(argv) != 0)
+                        err = -1;
+        }
+        /* the radio names point into the package */
+        if (pkg)
+                uci_unload(ctx, pkg);
+        uci_free_context(ctx);
+        free(radios);
+        return err;
 }
 
 static struct jsonapp_parse_backend wlan_parse_backend = {
+        .name = "wireless",
         .init = wireless_init_context,
+        .map = wireless_map,
+        .packages = wireless_packages,
+        .validate = wireless_validate,
         .process_json = wireless_process_json,
-        .exit = wireless_exit_context,
+        .reload = wireless_reload,
 };
 
 static void __jsonapp_init__ wlan_engine_init(void)